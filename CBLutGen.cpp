@@ -8,18 +8,87 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#include "CBLutGen.h"
 #include "CBLuts.h"
 
 #include "ColourMaps.h"
 
+#include <stddef.h>
+
+namespace
+{
+    // Image-sized buffers are recycled via cBufferPool, including those the
+    // decoders and encoders allocate
+    void* PoolAlloc  (size_t size);
+    void* PoolRealloc(void* p, size_t size);
+    void  PoolFree   (void* p);
+}
+
+#define STBI_MALLOC(size)       PoolAlloc(size)
+#define STBI_REALLOC(p, size)   PoolRealloc(p, size)
+#define STBI_FREE(p)            PoolFree(p)
+#define STBIW_MALLOC(size)      PoolAlloc(size)
+#define STBIW_REALLOC(p, size)  PoolRealloc(p, size)
+#define STBIW_FREE(p)           PoolFree(p)
+#define QOI_MALLOC(size)        PoolAlloc(size)
+#define QOI_FREE(p)             PoolFree(p)
+
 #include "stb_image_mini.h"
+#include "qoi_mini.h"
+#include "y4m_mini.h"
 
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
+#include <time.h>
 #include <assert.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
 #ifdef _MSC_VER
+    #include <direct.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <io.h>
+
     #define strlcpy(d, s, ds) strcpy_s(d, ds, s)
+#else
+    #include <dirent.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <glob.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_IO_URING 1
+    #endif
+#endif
+
+#ifdef HAVE_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/eventfd.h>
+    #include <sys/syscall.h>
 #endif
 
 using namespace CBLut;
@@ -59,12 +128,6 @@ namespace
         return lmsSim - lms;
     }
 
-    Vec3f RGBError(Vec3f c, tLMS lmsType, float strength)
-    {
-        Vec3f sc = Simulate(c, lmsType, strength); 
-        return c - sc;
-    }
-    
     Vec3f LMSSwap(Vec3f rgb, tLMS ch)
     {
         Vec3f lms = kLMSFromRGB * rgb;
@@ -113,7 +176,7 @@ namespace
         return kRGBFromLMS * lmsS;
     }
 
-    template<class T> void CreateLUT(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
+    template<class T, class E> void CreateLUT(T xform, E rgbLUT[kLUTSize][kLUTSize][kLUTSize], E (*encode)(Vec3f), Vec3f (*decode)(RGBA32) = FromRGBA32u)
     {
         constexpr int scale  = 256 / kLUTSize;
         constexpr int offset = scale / 2;
@@ -125,11 +188,32 @@ namespace
             // Vec3f c{ (k + 0.5f) / kLUTSize, (j + 0.5f) / kLUTSize, (i + 0.5f) / kLUTSize };
             RGBA32 identity = { uint8_t(k * scale + offset), uint8_t(j * scale + offset), uint8_t(i * scale + offset), 255 };
 
-            Vec3f c = FromRGBA32u(identity);
+            Vec3f c = decode(identity);
 
             c = xform(c);
 
-            rgbLUT[i][j][k] = ToRGBA32u(c);
+            rgbLUT[i][j][k] = encode(c);
+        }
+    }
+
+    template<class T> void CreateLUT(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
+    {
+        CreateLUT(xform, rgbLUT, ToRGBA32u);
+    }
+
+    template<class T> void CreateShapedLUT(T xform, RGBA32 rgbLUT[kShapedLUTSize][kShapedLUTSize][kShapedLUTSize], float power = kShaperPower)
+    {
+        constexpr float scale = 1.0f / (kShapedLUTSize - 1);    // shaped cube samples include both endpoints
+
+        for (int i = 0; i < kShapedLUTSize; i++)
+        for (int j = 0; j < kShapedLUTSize; j++)
+        for (int k = 0; k < kShapedLUTSize; k++)
+        {
+            Vec3f c = FromShaped({ k * scale, j * scale, i * scale }, power);
+
+            c = xform(c);
+
+            rgbLUT[i][j][k] = ToRGBA32(c);
         }
     }
 
@@ -145,12 +229,159 @@ namespace
         }
     }
 
-    template<class T> inline void PerformOp(T xform, RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    enum tApplyMode
     {
-        if (dataOut)
+        kApplyLUT,          ///< Create 32^3 LUT, and apply it to any source image
+        kApplyShapedLUT,    ///< Create shaped 16^3 LUT, and apply it to any source image
+        kApplyDirect,       ///< Directly transform source image
+        kApplyFixed,        ///< Directly transform source image using the fixed-point path
+        kApplyDecodeLUT,    ///< Create 32^3 LUT, and apply it to each scanline as a JPEG source is decoded
+        kApplyDecodeYCbCrLUT,   ///< As above, but with the LUT indexed by YCbCr, replacing the decoder's colour conversion
+        kApplyVideoLUT,         ///< Create 32^3 LUT indexed by and producing limited-range YCbCr, and apply it to Y4M frames
+        kApplyVideoFullLUT,     ///< As above, for full-range YCbCr
+    };
+
+    struct cLUTs
+    {
+        RGBA32 rgba  [kLUTSize][kLUTSize][kLUTSize];
+        RGBA32 shaped[kShapedLUTSize][kShapedLUTSize][kShapedLUTSize];
+        RGBA32 ycc   [kLUTSize][kLUTSize][kLUTSize];
+        RGBA32 video [kLUTSize][kLUTSize][kLUTSize];    // YCbCr -> YCbCr
+    };
+
+    // Op functors specialised on type and full strength, for PerformOpLMS
+    template<tLMS kType, bool kFull> struct cSimulateOp  { float strength; Vec3f operator()(Vec3f c) const { return Simulate <kType, kFull>(c, strength); } };
+    template<tLMS kType, bool kFull> struct cDaltoniseOp { float strength; Vec3f operator()(Vec3f c) const { return Daltonise<kType, kFull>(c, strength); } };
+    template<tLMS kType, bool kFull> struct cCorrectOp   { float strength; Vec3f operator()(Vec3f c) const { return Correct  <kType, kFull>(c, strength); } };
+    template<tLMS kType, bool kFull> struct cErrorOp     { float strength; Vec3f operator()(Vec3f c) const { return c - Simulate<kType, kFull>(c, strength); } };
+
+    // Dispatch once to the PerformOp instantiation for lmsType and strength
+    template<template<tLMS, bool> class tOp> void PerformOpLMS(tLMS lmsType, float strength, tApplyMode mode, cLUTs* luts, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const bool full = strength == 1.0f;
+
+        switch (lmsType)
+        {
+        case kL:
+            full ? PerformOp(tOp<kL, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp<kL, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        case kM:
+            full ? PerformOp(tOp<kM, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp<kM, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        case kS:
+            full ? PerformOp(tOp<kS, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp<kS, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        }
+    }
+
+    // As above, for tOp2(clamp(tOp1(c)))
+    template<template<tLMS, bool> class tOp1, template<tLMS, bool> class tOp2> void PerformOpLMS(tLMS lmsType, float strength, tApplyMode mode, cLUTs* luts, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        const bool full = strength == 1.0f;
+
+        switch (lmsType)
+        {
+        case kL:
+            full ? PerformOp(tOp1<kL, true>{ strength }, tOp2<kL, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp1<kL, false>{ strength }, tOp2<kL, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        case kM:
+            full ? PerformOp(tOp1<kM, true>{ strength }, tOp2<kM, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp1<kM, false>{ strength }, tOp2<kM, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        case kS:
+            full ? PerformOp(tOp1<kS, true>{ strength }, tOp2<kS, true>{ strength }, mode, luts, n, dataIn, dataOut) : PerformOp(tOp1<kS, false>{ strength }, tOp2<kS, false>{ strength }, mode, luts, n, dataIn, dataOut);
+            break;
+        }
+    }
+
+    // A standard LUT converted to the given memory layout, for applying repeatedly
+    struct cLayoutLUT
+    {
+        tLUTLayout    layout;
+        const RGBA32 (*rgbLUT)[kLUTSize][kLUTSize];
+        RGBA32*       mortonLUT = 0;
+        RGBA32      (*brickLUT)[8] = 0;
+
+        cLayoutLUT(const RGBA32 rgbLUTIn[kLUTSize][kLUTSize][kLUTSize], tLUTLayout layoutIn) : layout(layoutIn), rgbLUT(rgbLUTIn)
+        {
+            if (layout == kLayoutMorton)
+            {
+                mortonLUT = new RGBA32[kLUTEntries];
+                ConvertLUTToMorton(rgbLUT, mortonLUT);
+            }
+            else if (layout == kLayoutBricked)
+            {
+                brickLUT = new RGBA32[kLUTCells][8];
+                ConvertLUTToBricked(rgbLUT, brickLUT);
+            }
+        }
+
+        ~cLayoutLUT()
+        {
+            delete[] mortonLUT;
+            delete[] brickLUT;
+        }
+
+        cLayoutLUT(const cLayoutLUT&) = delete;
+        cLayoutLUT& operator=(const cLayoutLUT&) = delete;
+
+        void Apply(int n, const RGBA32 dataIn[], RGBA32 dataOut[]) const
+        {
+            switch (layout)
+            {
+            case kLayoutLinear:
+                ApplyLUT(rgbLUT, n, dataIn, dataOut);
+                break;
+            case kLayoutMorton:
+                ApplyLUTMorton(mortonLUT, n, dataIn, dataOut);
+                break;
+            case kLayoutBricked:
+                ApplyLUTBricked(brickLUT, n, dataIn, dataOut);
+                break;
+            }
+        }
+    };
+
+    // Returns fixed-point equivalent of 'xform', which must be linear in linear RGB
+    template<class T> FixedXform CreateFixedXform(T xform)
+    {
+        Vec3f c0 = xform({ 1, 0, 0 });
+        Vec3f c1 = xform({ 0, 1, 0 });
+        Vec3f c2 = xform({ 0, 0, 1 });
+
+        return ToFixedXform({ { c0.x, c1.x, c2.x }, { c0.y, c1.y, c2.y }, { c0.z, c1.z, c2.z } });
+    }
+
+    template<class T> inline void PerformOp(T xform, tApplyMode mode, cLUTs* luts, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        if (dataOut && mode == kApplyFixed)
+            ApplyFixed(CreateFixedXform(xform), n, dataIn, dataOut);
+        else if (dataOut)
             Transform(xform, n, dataIn, dataOut);
+        else if (mode == kApplyShapedLUT)
+            CreateShapedLUT(xform, luts->shaped);
+        else if (mode == kApplyVideoLUT)
+            CreateLUT(xform, luts->video, ToYCbCrLimitedu, FromYCbCrLimitedu);
+        else if (mode == kApplyVideoFullLUT)
+            CreateLUT(xform, luts->video, ToYCbCru, FromYCbCru);
+        else
+        {
+            CreateLUT(xform, luts->rgba);
+
+            if (mode == kApplyDecodeYCbCrLUT)
+                CreateLUT(xform, luts->ycc, ToRGBA32u, FromYCbCru);
+        }
+    }
+
+    // Perform xform2(clamp(xform1(c)))
+    template<class T1, class T2> inline void PerformOp(T1 xform1, T2 xform2, tApplyMode mode, cLUTs* luts, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+    {
+        if (dataOut && mode == kApplyFixed)
+        {
+            const FixedXform xforms[2] = { CreateFixedXform(xform1), CreateFixedXform(xform2) };
+            ApplyFixed(xforms, 2, n, dataIn, dataOut);
+        }
         else
-            CreateLUT(xform, rgbLUT);
+            PerformOp([xform1, xform2](Vec3f c) { return xform2(ClampUnit(xform1(c))); }, mode, luts, n, dataIn, dataOut);
     }
 }
 
@@ -169,6 +400,9 @@ namespace
         kAll,
     };
 
+    const char* kCBTypeNames[] = { "identity", "protanope", "deuteranope", "tritanope" };
+    const tLMS  kCBTypeLMS  [] = { kL,         kL,          kM,            kS          };
+
     enum tImageOp 
     {
         kSimulate,
@@ -180,180 +414,4265 @@ namespace
         kPassThrough,
     };
 
-    void CreateImage(tImageOp op, tCBType cbType, float strength, int w, int h, const RGBA32* dataIn, const char* dataInName, bool noLUT)
+    // Box-filter the image down to w x h from sw x sh. Result is from the buffer pool, like stbi's.
+    RGBA32* DownscaleImage(const RGBA32* dataIn, int sw, int sh, int w, int h)
     {
-        if (cbType == kAll)
+        RGBA32* dataOut = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+        if (!dataOut)
+            return 0;
+
+        RGBA32* p = dataOut;
+
+        for (int y = 0; y < h; y++)
         {
-            CreateImage(op, kProtanope,   strength, w, h, dataIn, dataInName, noLUT);
-            CreateImage(op, kDeuteranope, strength, w, h, dataIn, dataInName, noLUT);
-            CreateImage(op, kTritanope,   strength, w, h, dataIn, dataInName, noLUT);
-            return;
+            int y0 = int(int64_t(y) * sh / h);
+            int y1 = std::max(int(int64_t(y + 1) * sh / h), y0 + 1);
+
+            for (int x = 0; x < w; x++)
+            {
+                int x0 = int(int64_t(x) * sw / w);
+                int x1 = std::max(int(int64_t(x + 1) * sw / w), x0 + 1);
+
+                uint32_t sum[4] = { 0 };
+
+                for (int sy = y0; sy < y1; sy++)
+                {
+                    const uint8_t* row = (const uint8_t*) (dataIn + size_t(sy) * sw);
+
+                    for (int sx = x0; sx < x1; sx++)
+                        for (int c = 0; c < 4; c++)
+                            sum[c] += row[sx * 4 + c];
+                }
+
+                uint32_t count = (x1 - x0) * (y1 - y0);
+                uint8_t* out = (uint8_t*) p++;
+
+                for (int c = 0; c < 4; c++)
+                    out[c] = uint8_t((sum[c] + count / 2) / count);
+            }
+        }
+
+        return dataOut;
+    }
+
+    // Image I/O. Input format is detected from the file contents, output
+    // format is set by -o.
+    enum tImageFormat
+    {
+        kFormatPNG,
+        kFormatQOI,
+        kNumImageFormats
+    };
+
+    const char* kImageFormatNames[kNumImageFormats] = { "png", "qoi" };
+
+    tImageFormat sOutputFormat = kFormatPNG;
+    bool sIndexedOutput = false;        // write PNGs with few enough colours as paletted, set by -I
+    bool sParallelJPEG = false;         // decode each JPEG on multiple threads, set by -P
+    int  sBandRows = 0;                 // if non-zero, stream images through in bands of this many rows, set by --band
+    int  sFrameWidth = 0;               // if non-zero, stream raw frames of this size from stdin to stdout, set by --frames
+    int  sFrameHeight = 0;
+    int  sFrameComp = 4;                // bytes per pixel of raw frames, 4 for rgba or 3 for rgb24
+    bool sFrameY4M = false;             // if set, frames are Y4M rather than raw, as described by sFrameY4MInfo
+    y4m_info sFrameY4MInfo;
+    int  sFrameTileSize = 0;            // if non-zero, only transform tiles of this size that differ from the previous frame, set by --tile-diff
+
+    enum tBatchStage
+    {
+        kStageDecode,
+        kStageTransform,
+        kStageEncode,
+        kNumBatchStages
+    };
+
+    int  sBatchStageThreads[kNumBatchStages] = {};  // if set, run --batch as a pipeline with this many threads per stage, set by --stages
+    int  sReportSheetWidth = 0;                     // if non-zero, --report also writes contact sheets with images this wide, set by --sheet
+    int  sReportDisplayWidth = 256;                 // width of --report images in the markdown, set by --display-width
+
+    // A pool of large buffers, for decoded images, transform results, and
+    // encoder output. Rather than being returned to the system, freed buffers
+    // are kept by size class, so the next image of a similar size reuses
+    // memory that's already mapped, instead of faulting in fresh pages and
+    // zero-filling them. Each class is 1/4 of a power of two larger than the
+    // last, so at most 20% of a buffer is wasted, and a realloc that stays
+    // within the class, as when stb grows its output, doesn't need to copy.
+    // Small allocations go straight to malloc.
+    class cBufferPool
+    {
+    public:
+        ~cBufferPool();
+
+        void* Alloc  (size_t size);
+        void* Realloc(void* p, size_t size);
+        void  Free   (void* p);
+
+        size_t  mLimit = size_t(64) << 20; // most free memory to hold on to, set by --pool-mb. Enough to cycle the buffers of a few-megapixel image.
+
+        int64_t mNumAllocs = 0;             // counts of pooled allocations, and those satisfied by reuse
+        int64_t mNumReused = 0;
+
+    protected:
+        struct alignas(16) cHeader
+        {
+            size_t size;        // as requested
+            int    sizeClass;   // or -1 if not pooled
         };
 
-        tLMS lmsType = kL;
-        char filename[256] = "";
+        enum { kMinClass = 4 * 16, kNumClasses = 4 * 48 };    // 64KB and up
 
-        if (dataIn)
-            snprintf(filename, sizeof(filename), "%s_", dataInName);
+        static size_t ClassSize(int sizeClass) { return (size_t(4) + (sizeClass & 3)) << (sizeClass / 4 - 2); }
+        static int    SizeClass(size_t size);
+
+        std::mutex              mMutex;
+        std::vector<cHeader*>   mFree[kNumClasses];
+        size_t                  mFreeSize = 0;
+    };
+
+    cBufferPool::~cBufferPool()
+    {
+        for (std::vector<cHeader*>& blocks : mFree)
+            for (cHeader* header : blocks)
+                free(header);
+    }
+
+    // Returns the smallest class that can hold 'size', or -1 if it's too small to pool
+    int cBufferPool::SizeClass(size_t size)
+    {
+        if (size <= ClassSize(kMinClass - 1))
+            return -1;
+
+        int bits = 0;
+
+        while ((size_t(2) << bits) <= size)
+            bits++;
+
+        int sizeClass = 4 * bits;
+
+        while (ClassSize(sizeClass) < size)
+            sizeClass++;
 
-        switch (cbType)
+        return sizeClass < kNumClasses ? sizeClass : -1;
+    }
+
+    void* cBufferPool::Alloc(size_t size)
+    {
+        int sizeClass = SizeClass(size);
+        cHeader* header = 0;
+
+        if (sizeClass >= 0)
         {
-        case kIdentity:
-            strcat(filename, "identity");
-            break;
-        case kProtanope:
-            strcat(filename, "protanope");
-            lmsType = kL;
-            break;
-        case kDeuteranope:
-            strcat(filename, "deuteranope");
-            lmsType = kM;
-            break;
-        case kTritanope:
-            strcat(filename, "tritanope");
-            lmsType = kS;
-            break;
-        default:
-            return;
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            mNumAllocs++;
+
+            if (!mFree[sizeClass].empty())
+            {
+                header = mFree[sizeClass].back();
+                mFree[sizeClass].pop_back();
+                mFreeSize -= ClassSize(sizeClass);
+                mNumReused++;
+            }
         }
 
-        RGBA32 rgbaLUT[kLUTSize][kLUTSize][kLUTSize];
-        RGBA32* dataOut = 0;
-        int n = w * h;
-        
-        if (noLUT && dataIn) 
-            dataOut = new RGBA32[n];
-        
-        switch (op)
+        if (!header)
+            header = (cHeader*) malloc(sizeof(cHeader) + (sizeClass >= 0 ? ClassSize(sizeClass) : size));
+
+        if (!header)
+            return 0;
+
+        header->size = size;
+        header->sizeClass = sizeClass;
+
+        return header + 1;
+    }
+
+    void* cBufferPool::Realloc(void* p, size_t size)
+    {
+        if (!p)
+            return Alloc(size);
+
+        cHeader* header = (cHeader*) p - 1;
+
+        if (header->sizeClass >= 0 && size <= ClassSize(header->sizeClass) && SizeClass(size) >= header->sizeClass - 4)
         {
-        case kSimulate:
-            PerformOp([lmsType, strength](Vec3f c){ return Simulate(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate");
-            break;
-        case kError:
-            PerformOp([lmsType, strength](Vec3f c){ return RGBError(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_error");
-            break;
-        case kDaltonise:
-            PerformOp([lmsType, strength](Vec3f c) { return Daltonise(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_daltonise");
-            break;
-        case kCorrect:
-            PerformOp([lmsType, strength](Vec3f c) { return Correct(c, lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_correct");
-            break;
-        case kDaltoniseSimulate:
-            PerformOp([lmsType, strength](Vec3f c) { return Simulate(ClampUnit(Daltonise(c, lmsType, strength)), lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate_daltonised");
-            break;
-        case kCorrectSimulate:
-            PerformOp([lmsType, strength](Vec3f c) { return Simulate(ClampUnit(Correct(c, lmsType, strength)), lmsType, strength); }, rgbaLUT, n, dataIn, dataOut);
-            strcat(filename, "_simulate_corrected");
-            break;
-        case kPassThrough:
-            if (dataOut)
-                PerformOp([](Vec3f c) { return c; }, rgbaLUT, n, dataIn, dataOut);
-            else
-                CreateIdentityLUT(rgbaLUT);
-            break;
-        };
+            header->size = size;
+            return p;
+        }
 
-        if (dataIn && !dataOut)
+        void* result = Alloc(size);
+
+        if (result)
+        {
+            memcpy(result, p, std::min(size, header->size));
+            Free(p);
+        }
+
+        return result;
+    }
+
+    void cBufferPool::Free(void* p)
+    {
+        if (!p)
+            return;
+
+        cHeader* header = (cHeader*) p - 1;
+
+        if (header->sizeClass >= 0)
         {
-            dataOut = new RGBA32[n];
+            std::lock_guard<std::mutex> lock(mMutex);
+            size_t classSize = ClassSize(header->sizeClass);
 
-            ApplyLUT(rgbaLUT, n, dataIn, dataOut);
+            if (mFreeSize + classSize <= mLimit)
+            {
+                mFree[header->sizeClass].push_back(header);
+                mFreeSize += classSize;
+                return;
+            }
         }
 
-        if (dataOut)
+        free(header);
+    }
+
+    cBufferPool sBufferPool;
+
+    void* PoolAlloc  (size_t size)          { return sBufferPool.Alloc(size); }
+    void* PoolRealloc(void* p, size_t size) { return sBufferPool.Realloc(p, size); }
+    void  PoolFree   (void* p)              { sBufferPool.Free(p); }
+
+    // Report page faults and peak RSS so far, and how often the buffer pool was able to help
+    void PrintMemoryStats()
+    {
+    #ifndef _MSC_VER
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+    #ifdef __APPLE__
+        double peakMB = usage.ru_maxrss / (1024.0 * 1024.0);   // in bytes rather than KB
+    #else
+        double peakMB = usage.ru_maxrss / 1024.0;
+    #endif
+
+        printf("%ld minor and %ld major page faults, peak RSS %.1f MB, ", long(usage.ru_minflt), long(usage.ru_majflt), peakMB);
+    #endif
+        printf("%lld of %lld pooled buffers reused\n", (long long) sBufferPool.mNumReused, (long long) sBufferPool.mNumAllocs);
+    }
+
+    // Returns the contents of the given file, from the buffer pool, or 0 if it can't be read
+    uint8_t* ReadFile(const char* path, size_t* size)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return 0;
+
+        size_t capacity = 65536;
+        uint8_t* data = (uint8_t*) PoolAlloc(capacity);
+        size_t bytesRead;
+
+        *size = 0;
+
+        while (data && (bytesRead = fread(data + *size, 1, capacity - *size, file)) > 0)
         {
-            strcat(filename, ".png");
-            printf("Saving %s\n", filename);
-            stbi_write_png(filename, w, h, 4, dataOut, 0);
+            *size += bytesRead;
+
+            if (*size == capacity)
+            {
+                uint8_t* grown = (uint8_t*) PoolRealloc(data, capacity *= 2);
 
-            delete[] dataOut;
+                if (!grown)
+                    PoolFree(data);
+                data = grown;
+            }
         }
-        else
+
+        fclose(file);
+        return data;
+    }
+
+    // Writes 'data' to the given file, and frees it
+    bool WriteFile(const char* path, uint8_t* data, size_t size)
+    {
+        FILE* file = fopen(path, "wb");
+        bool success = file && fwrite(data, 1, size, file) == size;
+
+        if (file && fclose(file) != 0)
+            success = false;
+        if (!success)
+            fprintf(stderr, "Couldn't write %s\n", path);
+
+        PoolFree(data);
+        return success;
+    }
+
+    // Whole-file reads and writes for --batch. On Linux these go through an
+    // io_uring, serviced by a single I/O thread, so that many are in flight at
+    // once and the device sees a deep queue: reads are issued ahead of when
+    // they're needed, in order, and writes are queued up and completed in the
+    // background. Elsewhere, or if the kernel doesn't support io_uring, the
+    // calling thread simply does blocking I/O, as it does from then on if the
+    // ring fails part way through.
+    class cAsyncIO
+    {
+    public:
+        cAsyncIO(const std::vector<std::string>& paths, int depth);
+        ~cAsyncIO();   // waits for all writes to finish
+
+        bool IsAsync() const { return mRing.fd >= 0; }   // requested async I/O, whether or not the ring later failed
+
+        // Returns the contents of paths[index], from the buffer pool, or 0 if it can't be read. Call once per index.
+        uint8_t* Read(int index, size_t* size);
+
+        // Writes 'data' to 'path', and then returns it to the pool. May block until there's room in the queue.
+        void Write(const char* path, uint8_t* data, size_t size);
+
+    protected:
+        enum tState { kQueued, kInFlight, kReady, kFailed, kTaken };
+
+        struct cRequest
+        {
+            std::string path;
+            int         fd    = -1;
+            uint8_t*    data  = 0;
+            size_t      size  = 0;
+            size_t      done  = 0;
+            bool        write = false;
+            bool        urgent = false;     // a read that's already being waited on
+            tState      state = kQueued;
+        };
+
+        struct cRing
+        {
+            int       fd = -1;
+            unsigned  entries = 0;
+            unsigned* sqHead;
+            unsigned* sqTail;
+            unsigned* sqMask;
+            unsigned* sqArray;
+            unsigned* cqHead;
+            unsigned* cqTail;
+            unsigned* cqMask;
+            void*     sqes;
+            void*     cqes;
+            void*     sqMap  = 0;
+            void*     cqMap  = 0;
+            size_t    sqMapSize = 0;
+            size_t    cqMapSize = 0;
+            size_t    sqesSize  = 0;
+        };
+
+        bool SetupRing(unsigned entries);
+        bool ProbeRing();
+        void FreeRing();
+        void Submit(int op, int fd, void* buffer, size_t size, uint64_t offset, uint64_t userData);
+        bool Start(cRequest* request);
+        void Complete(cRequest* request, int result);
+        void Wake();
+        void Service();
+        void Fail(std::unique_lock<std::mutex>& lock);
+
+        const std::vector<std::string>& mPaths;
+        int                     mDepth;
+        std::vector<cRequest>   mReads;
+        std::deque<cRequest*>   mWrites;        // queued or in flight
+        int                     mNextRead = 0;  // next read to issue ahead of time
+        int                     mReadsHeld = 0; // in flight, or ready and not yet taken
+        int                     mInFlight = 0;
+        int                     mToSubmit = 0;
+        bool                    mQuit = false;
+        bool                    mFailed = false;    // the ring stopped working, so I/O is now blocking
+
+        std::mutex              mMutex;
+        std::condition_variable mChanged;
+        std::thread             mThread;
+        cRing                   mRing;
+        int                     mWakeFD = -1;
+        uint64_t                mWakeCount = 0;
+    };
+
+#ifdef HAVE_IO_URING
+    cAsyncIO::cAsyncIO(const std::vector<std::string>& paths, int depth) :
+        mPaths(paths),
+        mDepth(std::max(depth, 1)),
+        mReads(paths.size())
+    {
+        for (size_t i = 0; i < paths.size(); i++)
+            mReads[i].path = paths[i];
+
+        // Room for everything in flight, plus the read of mWakeFD
+        if (!SetupRing(mDepth + 1))
+            return;
+
+        mWakeFD = eventfd(0, EFD_CLOEXEC);
+
+        if (mWakeFD < 0)
         {
-            strcat(filename, "_lut.png");
-            printf("Saving %s\n", filename);
-            stbi_write_png(filename, kLUTSize * kLUTSize, kLUTSize, 4, rgbaLUT, 0);
+            FreeRing();
+            return;
+        }
+
+        Submit(IORING_OP_READ, mWakeFD, &mWakeCount, sizeof(mWakeCount), 0, 0);
+        mThread = std::thread(&cAsyncIO::Service, this);
+    }
+
+    cAsyncIO::~cAsyncIO()
+    {
+        if (!IsAsync())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQuit = true;
+        }
+
+        Wake();
+        mThread.join();
+
+        for (cRequest& request : mReads)
+            PoolFree(request.data);
+
+        close(mWakeFD);
+        FreeRing();
+    }
+
+    bool cAsyncIO::SetupRing(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        mRing.fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (mRing.fd < 0)
+            return false;
+
+        if (!ProbeRing())
+        {
+            FreeRing();
+            return false;
+        }
+
+        mRing.entries   = params.sq_entries;
+        mRing.sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        mRing.cqMapSize = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+        mRing.sqesSize  = params.sq_entries * sizeof(io_uring_sqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            mRing.sqMapSize = mRing.cqMapSize = std::max(mRing.sqMapSize, mRing.cqMapSize);
+
+        mRing.sqMap = mmap(0, mRing.sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd, IORING_OFF_SQ_RING);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            mRing.cqMap = mRing.sqMap;
+        else
+            mRing.cqMap = mmap(0, mRing.cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd, IORING_OFF_CQ_RING);
+
+        mRing.sqes = mmap(0, mRing.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing.fd, IORING_OFF_SQES);
+
+        if (mRing.sqMap == MAP_FAILED || mRing.cqMap == MAP_FAILED || mRing.sqes == MAP_FAILED)
+        {
+            FreeRing();
+            return false;
+        }
+
+        uint8_t* sq = (uint8_t*) mRing.sqMap;
+        uint8_t* cq = (uint8_t*) mRing.cqMap;
+
+        mRing.sqHead  = (unsigned*) (sq + params.sq_off.head);
+        mRing.sqTail  = (unsigned*) (sq + params.sq_off.tail);
+        mRing.sqMask  = (unsigned*) (sq + params.sq_off.ring_mask);
+        mRing.sqArray = (unsigned*) (sq + params.sq_off.array);
+        mRing.cqHead  = (unsigned*) (cq + params.cq_off.head);
+        mRing.cqTail  = (unsigned*) (cq + params.cq_off.tail);
+        mRing.cqMask  = (unsigned*) (cq + params.cq_off.ring_mask);
+        mRing.cqes    = cq + params.cq_off.cqes;
+
+        return true;
+    }
+
+    // Check the kernel supports the operations we need. io_uring itself
+    // predates IORING_OP_READ and IORING_OP_WRITE (5.6), and on those kernels
+    // they complete with -EINVAL rather than failing the setup. The probe is
+    // 5.6+ too, so if it fails, so would they.
+    bool cAsyncIO::ProbeRing()
+    {
+        const int numOps = 256;
+        std::vector<uint8_t> storage(sizeof(io_uring_probe) + numOps * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = (io_uring_probe*) storage.data();
+
+        if (syscall(__NR_io_uring_register, mRing.fd, IORING_REGISTER_PROBE, probe, numOps) < 0)
+            return false;
+
+        for (int op : { IORING_OP_READ, IORING_OP_WRITE })
+            if (op > probe->last_op || op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+
+        return true;
+    }
+
+    void cAsyncIO::FreeRing()
+    {
+        if (mRing.sqes && mRing.sqes != MAP_FAILED)
+            munmap(mRing.sqes, mRing.sqesSize);
+        if (mRing.cqMap && mRing.cqMap != MAP_FAILED && mRing.cqMap != mRing.sqMap)
+            munmap(mRing.cqMap, mRing.cqMapSize);
+        if (mRing.sqMap && mRing.sqMap != MAP_FAILED)
+            munmap(mRing.sqMap, mRing.sqMapSize);
+        if (mRing.fd >= 0)
+            close(mRing.fd);
+
+        mRing = cRing();
+    }
+
+    // Queue an operation, to be submitted by the next io_uring_enter. Only the
+    // I/O thread does this, once it's running, and never with more than
+    // mRing.entries outstanding, so there's always room.
+    void cAsyncIO::Submit(int op, int fd, void* buffer, size_t size, uint64_t offset, uint64_t userData)
+    {
+        unsigned tail  = *mRing.sqTail;
+        unsigned index = tail & *mRing.sqMask;
+
+        io_uring_sqe* sqe = (io_uring_sqe*) mRing.sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+
+        sqe->opcode    = uint8_t(op);
+        sqe->fd        = fd;
+        sqe->addr      = uint64_t(uintptr_t(buffer));
+        sqe->len       = unsigned(std::min(size, size_t(1) << 30));
+        sqe->off       = offset;
+        sqe->user_data = userData;
+
+        mRing.sqArray[index] = index;
+        __atomic_store_n(mRing.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        mToSubmit++;
+    }
+
+    // Open the request's file and issue the first read or write
+    bool cAsyncIO::Start(cRequest* request)
+    {
+        if (request->write)
+            request->fd = open(request->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        else
+        {
+            request->fd = open(request->path.c_str(), O_RDONLY | O_CLOEXEC);
+
+            struct stat info;
+
+            if (request->fd >= 0 && fstat(request->fd, &info) == 0)
+            {
+                request->size = size_t(info.st_size);
+                request->data = (uint8_t*) PoolAlloc(std::max(request->size, size_t(1)));
+            }
+        }
+
+        if (request->fd < 0 || !request->data)
+        {
+            Complete(request, -1);
+            return false;
+        }
+
+        if (request->size == 0)
+        {
+            Complete(request, 0);
+            return false;
+        }
+
+        request->state = kInFlight;
+        mInFlight++;
+
+        Submit(request->write ? IORING_OP_WRITE : IORING_OP_READ, request->fd, request->data, request->size, 0, uint64_t(uintptr_t(request)));
+        return true;
+    }
+
+    // Handle the result of a read or write, issuing another for the rest of the file if it was short
+    void cAsyncIO::Complete(cRequest* request, int result)
+    {
+        if (request->state == kInFlight)
+            mInFlight--;
+
+        if (result == -EINTR || result == -EAGAIN)
+            result = 0;
+        else if (result < 0 || (result == 0 && request->write && request->done < request->size))
+            request->state = kFailed;
+        else if (result == 0)
+            request->size = request->done;      // the file was truncated since we started
+
+        if (result > 0)
+            request->done += size_t(result);
+
+        if (request->state == kInFlight && request->done < request->size)
+        {
+            mInFlight++;
+            Submit(request->write ? IORING_OP_WRITE : IORING_OP_READ, request->fd, request->data + request->done, request->size - request->done, request->done, uint64_t(uintptr_t(request)));
+            return;
+        }
+
+        if (request->fd >= 0)
+            close(request->fd);
+        request->fd = -1;
+
+        if (request->write)
+        {
+            if (request->state == kFailed)
+                fprintf(stderr, "Couldn't write %s\n", request->path.c_str());
+
+            PoolFree(request->data);
+            mWrites.erase(std::find(mWrites.begin(), mWrites.end(), request));
+            delete request;
+        }
+        else if (request->state != kFailed)
+            request->state = kReady;
+        else
+        {
+            PoolFree(request->data);
+            request->data = 0;
+        }
+
+        mChanged.notify_all();
+    }
+
+    void cAsyncIO::Wake()
+    {
+        uint64_t one = 1;
+
+        if (write(mWakeFD, &one, sizeof(one)) < 0)
+            fprintf(stderr, "Couldn't wake I/O thread\n");
+    }
+
+    // The I/O thread: keeps the ring topped up with queued writes, and reads
+    // as far ahead as mDepth allows, until asked to quit and nothing's left
+    void cAsyncIO::Service()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for (;;)
+        {
+            // Start() removes writes that fail immediately, so collect them first
+            std::vector<cRequest*> writes;
+
+            for (cRequest* request : mWrites)
+                if (request->state == kQueued && mInFlight + int(writes.size()) < mDepth)
+                    writes.push_back(request);
+
+            for (cRequest* request : writes)
+                Start(request);
+
+            // Reads that are needed now jump the queue
+            for (cRequest& request : mReads)
+                if (request.state == kQueued && request.urgent && mInFlight < mDepth)
+                    Start(&request);
+
+            while (!mQuit && mNextRead < int(mReads.size()) && mInFlight < mDepth && mReadsHeld < mDepth)
+            {
+                cRequest& request = mReads[mNextRead++];
+
+                if (request.state == kQueued && !request.urgent)
+                {
+                    mReadsHeld++;
+                    Start(&request);
+                }
+            }
+
+            if (mQuit && mWrites.empty() && mInFlight == 0)
+                break;
+
+            int toSubmit = mToSubmit;
+            mToSubmit = 0;
+
+            lock.unlock();
+            int result = int(syscall(__NR_io_uring_enter, mRing.fd, toSubmit, 1, IORING_ENTER_GETEVENTS, 0, 0));
+            lock.lock();
+
+            if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                fprintf(stderr, "io_uring_enter failed, continuing with blocking I/O: %s\n", strerror(errno));
+                Fail(lock);
+                break;
+            }
+
+            // Anything not submitted is still in the ring, for next time
+            mToSubmit += toSubmit - std::max(std::min(result, toSubmit), 0);
+
+            unsigned head = *mRing.cqHead;
+            unsigned tail = __atomic_load_n(mRing.cqTail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++)
+            {
+                const io_uring_cqe& cqe = ((const io_uring_cqe*) mRing.cqes)[head & *mRing.cqMask];
+
+                if (cqe.user_data == 0)
+                    Submit(IORING_OP_READ, mWakeFD, &mWakeCount, sizeof(mWakeCount), 0, 0);
+                else
+                    Complete((cRequest*) uintptr_t(cqe.user_data), cqe.res);
+            }
+
+            __atomic_store_n(mRing.cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Called by the I/O thread if io_uring_enter fails. Everything not yet
+    // done is redone with blocking I/O: writes here, and reads by whoever calls
+    // Read for them. The buffers of requests in flight are left alone, as the
+    // kernel may still be using them.
+    void cAsyncIO::Fail(std::unique_lock<std::mutex>& lock)
+    {
+        mFailed = true;
+
+        for (cRequest& request : mReads)
+            if (request.state == kInFlight)
+            {
+                close(request.fd);
+                request.fd    = -1;
+                request.data  = 0;
+                request.done  = 0;
+                request.state = kQueued;
+            }
+
+        std::vector<cRequest*> writes(mWrites.begin(), mWrites.end());
+        mWrites.clear();
+        mInFlight = 0;
+
+        mChanged.notify_all();
+        lock.unlock();
+
+        for (cRequest* request : writes)
+        {
+            if (request->state == kQueued)
+                WriteFile(request->path.c_str(), request->data, request->size);
+            else
+            {
+                // The kernel only reads the buffer, so its contents are intact, but it can't be freed
+                uint8_t* copy = (uint8_t*) PoolAlloc(request->size);
+
+                close(request->fd);
+
+                if (copy)
+                {
+                    memcpy(copy, request->data, request->size);
+                    WriteFile(request->path.c_str(), copy, request->size);
+                }
+                else
+                    fprintf(stderr, "Couldn't write %s\n", request->path.c_str());
+            }
+
+            delete request;
+        }
+
+        lock.lock();
+    }
+
+    uint8_t* cAsyncIO::Read(int index, size_t* size)
+    {
+        if (!IsAsync())
+            return ReadFile(mPaths[index].c_str(), size);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        cRequest& request = mReads[index];
+
+        if (request.state == kQueued && !mFailed)
+        {
+            // Not issued yet, so have it issued next
+            mReadsHeld++;
+            request.urgent = true;
+            Wake();
+        }
+
+        mChanged.wait(lock, [this, &request]() { return request.state == kReady || request.state == kFailed || mFailed; });
+
+        // Not read before the ring failed, so read it now into a fresh buffer
+        if (request.state == kQueued)
+        {
+            request.state = kTaken;
+            lock.unlock();
+
+            return ReadFile(mPaths[index].c_str(), size);
+        }
+
+        uint8_t* data = request.data;
+        *size = request.done;
+
+        request.data  = 0;
+        request.state = kTaken;
+        mReadsHeld--;
+        lock.unlock();
+
+        Wake();     // there's room to read further ahead
+        return data;
+    }
+
+    void cAsyncIO::Write(const char* path, uint8_t* data, size_t size)
+    {
+        if (!IsAsync())
+        {
+            WriteFile(path, data, size);
+            return;
+        }
+
+        cRequest* request = new cRequest;
+        request->path  = path;
+        request->data  = data;
+        request->size  = size;
+        request->write = true;
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mChanged.wait(lock, [this]() { return int(mWrites.size()) < mDepth || mFailed; });
+
+        if (mFailed)
+        {
+            lock.unlock();
+            WriteFile(path, data, size);
+            delete request;
+            return;
+        }
+
+        mWrites.push_back(request);
+        lock.unlock();
+
+        Wake();
+    }
+#else
+    cAsyncIO::cAsyncIO(const std::vector<std::string>& paths, int depth) : mPaths(paths), mDepth(depth) {}
+    cAsyncIO::~cAsyncIO() {}
+
+    uint8_t* cAsyncIO::Read(int index, size_t* size)
+    {
+        return ReadFile(mPaths[index].c_str(), size);
+    }
+
+    void cAsyncIO::Write(const char* path, uint8_t* data, size_t size)
+    {
+        WriteFile(path, data, size);
+    }
+#endif
+
+    cAsyncIO* sAsyncIO = 0;     // if set, images are written via this, set up by --batch
+    int sAsyncIODepth = 32;     // reads and writes in flight at once, set by --io-depth
+
+    // Destination for encoded images. Write takes ownership of 'data', which
+    // is from the buffer pool, and may be called from several threads at once.
+    class cOutputSink
+    {
+    public:
+        virtual ~cOutputSink() {}
+        virtual void Write(const char* filename, uint8_t* data, size_t size) = 0;
+    };
+
+    // The default: one file per image, via sAsyncIO if it's set up
+    class cFileSink : public cOutputSink
+    {
+    public:
+        void Write(const char* filename, uint8_t* data, size_t size) override
+        {
+            if (sAsyncIO)
+                sAsyncIO->Write(filename, data, size);
+            else
+                WriteFile(filename, data, size);
+        }
+    };
+
+    // Passes each image to a callback, so the results can be used without
+    // going via the filesystem at all. Set up by SetOutputCallback.
+    class cCallbackSink : public cOutputSink
+    {
+    public:
+        cCallbackSink(tOutputCallback* callback, void* user) : mCallback(callback), mUser(user) {}
+
+        void Write(const char* filename, uint8_t* data, size_t size) override
+        {
+            mCallback(mUser, filename, data, size);
+            PoolFree(data);
+        }
+
+    protected:
+        tOutputCallback* mCallback;
+        void*            mUser;
+    };
+
+    // Collects all images into a single uncompressed tar or zip file, so there
+    // are only a handful of filesystem operations however many images there
+    // are. Zip files are limited to 4GB and 65535 entries.
+    class cArchiveSink : public cOutputSink
+    {
+    public:
+        ~cArchiveSink() override;
+
+        bool Open(const char* path);    // a .zip suffix selects zip, otherwise tar
+        void Write(const char* filename, uint8_t* data, size_t size) override;
+
+    protected:
+        struct cZipEntry
+        {
+            std::string name;
+            uint32_t    crc;
+            uint32_t    size;
+            uint32_t    offset;
+        };
+
+        bool WriteTarEntry(const char* filename, const uint8_t* data, size_t size);
+        bool WriteZipEntry(const char* filename, const uint8_t* data, size_t size);
+        void FinishZip();
+
+        std::mutex             mMutex;
+        FILE*                  mFile = 0;
+        std::string            mPath;
+        bool                   mZip = false;
+        uint64_t               mOffset = 0;
+        int                    mNumEntries = 0;
+        std::vector<cZipEntry> mZipEntries;
+        uint16_t               mDOSTime = 0;
+        uint16_t               mDOSDate = 0;
+    };
+
+    void Put16(uint8_t* p, uint32_t v) { p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); }
+    void Put32(uint8_t* p, uint32_t v) { Put16(p, v); Put16(p + 2, v >> 16); }
+
+    bool cArchiveSink::Open(const char* path)
+    {
+        size_t length = strlen(path);
+
+        mPath = path;
+        mZip = length >= 4 && strcmp(path + length - 4, ".zip") == 0;
+        mFile = fopen(path, "wb");
+
+        time_t now = time(0);
+        const tm* local = localtime(&now);
+
+        if (local)
+        {
+            mDOSTime = uint16_t(local->tm_hour << 11 | local->tm_min << 5 | local->tm_sec / 2);
+            mDOSDate = uint16_t(std::max(local->tm_year - 80, 0) << 9 | (local->tm_mon + 1) << 5 | local->tm_mday);
+        }
+
+        return mFile != 0;
+    }
+
+    cArchiveSink::~cArchiveSink()
+    {
+        if (!mFile)
+            return;
+
+        if (mZip)
+            FinishZip();
+        else
+        {
+            // Two empty blocks mark the end of a tar
+            uint8_t end[1024] = {};
+            fwrite(end, 1, sizeof(end), mFile);
+        }
+
+        bool success = !ferror(mFile);
+
+        if (fclose(mFile) != 0 || !success)
+            fprintf(stderr, "Couldn't write %s\n", mPath.c_str());
+        else
+            printf("Wrote %d images to %s (%.1f MB)\n", mNumEntries, mPath.c_str(), mOffset / (1024.0 * 1024.0));
+    }
+
+    void cArchiveSink::Write(const char* filename, uint8_t* data, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (!(mZip ? WriteZipEntry(filename, data, size) : WriteTarEntry(filename, data, size)))
+            fprintf(stderr, "Couldn't add %s to %s\n", filename, mPath.c_str());
+        else
+            mNumEntries++;
+
+        PoolFree(data);
+    }
+
+    bool cArchiveSink::WriteTarEntry(const char* filename, const uint8_t* data, size_t size)
+    {
+        // ustar header. Numeric fields are octal, NUL-terminated.
+        uint8_t header[512] = {};
+
+        if (strlen(filename) >= 100 || uint64_t(size) >= (uint64_t(1) << 33))
+            return false;
+
+        memcpy(header, filename, strlen(filename));
+        snprintf((char*) header + 100, 8, "%07o", 0644);
+        snprintf((char*) header + 108, 8, "%07o", 0);
+        snprintf((char*) header + 116, 8, "%07o", 0);
+        snprintf((char*) header + 124, 12, "%011llo", (unsigned long long) size);
+        snprintf((char*) header + 136, 12, "%011llo", (unsigned long long) time(0));
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+
+        // The checksum is taken with its own field set to spaces
+        unsigned checksum = 8 * ' ';
+
+        for (int i = 0; i < 512; i++)
+            checksum += header[i];
+
+        // Six octal digits, then NUL and space, as ustar readers expect
+        snprintf((char*) header + 148, 7, "%06o", checksum);
+        header[155] = ' ';
+
+        uint8_t padding[512] = {};
+        size_t paddingSize = (512 - size % 512) % 512;
+
+        if (fwrite(header, 1, sizeof(header), mFile) != sizeof(header)
+         || fwrite(data, 1, size, mFile) != size
+         || fwrite(padding, 1, paddingSize, mFile) != paddingSize)
+            return false;
+
+        mOffset += sizeof(header) + size + paddingSize;
+        return true;
+    }
+
+    bool cArchiveSink::WriteZipEntry(const char* filename, const uint8_t* data, size_t size)
+    {
+        size_t nameSize = strlen(filename);
+
+        if (mOffset + 30 + nameSize + size > UINT32_MAX || mZipEntries.size() >= 0xFFFF || nameSize > 0xFFFF)
+            return false;
+
+        cZipEntry entry;
+        entry.name   = filename;
+        entry.crc    = stbiw__crc32((unsigned char*) data, int(size));
+        entry.size   = uint32_t(size);
+        entry.offset = uint32_t(mOffset);
+
+        // Local file header, with the data stored rather than deflated
+        uint8_t header[30] = {};
+
+        Put32(header +  0, 0x04034b50);
+        Put16(header +  4, 20);             // version needed
+        Put16(header + 10, mDOSTime);
+        Put16(header + 12, mDOSDate);
+        Put32(header + 14, entry.crc);
+        Put32(header + 18, entry.size);     // compressed
+        Put32(header + 22, entry.size);
+        Put16(header + 26, uint32_t(nameSize));
+
+        if (fwrite(header, 1, sizeof(header), mFile) != sizeof(header)
+         || fwrite(filename, 1, nameSize, mFile) != nameSize
+         || fwrite(data, 1, size, mFile) != size)
+            return false;
+
+        mOffset += sizeof(header) + nameSize + size;
+        mZipEntries.push_back(entry);
+        return true;
+    }
+
+    // Write the central directory, which lists all the entries
+    void cArchiveSink::FinishZip()
+    {
+        uint64_t directoryStart = mOffset;
+
+        for (const cZipEntry& entry : mZipEntries)
+        {
+            uint8_t header[46] = {};
+
+            Put32(header +  0, 0x02014b50);
+            Put16(header +  4, 3 << 8 | 20);    // made by unix, so the attributes below apply
+            Put16(header +  6, 20);
+            Put16(header + 12, mDOSTime);
+            Put16(header + 14, mDOSDate);
+            Put32(header + 16, entry.crc);
+            Put32(header + 20, entry.size);
+            Put32(header + 24, entry.size);
+            Put16(header + 28, uint32_t(entry.name.size()));
+            Put32(header + 38, 0100644u << 16); // regular file, rw-r--r--
+            Put32(header + 42, entry.offset);
+
+            fwrite(header, 1, sizeof(header), mFile);
+            fwrite(entry.name.data(), 1, entry.name.size(), mFile);
+
+            mOffset += sizeof(header) + entry.name.size();
+        }
+
+        uint8_t end[22] = {};
+
+        Put32(end +  0, 0x06054b50);
+        Put16(end +  8, uint32_t(mZipEntries.size()));
+        Put16(end + 10, uint32_t(mZipEntries.size()));
+        Put32(end + 12, uint32_t(mOffset - directoryStart));
+        Put32(end + 16, uint32_t(directoryStart));
+
+        fwrite(end, 1, sizeof(end), mFile);
+        mOffset += sizeof(end);
+    }
+
+    cFileSink    sFileSink;
+    cOutputSink* sOutputSink = &sFileSink;  // where encoded images go, set by --output
+    cOutputSink* sDefaultSink = &sFileSink; // where they go without --output, set by SetOutputCallback
+
+    std::unique_ptr<cCallbackSink> sCallbackSink;
+
+    // Write out an encoded image, taking ownership of 'data'
+    void WriteImageFile(const char* filename, uint8_t* data, int size)
+    {
+        if (!data)
+            fprintf(stderr, "Couldn't write %s\n", filename);
+        else
+            sOutputSink->Write(filename, data, size);
+    }
+
+    void SaveImage(const char* name, int w, int h, const void* data);
+
+    // An 8-bit indexed image, as loaded from a paletted PNG
+    struct cPalettedImage
+    {
+        uint8_t* indices = 0;   // one per pixel, from the buffer pool
+        RGBA32   palette[256];
+        int      paletteSize = 0;
+    };
+
+    // Save an indexed image, expanding it if the output format has no palette support
+    void SaveIndexedImage(const char* name, int w, int h, const uint8_t* indices, const RGBA32* palette, int paletteSize)
+    {
+        if (sOutputFormat != kFormatPNG)
+        {
+            RGBA32* data = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+
+            if (!data)
+            {
+                fprintf(stderr, "Out of memory saving %s\n", name);
+                return;
+            }
+
+            for (int i = 0, n = w * h; i < n; i++)
+                data[i] = palette[indices[i]];
+
+            SaveImage(name, w, h, data);
+            PoolFree(data);
+            return;
+        }
+
+        char filename[300];
+        snprintf(filename, sizeof(filename), "%s.png", name);
+        printf("Saving %s (%d colour palette)\n", filename, paletteSize);
+
+        int size;
+        uint8_t* png = stbi_write_png_indexed_to_mem(indices, w, h, (const stbi_uc*) palette, paletteSize, &size);
+
+        WriteImageFile(filename, png, size);
+    }
+
+    // Find the distinct colours in the image, filling in 'indices' and
+    // 'palette'. Returns the palette size, or 0 if there are more than 256.
+    int FindPalette(int n, const RGBA32* data, uint8_t* indices, RGBA32 palette[256])
+    {
+        // Open-addressed hash table, at most 1/4 full
+        const int kTableBits = 10;
+        const int kTableMask = (1 << kTableBits) - 1;
+
+        uint32_t keys[1 << kTableBits];
+        int16_t  slots[1 << kTableBits];
+        std::fill(slots, slots + (1 << kTableBits), int16_t(-1));
+
+        int paletteSize = 0;
+        uint32_t lastKey = 0;
+        int lastIndex = -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t key;
+            memcpy(&key, data + i, sizeof(key));
+
+            if (key != lastKey || lastIndex < 0)    // runs are common, so skip the lookup for them
+            {
+                int h = (key * 0x9E3779B1u) >> (32 - kTableBits);
+
+                while (slots[h] >= 0 && keys[h] != key)
+                    h = (h + 1) & kTableMask;
+
+                if (slots[h] < 0)
+                {
+                    if (paletteSize == 256)
+                        return 0;
+
+                    keys[h] = key;
+                    slots[h] = int16_t(paletteSize);
+                    palette[paletteSize++] = data[i];
+                }
+
+                lastKey = key;
+                lastIndex = slots[h];
+            }
+
+            indices[i] = uint8_t(lastIndex);
+        }
+
+        return paletteSize;
+    }
+
+    // Save the given RGBA image as 'name' plus the output format's extension
+    void SaveImage(const char* name, int w, int h, const void* data)
+    {
+        // Callers may pass on a failed allocation
+        if (!data)
+        {
+            fprintf(stderr, "Out of memory saving %s\n", name);
+            return;
+        }
+
+        uint8_t* indices = (sIndexedOutput && sOutputFormat == kFormatPNG) ? (uint8_t*) PoolAlloc(size_t(w) * h) : 0;
+
+        // If there's no room for the indices, it's saved as RGBA instead
+        if (indices)
+        {
+            RGBA32 palette[256];
+            int paletteSize = FindPalette(w * h, (const RGBA32*) data, indices, palette);
+
+            if (paletteSize > 0)
+                SaveIndexedImage(name, w, h, indices, palette, paletteSize);
+
+            PoolFree(indices);
+
+            if (paletteSize > 0)
+                return;
+        }
+
+        char filename[300];
+        snprintf(filename, sizeof(filename), "%s.%s", name, kImageFormatNames[sOutputFormat]);
+        printf("Saving %s\n", filename);
+
+        int size;
+        uint8_t* file;
+
+        if (sOutputFormat == kFormatQOI)
+            file = qoi_write_to_mem((const uint8_t*) data, w, h, 4, &size);
+        else
+            file = stbi_write_png_to_mem((stbi_uc*) data, 0, w, h, 4, &size);
+
+        WriteImageFile(filename, file, size);
+    }
+
+    // Image output a band of rows at a time, in the current output format
+    struct cImageWriter
+    {
+        stbi_png_writer* png = 0;
+        qoi_writer*      qoi = 0;
+    };
+
+    bool BeginImage(cImageWriter* writer, const char* name, int w, int h)
+    {
+        char filename[300];
+        snprintf(filename, sizeof(filename), "%s.%s", name, kImageFormatNames[sOutputFormat]);
+
+        // Rows are written straight out to keep memory use down, so can't go via a sink
+        if (sOutputSink != &sFileSink)
+        {
+            fprintf(stderr, "Can't send %s to an --output archive or callback, as --band output is written directly to a file\n", filename);
+            return false;
+        }
+
+        printf("Saving %s\n", filename);
+
+        if (sOutputFormat == kFormatQOI)
+            writer->qoi = qoi_write_begin(filename, w, h, 4);
+        else
+            writer->png = stbi_write_png_begin(filename, w, h, 4);
+
+        if (!writer->png && !writer->qoi)
+        {
+            fprintf(stderr, "Couldn't write %s\n", filename);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool WriteImageRows(cImageWriter* writer, const RGBA32* rows, int count)
+    {
+        if (writer->qoi)
+            return qoi_write_rows(writer->qoi, rows, count) != 0;
+
+        return stbi_write_png_rows(writer->png, rows, count) != 0;
+    }
+
+    // Returns false if the image wasn't written successfully
+    bool EndImage(cImageWriter* writer)
+    {
+        if (writer->qoi)
+            return qoi_write_end(writer->qoi) != 0;
+
+        return stbi_write_png_end(writer->png) != 0;
+    }
+
+    // As stbi_info, but also handling QOI, and PNGs too large for stbi to load
+    bool GetImageInfo(const char* path, int* w, int* h)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return false;
+
+        uint8_t header[24];
+        size_t headerSize = fread(header, 1, sizeof(header), file);
+        fclose(file);
+
+        if (qoi_info_from_memory(header, int(headerSize), w, h, 0))
+            return true;
+
+        const uint8_t kPNGSignature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+        if (headerSize == sizeof(header) && memcmp(header, kPNGSignature, 8) == 0 && memcmp(header + 12, "IHDR", 4) == 0)
+        {
+            uint32_t pw = uint32_t(header[16]) << 24 | header[17] << 16 | header[18] << 8 | header[19];
+            uint32_t ph = uint32_t(header[20]) << 24 | header[21] << 16 | header[22] << 8 | header[23];
+
+            if (pw == 0 || ph == 0 || pw > (1 << 24) || ph > (1 << 24))
+                return false;
+
+            *w = int(pw);
+            *h = int(ph);
+            return true;
+        }
+
+        return stbi_info(path, w, h, 0) != 0;
+    }
+
+    // Decode the given image file contents. If maxDim is non-zero, the image
+    // is shrunk to fit within maxDim x maxDim: JPEGs are decoded at the
+    // smallest of 1/2, 1/4 or 1/8 scale that still covers that, and the rest
+    // is done with a box filter.
+    // If 'paletted' is supplied, and the image is a paletted PNG, its indices
+    // and palette are also returned there, so ops can transform the palette alone.
+    RGBA32* LoadImageFromMemory(const uint8_t* data, size_t dataSize, int* w, int* h, int maxDim = 0, cPalettedImage* paletted = 0)
+    {
+        if (dataSize > INT_MAX)
+            return 0;
+
+        const int size = int(dataSize);
+        RGBA32* image;
+
+        if (paletted && maxDim == 0)
+        {
+            paletted->indices = stbi_load_png_indexed_from_memory(data, size, w, h, (stbi_uc*) paletted->palette, &paletted->paletteSize);
+
+            if (paletted->indices)
+            {
+                // Malformed files can have indices past the end of the palette:
+                // those entries read as transparent black, and are counted in
+                // paletteSize so ops transforming the palette alone cover them.
+                for (int i = paletted->paletteSize; i < 256; i++)
+                    paletted->palette[i].u32 = 0;
+
+                // Expand from the palette, rather than decoding again
+                int n = *w * *h;
+                image = (RGBA32*) PoolAlloc(n * sizeof(RGBA32));
+                int maxIndex = 0;
+
+                if (image)
+                    for (int i = 0; i < n; i++)
+                    {
+                        int index = paletted->indices[i];
+                        image[i] = paletted->palette[index];
+                        maxIndex = maxIndex > index ? maxIndex : index;
+                    }
+
+                if (paletted->paletteSize <= maxIndex)
+                    paletted->paletteSize = maxIndex + 1;
+
+                return image;
+            }
+        }
+
+        if (qoi_info_from_memory(data, size, 0, 0, 0))
+            image = (RGBA32*) qoi_load_from_memory(data, size, w, h, 0, 4);
+        else
+        {
+            int denom = 1;
+
+            if (maxDim > 0 && stbi_info_from_memory(data, size, w, h, 0))
+            {
+                int fullDim = std::max(*w, *h);
+
+                while (denom < 8 && (fullDim + 2 * denom - 1) / (2 * denom) >= maxDim)
+                    denom *= 2;
+            }
+
+            stbi_set_jpeg_scale_denom(denom);
+            image = (RGBA32*) stbi_load_from_memory(data, size, w, h, 0, 4);
+            stbi_set_jpeg_scale_denom(1);
+        }
+
+        if (image && maxDim > 0 && std::max(*w, *h) > maxDim)
+        {
+            int sw = *w;
+            int sh = *h;
+
+            if (sw >= sh)
+            {
+                *w = maxDim;
+                *h = std::max(int((int64_t(sh) * maxDim + sw / 2) / sw), 1);
+            }
+            else
+            {
+                *h = maxDim;
+                *w = std::max(int((int64_t(sw) * maxDim + sh / 2) / sh), 1);
+            }
+
+            RGBA32* scaled = DownscaleImage(image, sw, sh, *w, *h);
+            stbi_image_free(image);
+            image = scaled;
+        }
+
+        return image;
+    }
+
+    // Load the given image, reading it into memory first so the JPEG decoder
+    // can split it at restart markers if parallel decoding is on. See
+    // LoadImageFromMemory for the other arguments.
+    RGBA32* LoadImage(const char* path, int* w, int* h, int maxDim = 0, cPalettedImage* paletted = 0)
+    {
+        size_t size;
+        uint8_t* data = ReadFile(path, &size);
+
+        if (!data)
+            return 0;
+
+        RGBA32* image = LoadImageFromMemory(data, size, w, h, maxDim, paletted);
+
+        PoolFree(data);
+        return image;
+    }
+
+    // Decode the given image a band of up to bandRows rows at a time, calling
+    // processBand(rows, y, count) with each, which returns false to stop.
+    // PNGs and QOIs are decoded incrementally, so memory use depends only on
+    // the band size. Other formats, and PNGs the band decoder doesn't handle,
+    // are loaded in full first.
+    template<class T> bool LoadImageBands(const char* path, int bandRows, T processBand)
+    {
+        int w, h;
+        qoi_reader* qoi = qoi_read_begin(path, &w, &h, 0);
+
+        if (qoi)
+        {
+            RGBA32* band = new RGBA32[size_t(w) * bandRows];
+            int y = 0;
+
+            while (y < h)
+            {
+                int count = qoi_read_rows(qoi, (uint8_t*) band, bandRows, 4);
+
+                if (count == 0 || !processBand(band, y, count))
+                    break;
+
+                y += count;
+            }
+
+            delete[] band;
+            qoi_read_end(qoi);
+            return y == h;
+        }
+
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return false;
+
+        bool started = false;
+        auto startBand = [&started, &processBand](const RGBA32* rows, int y, int count) { started = true; return processBand(rows, y, count); };
+        stbi_band_callback* bandCallback = [](void* user, stbi_uc* rows, int y, int count)
+        {
+            return int((*(decltype(startBand)*) user)((const RGBA32*) rows, y, count));
+        };
+
+        int success = stbi_load_png_bands(file, bandRows, bandCallback, &startBand);
+        fclose(file);
+
+        if (success || started)
+            return success != 0;
+
+        RGBA32* data = LoadImage(path, &w, &h);
+        if (!data)
+            return false;
+
+        bool ok = true;
+
+        for (int y = 0; y < h && ok; y += bandRows)
+            ok = processBand(data + int64_t(y) * w, y, std::min(bandRows, h - y));
+
+        stbi_image_free(data);
+        return ok;
+    }
+
+    // Set while a thread is working for one of our thread pools, so that
+    // ParallelFor, as called by the codecs, runs serially there rather than
+    // starting yet more threads on top of a pool that already fills the machine.
+    thread_local bool sOnPoolThread = false;
+
+    struct cPoolThreadScope
+    {
+        bool wasOnPoolThread = sOnPoolThread;
+
+        cPoolThreadScope()  { sOnPoolThread = true; }
+        ~cPoolThreadScope() { sOnPoolThread = wasOnPoolThread; }
+    };
+
+    // Threads kept around for ParallelFor and WorkStealingFor, so that each
+    // call, e.g., for every PNG deflated in parallel, doesn't pay to start and
+    // join its own. They're started as first needed. Callers must cope with
+    // the pool's threads starting on their work late, as they may be busy
+    // with another caller's.
+    class cThreadPool
+    {
+    public:
+        ~cThreadPool();
+
+        // Runs worker(i) for i in [0, numThreads), worker(0) on the calling thread, and returns once all are done
+        void Run(int numThreads, const std::function<void(int)>& worker);
+
+    protected:
+        void Service();
+
+        std::mutex                          mMutex;
+        std::condition_variable             mChanged;
+        std::deque<std::function<void()>>   mTasks;
+        std::vector<std::thread>            mThreads;
+        bool                                mQuit = false;
+    };
+
+    cThreadPool::~cThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQuit = true;
+        }
+
+        mChanged.notify_all();
+
+        for (std::thread& thread : mThreads)
+            thread.join();
+    }
+
+    void cThreadPool::Run(int numThreads, const std::function<void(int)>& worker)
+    {
+        if (numThreads <= 1)
+        {
+            worker(0);
+            return;
+        }
+
+        int running = numThreads - 1;   // guarded by mMutex
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            while (int(mThreads.size()) < numThreads - 1)
+                mThreads.emplace_back(&cThreadPool::Service, this);
+
+            for (int i = 1; i < numThreads; i++)
+                mTasks.push_back(
+                    [this, &worker, &running, i]()
+                    {
+                        worker(i);
+
+                        std::lock_guard<std::mutex> lock(mMutex);
+                        running--;
+                        mChanged.notify_all();
+                    }
+                );
+        }
+
+        mChanged.notify_all();
+        worker(0);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mChanged.wait(lock, [&running]() { return running == 0; });
+    }
+
+    void cThreadPool::Service()
+    {
+        sOnPoolThread = true;
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for (;;)
+        {
+            mChanged.wait(lock, [this]() { return !mTasks.empty() || mQuit; });
+
+            if (mTasks.empty())
+                return;
+
+            std::function<void()> task = std::move(mTasks.front());
+            mTasks.pop_front();
+
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    cThreadPool sThreadPool;
+
+    // stbi_parallel_for_callback that spreads tasks over the available hardware threads
+    void ParallelFor(void*, void (*task)(void* taskData, int index), void* taskData, int count)
+    {
+        std::atomic<int> next(0);
+
+        auto worker = [&](int)
+        {
+            cPoolThreadScope scope;
+
+            for (int i = next++; i < count; i = next++)
+                task(taskData, i);
+        };
+
+        int numThreads = sOnPoolThread ? 1 : std::min(int(std::thread::hardware_concurrency()), count);
+
+        sThreadPool.Run(numThreads, worker);
+    }
+
+    // Scanline hooks for applying LUTs during JPEG decode
+    struct cDecodeInfo
+    {
+        const cLUTs*      luts;
+        std::atomic<bool> applied;  // set once the decoder calls us, i.e., the source is a JPEG. Rows may be decoded in parallel.
+    };
+
+    void ApplyLUTToRow(void* user, stbi_uc* row, int, int count, int comp)
+    {
+        cDecodeInfo* info = (cDecodeInfo*) user;
+        assert(comp == 4);  // LoadImage always asks for RGBA
+
+        ApplyLUT(info->luts->rgba, count, (const RGBA32*) row, (RGBA32*) row);
+        info->applied = true;
+    }
+
+    void ApplyYCbCrLUTToRow(void* user, stbi_uc* out, const stbi_uc* y, const stbi_uc* cb, const stbi_uc* cr, int count, int step)
+    {
+        cDecodeInfo* info = (cDecodeInfo*) user;
+        assert(step == 4);
+
+        ApplyYCbCrLUT(info->luts->ycc, count, y, cb, cr, (RGBA32*) out);
+        info->applied = true;
+    }
+
+    // Load the given image with the LUT for 'mode' applied. For JPEGs this is done
+    // as each scanline is decoded, so pixels are only touched once, otherwise the
+    // standard LUT is applied afterwards. Result should be freed with stbi_image_free.
+    // The decode hooks are per thread, so this can run on several threads at once.
+    RGBA32* LoadImageWithLUT(const char* path, int maxDim, const cLUTs* luts, tApplyMode mode, int* w, int* h)
+    {
+        cDecodeInfo info;
+        info.luts = luts;
+        info.applied = false;
+
+        if (mode == kApplyDecodeYCbCrLUT)
+            stbi_set_jpeg_ycbcr_callback(ApplyYCbCrLUTToRow, &info);
+        else
+            stbi_set_jpeg_row_callback(ApplyLUTToRow, &info);
+
+        RGBA32* data = LoadImage(path, w, h, maxDim);
+
+        stbi_set_jpeg_ycbcr_callback(0, 0);
+        stbi_set_jpeg_row_callback(0, 0);
+
+        if (data && !info.applied)
+            ApplyLUT(luts->rgba, *w * *h, data, data);
+
+        return data;
+    }
+
+    const char* kImageOpSuffixes[] =
+    {
+        "_simulate",
+        "_error",
+        "_daltonise",
+        "_correct",
+        "_simulate_daltonised",
+        "_simulate_corrected",
+        "",
+    };
+
+    // Apply 'op' to dataIn, or if dataOut is 0, create the LUT for it that 'mode' calls for
+    void PerformImageOp(tImageOp op, tLMS lmsType, float strength, tApplyMode mode, cLUTs* luts, int n, const RGBA32* dataIn, RGBA32* dataOut)
+    {
+        switch (op)
+        {
+        case kSimulate:
+            PerformOpLMS<cSimulateOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kError:
+            PerformOpLMS<cErrorOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kDaltonise:
+            PerformOpLMS<cDaltoniseOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kCorrect:
+            PerformOpLMS<cCorrectOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kDaltoniseSimulate:
+            PerformOpLMS<cDaltoniseOp, cSimulateOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kCorrectSimulate:
+            PerformOpLMS<cCorrectOp, cSimulateOp>(lmsType, strength, mode, luts, n, dataIn, dataOut);
+            break;
+        case kPassThrough:
+            if (dataOut || mode == kApplyShapedLUT || mode == kApplyDecodeYCbCrLUT || mode == kApplyVideoLUT || mode == kApplyVideoFullLUT)
+                PerformOp([](Vec3f c) { return c; }, mode, luts, n, dataIn, dataOut);
+            else
+                CreateIdentityLUT(luts->rgba);
+            break;
+        };
+    }
+
+    // Apply 'op' to n pixels, via the LUT previously set up for it by PerformImageOp if 'mode' uses one
+    void ApplyImageOp(tImageOp op, tLMS lmsType, float strength, tApplyMode mode, const cLUTs* luts, const ShaperLUT& shaper, const cLayoutLUT& layoutLUT, int n, const RGBA32* dataIn, RGBA32* dataOut)
+    {
+        if (mode == kApplyDirect || mode == kApplyFixed)
+            PerformImageOp(op, lmsType, strength, mode, 0, n, dataIn, dataOut);
+        else if (mode == kApplyShapedLUT)
+            ApplyShapedLUT(shaper, luts->shaped, n, dataIn, dataOut);
+        else
+            layoutLUT.Apply(n, dataIn, dataOut);
+    }
+
+    // Keeps the previous input and output frames of a stream, so only the
+    // tiles that have changed since need transforming. For screen captures and
+    // the like, this is typically most of them.
+    struct cTileCache
+    {
+        int     w;
+        int     h;
+        int     tileSize;
+        RGBA32* prevIn;
+        RGBA32* prevOut;
+        bool    primed = false;     // set once prevIn/prevOut hold a frame
+
+        cTileCache(int wIn, int hIn, int tileSizeIn) : w(wIn), h(hIn), tileSize(tileSizeIn)
+        {
+            prevIn  = new RGBA32[size_t(w) * h];
+            prevOut = new RGBA32[size_t(w) * h];
+        }
+
+        ~cTileCache()
+        {
+            delete[] prevIn;
+            delete[] prevOut;
+        }
+
+        cTileCache(const cTileCache&) = delete;
+        cTileCache& operator=(const cTileCache&) = delete;
+
+        int NumTiles() const { return ((w + tileSize - 1) / tileSize) * ((h + tileSize - 1) / tileSize); }
+
+        // Transform 'frame' in place with 'apply(n, in, out)', reusing the
+        // previous output for tiles whose input hasn't changed. Returns the
+        // number of tiles skipped.
+        template<class T> int Apply(RGBA32* frame, T apply)
+        {
+            int skipped = 0;
+
+            for (int y0 = 0; y0 < h; y0 += tileSize)
+            for (int x0 = 0; x0 < w; x0 += tileSize)
+            {
+                const int    tw  = std::min(tileSize, w - x0);
+                const int    th  = std::min(tileSize, h - y0);
+                const size_t row = tw * sizeof(RGBA32);
+                const size_t ti  = size_t(y0) * w + x0;
+
+                // memcmp is vectorised, and stops at the first difference
+                bool changed = !primed;
+
+                for (int y = 0; y < th && !changed; y++)
+                    changed = memcmp(frame + ti + size_t(y) * w, prevIn + ti + size_t(y) * w, row) != 0;
+
+                for (int y = 0; y < th; y++)
+                {
+                    const size_t i = ti + size_t(y) * w;
+
+                    if (changed)
+                    {
+                        memcpy(prevIn + i, frame + i, row);
+                        apply(tw, frame + i, frame + i);
+                        memcpy(prevOut + i, frame + i, row);
+                    }
+                    else
+                        memcpy(frame + i, prevOut + i, row);
+                }
+
+                skipped += !changed;
+            }
+
+            primed = true;
+            return skipped;
+        }
+    };
+
+    // Transform the image at 'path' a band of sBandRows rows at a time, writing
+    // each band out as it's done, so memory use is proportional to the band
+    // size rather than the image size. 'luts' and 'layoutLUT' must already be set up for 'op'.
+    bool StreamImage(const char* name, const char* path, tImageOp op, tLMS lmsType, float strength, tApplyMode mode, const cLUTs* luts, const cLayoutLUT& layoutLUT)
+    {
+        int w, h;
+        if (!GetImageInfo(path, &w, &h))
+            return false;
+
+        // Keep each band's pixel count well within an int
+        int bandRows = std::min(sBandRows, std::max((1 << 28) / w, 1));
+
+        cImageWriter writer;
+        if (!BeginImage(&writer, name, w, h))
+            return false;
+
+        ShaperLUT shaper;
+        if (mode == kApplyShapedLUT)
+            CreateShaperLUT(&shaper);
+
+        RGBA32* bandOut = new RGBA32[size_t(w) * bandRows];
+
+        bool success = LoadImageBands(path, bandRows,
+            [&](const RGBA32* rows, int, int count)
+            {
+                ApplyImageOp(op, lmsType, strength, mode, luts, shaper, layoutLUT, w * count, rows, bandOut);
+                return WriteImageRows(&writer, bandOut, count);
+            }
+        );
+
+        delete[] bandOut;
+        return EndImage(&writer) && success;
+    }
+
+    // Blocking FIFO of frame slots, for handing frames between the threads of StreamFrames
+    struct cFrameQueue
+    {
+        std::mutex              mutex;
+        std::condition_variable ready;
+        std::deque<int>         slots;
+
+        void Push(int slot)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots.push_back(slot);
+            }
+            ready.notify_one();
+        }
+
+        int Pop()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this]() { return !slots.empty(); });
+
+            int slot = slots.front();
+            slots.pop_front();
+            return slot;
+        }
+    };
+
+    const int kNumFrameSlots = 3;   // one each being read, transformed, and written
+
+    // Transform raw frames of sFrameWidth x sFrameHeight from stdin to stdout
+    // until the input runs out, e.g., as a filter between video decode and
+    // encode. Reading and writing are done on their own threads, so they overlap
+    // with the transform of the frame in between. 'luts' and 'layoutLUT' must
+    // already be set up for 'op'. Y4M frames are transformed in YCbCr via luts->video, with
+    // chroma processed at its own resolution, so must use a kApplyVideo* mode.
+    bool StreamFrames(tImageOp op, tLMS lmsType, float strength, tApplyMode mode, const cLUTs* luts, const cLayoutLUT& layoutLUT)
+    {
+    #ifdef _MSC_VER
+        _setmode(_fileno(stdin),  _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+    #endif
+
+        const int    n          = sFrameWidth * sFrameHeight;
+        const size_t frameBytes = sFrameY4M ? y4m_frame_size(&sFrameY4MInfo) : size_t(n) * sFrameComp;
+
+        assert(!sFrameY4M || mode == kApplyVideoLUT || mode == kApplyVideoFullLUT);
+
+        ShaperLUT shaper;
+        if (mode == kApplyShapedLUT)
+            CreateShaperLUT(&shaper);
+
+        uint8_t* frames[kNumFrameSlots];
+        for (uint8_t*& frame : frames)
+            frame = new uint8_t[frameBytes];
+
+        RGBA32* pixels = (sFrameComp == 3 && !sFrameY4M) ? new RGBA32[n] : 0;   // for rgb24 frames
+
+        auto applyOp = [&](int count, const RGBA32* dataIn, RGBA32* dataOut)
+        {
+            ApplyImageOp(op, lmsType, strength, mode, luts, shaper, layoutLUT, count, dataIn, dataOut);
+        };
+
+        cTileCache* tileCache = (sFrameTileSize > 0 && !sFrameY4M) ? new cTileCache(sFrameWidth, sFrameHeight, sFrameTileSize) : 0;
+        int64_t tilesSkipped = 0;
+
+        cFrameQueue freeSlots, readSlots, writeSlots;   // a slot of -1 marks the end of the stream
+
+        for (int i = 0; i < kNumFrameSlots; i++)
+            freeSlots.Push(i);
+
+        size_t partialBytes = 0;
+        bool   writeFailed  = false;
+
+        std::thread reader([&]()
+        {
+            for (;;)
+            {
+                int slot = freeSlots.Pop();
+
+                if (sFrameY4M)
+                {
+                    if (!y4m_read_frame(stdin, &sFrameY4MInfo, frames[slot]))
+                    {
+                        readSlots.Push(-1);
+                        return;
+                    }
+
+                    readSlots.Push(slot);
+                    continue;
+                }
+
+                size_t bytes = fread(frames[slot], 1, frameBytes, stdin);
+
+                if (bytes < frameBytes)
+                {
+                    partialBytes = bytes;
+                    readSlots.Push(-1);
+                    return;
+                }
+
+                readSlots.Push(slot);
+            }
+        });
+
+        if (sFrameY4M && !y4m_write_header(stdout, &sFrameY4MInfo))
+            writeFailed = true;
+
+        std::thread writer([&]()
+        {
+            for (int slot = writeSlots.Pop(); slot >= 0; slot = writeSlots.Pop())
+            {
+                // On failure keep draining, so the reader isn't left waiting on a free slot
+                if (!writeFailed && !(sFrameY4M ? y4m_write_frame(stdout, &sFrameY4MInfo, frames[slot]) : fwrite(frames[slot], 1, frameBytes, stdout) == frameBytes))
+                    writeFailed = true;
+
+                freeSlots.Push(slot);
+            }
+
+            fflush(stdout);
+        });
+
+        auto startTime = std::chrono::steady_clock::now();
+        int numFrames = 0;
+
+        for (int slot = readSlots.Pop(); slot >= 0; slot = readSlots.Pop(), numFrames++)
+        {
+            uint8_t* frame = frames[slot];
+
+            if (sFrameY4M)
+            {
+                const y4m_info& info = sFrameY4MInfo;
+                const size_t chromaSize = (frameBytes - n) / 2;
+
+                ApplyYCbCrLUTPlanar(luts->video, info.w, info.h, info.chroma_shift_x, info.chroma_shift_y, frame, frame + n, frame + n + chromaSize);
+            }
+            else
+            {
+                RGBA32* framePixels = (sFrameComp == 4) ? (RGBA32*) frame : pixels;
+
+                if (sFrameComp == 3)
+                    for (int i = 0; i < n; i++)
+                        pixels[i] = { frame[3 * i + 0], frame[3 * i + 1], frame[3 * i + 2], 255 };
+
+                if (tileCache)
+                {
+                    int skipped = tileCache->Apply(framePixels, applyOp);
+                    tilesSkipped += skipped;
+
+                    fprintf(stderr, "Frame %d: skipped %d of %d tiles (%.1f%%)\n", numFrames, skipped, tileCache->NumTiles(), 100.0 * skipped / tileCache->NumTiles());
+                }
+                else
+                    applyOp(n, framePixels, framePixels);
+
+                if (sFrameComp == 3)
+                    for (int i = 0; i < n; i++)
+                    {
+                        frame[3 * i + 0] = pixels[i].c[0];
+                        frame[3 * i + 1] = pixels[i].c[1];
+                        frame[3 * i + 2] = pixels[i].c[2];
+                    }
+            }
+
+            writeSlots.Push(slot);
+        }
+
+        writeSlots.Push(-1);
+        reader.join();
+        writer.join();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        // stdout carries the frames, so report on stderr
+        fprintf(stderr, "Transformed %d %dx%d frames, %.1f fps\n", numFrames, sFrameWidth, sFrameHeight, seconds > 0.0 ? numFrames / seconds : 0.0);
+
+        if (tileCache && numFrames > 0)
+            fprintf(stderr, "Skipped %.1f%% of tiles overall\n", 100.0 * tilesSkipped / (int64_t(numFrames) * tileCache->NumTiles()));
+
+        if (partialBytes > 0)
+            fprintf(stderr, "Ignored %zu trailing bytes of incomplete frame\n", partialBytes);
+
+        for (uint8_t* frame : frames)
+            delete[] frame;
+        delete[] pixels;
+        delete tileCache;
+
+        return !writeFailed;
+    }
+
+    void CreateImage(tImageOp op, tCBType cbType, float strength, int w, int h, const RGBA32* dataIn, const cPalettedImage* paletted, const char* dataInPath, int maxDim, const char* dataInName, tApplyMode mode, tLUTLayout layout)
+    {
+        // Bands are decoded to RGBA before they're transformed, so there's no decode to apply the LUT during
+        if (!dataIn && dataInPath && sBandRows > 0 && (mode == kApplyDecodeLUT || mode == kApplyDecodeYCbCrLUT))
+        {
+            fprintf(stderr, "Can't apply the LUT during decode (-j, -J) with --band\n");
+            return;
+        }
+
+        if (cbType == kAll)
+        {
+            CreateImage(op, kProtanope,   strength, w, h, dataIn, paletted, dataInPath, maxDim, dataInName, mode, layout);
+            CreateImage(op, kDeuteranope, strength, w, h, dataIn, paletted, dataInPath, maxDim, dataInName, mode, layout);
+            CreateImage(op, kTritanope,   strength, w, h, dataIn, paletted, dataInPath, maxDim, dataInName, mode, layout);
+            return;
+        };
+
+        // If the source decode was deferred, we decode it with the LUT applied
+        const bool decodeInput = !dataIn && dataInPath;
+
+        if (cbType < kIdentity || cbType >= kAll)
+            return;
+
+        tLMS lmsType = kCBTypeLMS[cbType];
+        char filename[256] = "";
+
+        if (dataIn || decodeInput)
+            snprintf(filename, sizeof(filename), "%s_", dataInName);
+
+        strcat(filename, kCBTypeNames[cbType]);
+
+        cLUTs* luts = new cLUTs;
+        RGBA32* dataOut = 0;
+        int n = dataIn ? w * h : 0;
+
+        // For paletted sources only the palette needs transforming, and as
+        // that's at most 256 entries, it's done directly rather than via a LUT.
+        RGBA32 paletteOut[256];
+        const bool paletteOnly = paletted && paletted->indices && dataIn;
+
+        if (paletteOnly)
+        {
+            if (mode != kApplyFixed)
+                mode = kApplyDirect;
+
+            n = paletted->paletteSize;
+            dataIn = paletted->palette;
+            dataOut = paletteOut;
+        }
+        else if ((mode == kApplyDirect || mode == kApplyFixed) && dataIn) 
+            dataOut = (RGBA32*) PoolAlloc(n * sizeof(RGBA32));
+        else if (sFrameY4M && !dataIn && !decodeInput)
+            mode = sFrameY4MInfo.full_range ? kApplyVideoFullLUT : kApplyVideoLUT;
+        
+        PerformImageOp(op, lmsType, strength, mode, luts, n, dataIn, dataOut);
+        strcat(filename, kImageOpSuffixes[op]);
+
+        // Converted to 'layout' once, along with the LUTs, for whichever way they're applied below
+        const cLayoutLUT layoutLUT(luts->rgba, (mode == kApplyLUT || mode == kApplyDecodeLUT) ? layout : kLayoutLinear);
+
+        if (dataIn && !dataOut)
+        {
+            dataOut = (RGBA32*) PoolAlloc(n * sizeof(RGBA32));
+
+            if (!dataOut)
+            {
+                fprintf(stderr, "Out of memory for %s\n", filename);
+                delete luts;
+                return;
+            }
+
+            if (mode == kApplyShapedLUT)
+            {
+                ShaperLUT shaper;
+                CreateShaperLUT(&shaper);
+                ApplyShapedLUT(shaper, luts->shaped, n, dataIn, dataOut);
+            }
+            else
+                layoutLUT.Apply(n, dataIn, dataOut);
+        }
+
+        if (paletteOnly)
+            SaveIndexedImage(filename, w, h, paletted->indices, paletteOut, n);
+        else if (decodeInput && sBandRows > 0)
+        {
+            if (!StreamImage(filename, dataInPath, op, lmsType, strength, mode, luts, layoutLUT))
+                fprintf(stderr, "Couldn't process %s\n", dataInPath);
+        }
+        else if (decodeInput)
+        {
+            RGBA32* dataDecoded = LoadImageWithLUT(dataInPath, maxDim, luts, mode, &w, &h);
+
+            if (dataDecoded)
+            {
+                SaveImage(filename, w, h, dataDecoded);
+                stbi_image_free(dataDecoded);
+            }
+            else
+                fprintf(stderr, "Couldn't read %s\n", dataInPath);
+        }
+        else if (dataOut)
+        {
+            SaveImage(filename, w, h, dataOut);
+            PoolFree(dataOut);
+        }
+        else if (sFrameWidth > 0)
+        {
+            if (!StreamFrames(op, lmsType, strength, mode, luts, layoutLUT))
+                fprintf(stderr, "Couldn't write frames\n");
+        }
+        else if (mode == kApplyShapedLUT)
+        {
+            strcat(filename, "_shaped_lut");
+            SaveImage(filename, kShapedLUTSize * kShapedLUTSize, kShapedLUTSize, luts->shaped);
+        }
+        else if (mode == kApplyDecodeYCbCrLUT)
+        {
+            strcat(filename, "_ycbcr_lut");
+            SaveImage(filename, kLUTSize * kLUTSize, kLUTSize, luts->ycc);
+        }
+        else
+        {
+            strcat(filename, "_lut");
+            SaveImage(filename, kLUTSize * kLUTSize, kLUTSize, luts->rgba);
+        }
+
+        delete luts;
+    }
+
+    void GetFileName(char* buffer, size_t bufferSize, const char* path);
+
+    // Returns the name each of 'paths' has its outputs saved under. This is
+    // its file name, with a number added if an earlier path has already
+    // taken it, as with a/x.png and b/x.png, so neither overwrites the other.
+    std::vector<std::string> GetOutputNames(const std::vector<std::string>& paths)
+    {
+        std::vector<std::string> names(paths.size());
+        std::set<std::string> taken;
+
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            char name[256];
+            GetFileName(name, sizeof(name), paths[i].c_str());
+
+            names[i] = name;
+
+            for (int n = 2; !taken.insert(names[i]).second; n++)
+                names[i] = std::string(name) + "_" + std::to_string(n);
+
+            if (names[i] != name)
+                printf("Saving %s as %s, as %s is already taken\n", paths[i].c_str(), names[i].c_str(), name);
+        }
+
+        return names;
+    }
+
+    // Batch processing, where ops are applied to many files in one process. The
+    // LUT for each op is built once and shared, and the (file x op) jobs are
+    // spread over all hardware threads.
+    struct cBatchOp
+    {
+        tImageOp    op;
+        tCBType     cbType;         // a single type, kAll is expanded
+        float       strength;
+        tApplyMode  mode;
+        tLUTLayout  layout;
+
+        cLUTs*      luts      = 0;  // set up by RunBatch
+        cLayoutLUT* layoutLUT = 0;
+    };
+
+    struct cBatchFile
+    {
+        const char*      path = 0;
+        const char*      name = 0;      // for its outputs, from GetOutputNames
+        int              index = 0;     // into the batch's paths
+        std::once_flag   loaded;
+        std::atomic<int> jobsLeft;  // the image is freed once this reaches 0
+        RGBA32*          data = 0;
+        cPalettedImage   paletted;
+        int              w = 0;
+        int              h = 0;
+    };
+
+    void AddBatchOps(std::vector<cBatchOp>* ops, tImageOp op, tCBType cbType, float strength, tApplyMode mode, tLUTLayout layout)
+    {
+        if (cbType == kAll)
+        {
+            AddBatchOps(ops, op, kProtanope,   strength, mode, layout);
+            AddBatchOps(ops, op, kDeuteranope, strength, mode, layout);
+            AddBatchOps(ops, op, kTritanope,   strength, mode, layout);
+            return;
+        }
+
+        // There's no per-file LUT to apply during decode
+        if (mode == kApplyDecodeLUT || mode == kApplyDecodeYCbCrLUT)
+            mode = kApplyLUT;
+
+        cBatchOp batchOp;
+        batchOp.op       = op;
+        batchOp.cbType   = cbType;
+        batchOp.strength = strength;
+        batchOp.mode     = mode;
+        batchOp.layout   = layout;
+
+        ops->push_back(batchOp);
+    }
+
+    // Adds the images given by 'source' to 'paths'. This can be a directory, a
+    // wildcard pattern, a single image, or a file listing images one per line.
+    bool FindBatchFiles(const char* source, std::vector<std::string>* paths)
+    {
+        int w, h;
+        size_t first = paths->size();
+
+    #ifdef _MSC_VER
+        struct _stat info;
+        bool isDir = _stat(source, &info) == 0 && (info.st_mode & _S_IFDIR);
+
+        if (isDir || strpbrk(source, "*?"))
+        {
+            std::string dir(source);
+            std::string pattern(source);
+
+            if (isDir)
+                pattern += "\\*";
+            else
+                dir.resize(dir.find_last_of("/\\") == std::string::npos ? 0 : dir.find_last_of("/\\"));
+
+            _finddata_t entry;
+            intptr_t handle = _findfirst(pattern.c_str(), &entry);
+
+            for (bool found = handle != -1; found; found = _findnext(handle, &entry) == 0)
+            {
+                std::string path = dir.empty() ? entry.name : dir + "/" + entry.name;
+
+                if (entry.name[0] != '.' && !(entry.attrib & _A_SUBDIR) && GetImageInfo(path.c_str(), &w, &h))
+                    paths->push_back(path);
+            }
+
+            if (handle != -1)
+                _findclose(handle);
+
+            std::sort(paths->begin() + first, paths->end());
+            return true;
+        }
+    #else
+        if (strpbrk(source, "*?["))
+        {
+            glob_t matches;
+
+            if (glob(source, 0, 0, &matches) == 0)
+                for (size_t i = 0; i < matches.gl_pathc; i++)
+                    if (GetImageInfo(matches.gl_pathv[i], &w, &h))
+                        paths->push_back(matches.gl_pathv[i]);
+
+            globfree(&matches);
+            return true;
+        }
+
+        struct stat info;
+
+        if (stat(source, &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            DIR* dir = opendir(source);
+            if (!dir)
+                return false;
+
+            while (dirent* entry = readdir(dir))
+            {
+                std::string path = std::string(source) + "/" + entry->d_name;
+
+                if (entry->d_name[0] != '.' && GetImageInfo(path.c_str(), &w, &h))
+                    paths->push_back(path);
+            }
+
+            closedir(dir);
+
+            std::sort(paths->begin() + first, paths->end());
+            return true;
+        }
+    #endif
+
+        if (GetImageInfo(source, &w, &h))
+        {
+            paths->push_back(source);
+            return true;
+        }
+
+        FILE* list = fopen(source, "r");
+        if (!list)
+            return false;
+
+        char line[1024];
+
+        while (fgets(line, sizeof(line), list))
+        {
+            line[strcspn(line, "\r\n")] = 0;
+
+            if (line[0])
+                paths->push_back(line);
+        }
+
+        fclose(list);
+        return true;
+    }
+
+    // Runs task(i) for i in [0, count) over all hardware threads. Each thread
+    // starts on its own contiguous range of indices, so neighbouring jobs stay
+    // together, and once that's done, steals the back half of the largest
+    // range remaining, so the load stays balanced however uneven the jobs are.
+    template<class T> void WorkStealingFor(int count, T task)
+    {
+        struct cRange
+        {
+            std::mutex mutex;
+            int        begin = 0;
+            int        end   = 0;
+        };
+
+        // On a pool thread, the pool is already busy, so this runs serially
+        const int numThreads = sOnPoolThread ? 1 : std::max(std::min(int(std::thread::hardware_concurrency()), count), 1);
+        std::vector<cRange> ranges(numThreads);
+
+        for (int i = 0; i < numThreads; i++)
+        {
+            ranges[i].begin = int(int64_t(count) * i       / numThreads);
+            ranges[i].end   = int(int64_t(count) * (i + 1) / numThreads);
+        }
+
+        auto worker = [&](int self)
+        {
+            cPoolThreadScope scope;
+            cRange& own = ranges[self];
+
+            for (;;)
+            {
+                int index = -1;
+                {
+                    std::lock_guard<std::mutex> lock(own.mutex);
+
+                    if (own.begin < own.end)
+                        index = own.begin++;
+                }
+
+                if (index >= 0)
+                {
+                    task(index);
+                    continue;
+                }
+
+                int victim = -1;
+                int most   = 0;
+
+                for (int i = 0; i < numThreads; i++)
+                {
+                    std::lock_guard<std::mutex> lock(ranges[i].mutex);
+
+                    if (ranges[i].end - ranges[i].begin > most)
+                    {
+                        most   = ranges[i].end - ranges[i].begin;
+                        victim = i;
+                    }
+                }
+
+                if (victim < 0)
+                    return;
+
+                int begin;
+                int end;
+                {
+                    std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+
+                    // Rounded up, so the last job of a range can be taken too
+                    end   = ranges[victim].end;
+                    begin = end - (end - ranges[victim].begin + 1) / 2;
+
+                    ranges[victim].end = begin;
+                }
+
+                std::lock_guard<std::mutex> lock(own.mutex);
+                own.begin = begin;
+                own.end   = end;
+            }
+        };
+
+        sThreadPool.Run(numThreads, worker);
+    }
+
+    // Apply 'batchOp' to 'file', returning the new image, or for paletted
+    // sources, just the new palette, or 0 if there's no memory for it
+    RGBA32* TransformBatchJob(const cBatchOp& batchOp, const ShaperLUT& shaper, const cBatchFile& file)
+    {
+        const tLMS lmsType = kCBTypeLMS[batchOp.cbType];
+
+        if (file.paletted.indices)
+        {
+            // As with CreateImage, only the palette needs transforming
+            RGBA32* paletteOut = (RGBA32*) PoolAlloc(256 * sizeof(RGBA32));
+            tApplyMode mode = (batchOp.mode == kApplyFixed) ? kApplyFixed : kApplyDirect;
+
+            if (!paletteOut)
+                return 0;
+
+            ApplyImageOp(batchOp.op, lmsType, batchOp.strength, mode, batchOp.luts, shaper, *batchOp.layoutLUT, file.paletted.paletteSize, file.paletted.palette, paletteOut);
+            return paletteOut;
+        }
+
+        RGBA32* dataOut = (RGBA32*) PoolAlloc(size_t(file.w) * file.h * sizeof(RGBA32));
+
+        if (!dataOut)
+            return 0;
+
+        ApplyImageOp(batchOp.op, lmsType, batchOp.strength, batchOp.mode, batchOp.luts, shaper, *batchOp.layoutLUT, file.w * file.h, file.data, dataOut);
+        return dataOut;
+    }
+
+    // Save the result of TransformBatchJob
+    void SaveBatchJob(const cBatchOp& batchOp, const cBatchFile& file, const RGBA32* result)
+    {
+        char filename[300];     // room for the longest name, plus a number to make it unique, and the longest type and suffix
+        snprintf(filename, sizeof(filename), "%s_%s%s", file.name, kCBTypeNames[batchOp.cbType], kImageOpSuffixes[batchOp.op]);
+
+        if (!result)
+            fprintf(stderr, "Out of memory for %s\n", filename);
+        else if (file.paletted.indices)
+            SaveIndexedImage(filename, file.w, file.h, file.paletted.indices, result, file.paletted.paletteSize);
+        else
+            SaveImage(filename, file.w, file.h, result);
+    }
+
+    bool LoadBatchFile(cBatchFile* file, int maxDim)
+    {
+        if (sAsyncIO)
+        {
+            size_t size;
+            uint8_t* data = sAsyncIO->Read(file->index, &size);
+
+            if (data)
+                file->data = LoadImageFromMemory(data, size, &file->w, &file->h, maxDim, &file->paletted);
+
+            PoolFree(data);
+        }
+        else
+            file->data = LoadImage(file->path, &file->w, &file->h, maxDim, &file->paletted);
+
+        if (!file->data)
+            fprintf(stderr, "Couldn't read %s\n", file->path);
+
+        return file->data != 0;
+    }
+
+    void FreeBatchFile(cBatchFile* file)
+    {
+        stbi_image_free(file->data);
+        stbi_image_free(file->paletted.indices);
+        file->data = 0;
+        file->paletted.indices = 0;
+    }
+
+    // Run each (file x op) job in full on a work-stealing pool
+    int RunBatchJobs(const std::vector<std::string>& paths, const std::vector<std::string>& names, const std::vector<cBatchOp>& ops, const ShaperLUT& shaper, int maxDim)
+    {
+        const int numOps = int(ops.size());
+        std::vector<cBatchFile> files(paths.size());
+
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            files[i].path = paths[i].c_str();
+            files[i].name = names[i].c_str();
+            files[i].index = int(i);
+            files[i].jobsLeft = numOps;
+        }
+
+        std::atomic<int> numFailed(0);
+
+        WorkStealingFor(int(files.size()) * numOps,
+            [&](int job)
+            {
+                cBatchFile& file = files[job / numOps];
+
+                std::call_once(file.loaded,
+                    [&]()
+                    {
+                        if (!LoadBatchFile(&file, maxDim))
+                            numFailed++;
+                    }
+                );
+
+                if (file.data)
+                {
+                    const cBatchOp& batchOp = ops[job % numOps];
+                    RGBA32* result = TransformBatchJob(batchOp, shaper, file);
+
+                    SaveBatchJob(batchOp, file, result);
+                    PoolFree(result);
+                }
+
+                if (--file.jobsLeft == 0)
+                    FreeBatchFile(&file);
+            }
+        );
+
+        return numFailed;
+    }
+
+    // A queue of fixed capacity shared between pipeline stages. Push blocks
+    // while it's full, which throttles earlier stages to the pace of later
+    // ones, and so bounds the number of images in flight.
+    template<class T> struct cBoundedQueue
+    {
+        std::mutex              mutex;
+        std::condition_variable changed;
+        std::deque<T>           items;
+        size_t                  capacity;
+        int                     producers;  // Pop fails once all have called Finish and the queue is empty
+
+        cBoundedQueue(size_t capacityIn, int producersIn) : capacity(capacityIn), producers(producersIn) {}
+
+        void Push(const T& item)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return items.size() < capacity; });
+
+            items.push_back(item);
+            changed.notify_all();
+        }
+
+        bool Pop(T* item)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return !items.empty() || producers == 0; });
+
+            if (items.empty())
+                return false;
+
+            *item = items.front();
+            items.pop_front();
+            changed.notify_all();
+            return true;
+        }
+
+        void Finish()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            producers--;
+            changed.notify_all();
+        }
+    };
+
+    const char* kBatchStageNames[kNumBatchStages] = { "decode", "transform", "encode" };
+
+    // Where a stage's threads spent their time, in ns, summed over threads
+    struct cStageStats
+    {
+        std::atomic<int64_t> busy   {0};
+        std::atomic<int64_t> starved{0};    // waiting for input
+        std::atomic<int64_t> blocked{0};    // waiting for room in the next stage's queue
+        std::atomic<int>     items  {0};
+    };
+
+    // Returns the ns since 't', and resets it to now
+    int64_t Lap(std::chrono::steady_clock::time_point* t)
+    {
+        auto now = std::chrono::steady_clock::now();
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - *t).count();
+
+        *t = now;
+        return ns;
+    }
+
+    struct cBatchResult
+    {
+        cBatchFile* file;
+        int         opIndex;
+        RGBA32*     data;
+    };
+
+    // Run the batch as a three-stage pipeline, with sBatchStageThreads threads
+    // decoding files, applying all ops to each, and encoding and saving the
+    // results. So the decode of one file overlaps with the transform of the
+    // one before and the encode of the one before that. The queues between
+    // stages hold one source per transform thread, and two results per encode
+    // thread, beyond those being worked on.
+    int RunBatchPipeline(const std::vector<std::string>& paths, const std::vector<std::string>& names, const std::vector<cBatchOp>& ops, const ShaperLUT& shaper, int maxDim)
+    {
+        const int numFiles = int(paths.size());
+        const int numOps   = int(ops.size());
+        const int* threads = sBatchStageThreads;
+
+        cBoundedQueue<cBatchFile*>  decoded(threads[kStageTransform],     threads[kStageDecode]);
+        cBoundedQueue<cBatchResult> encoded(threads[kStageEncode] * 2, threads[kStageTransform]);
+
+        cStageStats stats[kNumBatchStages];
+        std::atomic<int> nextFile(0);
+        std::atomic<int> numFailed(0);
+
+        auto decode = [&]()
+        {
+            cPoolThreadScope scope;
+            cStageStats& stage = stats[kStageDecode];
+            auto t = std::chrono::steady_clock::now();
+
+            for (int i; (i = nextFile++) < numFiles; )
+            {
+                cBatchFile* file = new cBatchFile;
+                file->path = paths[i].c_str();
+                file->name = names[i].c_str();
+                file->index = i;
+                file->jobsLeft = numOps;
+
+                bool loaded = LoadBatchFile(file, maxDim);
+                stage.busy += Lap(&t);
+
+                if (!loaded)
+                {
+                    numFailed++;
+                    delete file;
+                    continue;
+                }
+
+                decoded.Push(file);
+                stage.blocked += Lap(&t);
+                stage.items++;
+            }
+
+            decoded.Finish();
+        };
+
+        auto transform = [&]()
+        {
+            cPoolThreadScope scope;
+            cStageStats& stage = stats[kStageTransform];
+            auto t = std::chrono::steady_clock::now();
+            cBatchFile* file;
+
+            while (decoded.Pop(&file))
+            {
+                stage.starved += Lap(&t);
+
+                for (int i = 0; i < numOps; i++)
+                {
+                    cBatchResult result = { file, i, TransformBatchJob(ops[i], shaper, *file) };
+                    stage.busy += Lap(&t);
+
+                    encoded.Push(result);
+                    stage.blocked += Lap(&t);
+                }
+
+                stage.items++;
+            }
+
+            stage.starved += Lap(&t);
+            encoded.Finish();
+        };
+
+        auto encode = [&]()
+        {
+            cPoolThreadScope scope;
+            cStageStats& stage = stats[kStageEncode];
+            auto t = std::chrono::steady_clock::now();
+            cBatchResult result;
+
+            while (encoded.Pop(&result))
+            {
+                stage.starved += Lap(&t);
+
+                SaveBatchJob(ops[result.opIndex], *result.file, result.data);
+                PoolFree(result.data);
+
+                if (--result.file->jobsLeft == 0)
+                {
+                    FreeBatchFile(result.file);
+                    delete result.file;
+                }
+
+                stage.busy += Lap(&t);
+                stage.items++;
+            }
+
+            stage.starved += Lap(&t);
+        };
+
+        auto startTime = std::chrono::steady_clock::now();
+        std::vector<std::thread> stageThreads;
+
+        for (int i = 0; i < threads[kStageDecode]; i++)
+            stageThreads.emplace_back(decode);
+        for (int i = 0; i < threads[kStageTransform]; i++)
+            stageThreads.emplace_back(transform);
+        for (int i = 0; i < threads[kStageEncode]; i++)
+            stageThreads.emplace_back(encode);
+
+        for (std::thread& thread : stageThreads)
+            thread.join();
+
+        int64_t elapsed = Lap(&startTime);
+
+        // Percentages are of the stage's total thread time. A stage that's
+        // mostly busy is the bottleneck, and would benefit from more threads.
+        for (int i = 0; i < kNumBatchStages; i++)
+        {
+            double total = double(elapsed) * threads[i] * 0.01;
+
+            printf("  %-9s : %d threads, %5.1f%% busy, %5.1f%% waiting for input, %5.1f%% blocked on output, %d items\n",
+                kBatchStageNames[i],
+                threads[i],
+                stats[i].busy    / total,
+                stats[i].starved / total,
+                stats[i].blocked / total,
+                int(stats[i].items)
+            );
+        }
+
+        return numFailed;
+    }
+
+    // Set up the LUTs batchOp's mode calls for
+    void CreateBatchOpLUTs(cBatchOp* batchOp)
+    {
+        batchOp->luts = new cLUTs;
+
+        if (batchOp->mode != kApplyDirect && batchOp->mode != kApplyFixed)
+            PerformImageOp(batchOp->op, kCBTypeLMS[batchOp->cbType], batchOp->strength, batchOp->mode, batchOp->luts, 0, 0, 0);
+
+        batchOp->layoutLUT = new cLayoutLUT(batchOp->luts->rgba, batchOp->mode == kApplyLUT ? batchOp->layout : kLayoutLinear);
+    }
+
+    // Apply all 'ops' to all the images in 'paths', either through the
+    // work-stealing pool, or if sBatchStageThreads is set, the pipeline.
+    void RunBatch(const std::vector<std::string>& paths, std::vector<cBatchOp>& ops, int maxDim)
+    {
+        auto startTime = std::chrono::steady_clock::now();
+
+        const std::vector<std::string> names = GetOutputNames(paths);
+
+        ShaperLUT shaper;
+        CreateShaperLUT(&shaper);
+
+        WorkStealingFor(int(ops.size()), [&](int i) { CreateBatchOpLUTs(&ops[i]); });
+
+        // The jobs already occupy every thread, so JPEGs are decoded and PNGs
+        // deflated serially
+        stbi_set_jpeg_parallel(0, 0);
+        stbi_set_write_png_parallel(0, 0);
+
+        if (sAsyncIODepth > 0)
+            sAsyncIO = new cAsyncIO(paths, sAsyncIODepth);
+
+        bool asyncIO = sAsyncIO && sAsyncIO->IsAsync();
+        int numFailed;
+
+        if (sBatchStageThreads[kStageDecode] > 0)
+            numFailed = RunBatchPipeline(paths, names, ops, shaper, maxDim);
+        else
+            numFailed = RunBatchJobs(paths, names, ops, shaper, maxDim);
+
+        delete sAsyncIO;    // waits for any outstanding writes
+        sAsyncIO = 0;
+
+        stbi_set_write_png_parallel(ParallelFor, 0);
+        if (sParallelJPEG)
+            stbi_set_jpeg_parallel(ParallelFor, 0);
+
+        for (cBatchOp& batchOp : ops)
+        {
+            delete batchOp.layoutLUT;
+            delete batchOp.luts;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        printf("Processed %d files x %d ops in %.2fs", int(paths.size()) - numFailed, int(ops.size()), seconds);
+        if (sBatchStageThreads[kStageDecode] == 0)
+            printf(" on %d threads", std::max(int(std::thread::hardware_concurrency()), 1));
+        if (asyncIO)
+            printf(", with up to %d reads and writes in flight", sAsyncIODepth);
+        if (numFailed > 0)
+            printf(", %d files couldn't be read", numFailed);
+        printf("\n");
+
+        PrintMemoryStats();
+    }
+
+    // Report mode, which produces the comparison images and results markdown
+    // for a set of test images in one process, in place of the generate script.
+    enum tReportImage
+    {
+        kReportOriginal,
+        kReportDaltonised,
+        kReportCorrected,
+        kReportSimulated,
+        kReportDaltonisedSimulated,
+        kReportCorrectedSimulated,
+        kNumReportImages
+    };
+
+    struct cReportImageInfo { tImageOp op; const char* suffix; const char* altText; } kReportImages[kNumReportImages] =
+    {
+        { kPassThrough,         "_identity",            "Original"              },
+        { kDaltonise,           "_daltonise",           "Daltonised"            },
+        { kCorrect,             "_correct",             "Corrected"             },
+        { kSimulate,            "_simulate",            "Simulated"             },
+        { kDaltoniseSimulate,   "_simulate_daltonised", "Simulated Daltonised"  },
+        { kCorrectSimulate,     "_simulate_corrected",  "Simulated Corrected"   },
+    };
+
+    const char* kReportTitles[] = { "", "Protanopia", "Deuteranopia", "Tritanopia" };
+
+    const int kReportSheetGap = 4;      // border around contact sheet cells
+
+    bool MakeDirectory(const char* path)
+    {
+    #ifdef _MSC_VER
+        return _mkdir(path) == 0 || errno == EEXIST;
+    #else
+        return mkdir(path, 0777) == 0 || errno == EEXIST;
+    #endif
+    }
+
+    // Hand 'text' to the output sink as the file 'filename'
+    void WriteTextFile(const std::string& filename, const std::string& text)
+    {
+        uint8_t* data = (uint8_t*) PoolAlloc(text.size());
+
+        if (!data)
+        {
+            fprintf(stderr, "Out of memory saving %s\n", filename.c_str());
+            return;
+        }
+
+        memcpy(data, text.data(), text.size());
+
+        printf("Saving %s\n", filename.c_str());
+        sOutputSink->Write(filename.c_str(), data, text.size());
+    }
+
+    struct cReportFile
+    {
+        std::string name;
+        bool        loaded = false;
+        int         cellHeight = 0;
+        RGBA32*     cells[kAll][kNumReportImages] = {};   // contact sheet cells, by tCBType, if --sheet is set
+    };
+
+    // Write one contact sheet for cbType, with a row of report images per source
+    void SaveReportSheet(const char* outDir, tCBType cbType, const std::vector<cReportFile>& files)
+    {
+        const int cellWidth = sReportSheetWidth;
+        const int w = kNumReportImages * (cellWidth + kReportSheetGap) + kReportSheetGap;
+        int h = kReportSheetGap;
+
+        for (const cReportFile& file : files)
+            if (file.loaded)
+                h += file.cellHeight + kReportSheetGap;
+
+        char filename[300];
+        snprintf(filename, sizeof(filename), "%s/sheet-%s", outDir, kCBTypeNames[cbType]);
+
+        RGBA32* sheet = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+
+        if (!sheet)
+        {
+            fprintf(stderr, "Out of memory saving %s\n", filename);
+            return;
+        }
+
+        memset(sheet, 0xFF, size_t(w) * h * sizeof(RGBA32));
+
+        int y0 = kReportSheetGap;
+
+        for (const cReportFile& file : files)
+        {
+            if (!file.loaded)
+                continue;
+
+            for (int i = 0; i < kNumReportImages; i++)
+            {
+                const int x0 = kReportSheetGap + i * (cellWidth + kReportSheetGap);
+
+                if (!file.cells[cbType][i])     // couldn't be allocated, so left blank
+                    continue;
+
+                for (int y = 0; y < file.cellHeight; y++)
+                    memcpy(sheet + size_t(y0 + y) * w + x0, file.cells[cbType][i] + size_t(y) * cellWidth, cellWidth * sizeof(RGBA32));
+            }
+
+            y0 += file.cellHeight + kReportSheetGap;
+        }
+
+        SaveImage(filename, w, h, sheet);
+
+        PoolFree(sheet);
+    }
+
+    // Write the original, daltonised, corrected, simulated, and simulated
+    // daltonised/corrected versions of each source to outDir/<name>/, for
+    // each type of colour blindness, along with results-<type>.md files
+    // showing them side by side, and if sReportSheetWidth is set, the same
+    // composited into sheet-<type>.png. Tritanope results start from the
+    // source remapped by -rL, as the test images are for red-green colour
+    // blindness. Each source is decoded once, and unless 'mode' is direct,
+    // its results for a type are all produced in a single pass over it, with
+    // the LUT coordinates for each pixel found once and shared by all ops.
+    // Returns false if outDir couldn't be created, or any source failed.
+    bool RunReport(const std::vector<std::string>& paths, const char* outDir, float strength, tApplyMode mode, int maxDim)
+    {
+        auto startTime = std::chrono::steady_clock::now();
+
+        // Archive entries are simply named by path, so directories are only needed for files
+        const bool makeDirs = sOutputSink == &sFileSink;
+
+        if (makeDirs && !MakeDirectory(outDir))
+        {
+            fprintf(stderr, "Couldn't create %s\n", outDir);
+            return false;
+        }
+
+        // Indexed by type and then report image. The entries for the originals go unused.
+        const bool useLUTs = mode != kApplyDirect && mode != kApplyFixed;
+        const int  numLUTs = useLUTs ? kAll * kNumReportImages : 0;
+        cLUTs*     luts    = new cLUTs[numLUTs];
+
+        WorkStealingFor(numLUTs,
+            [&](int index)
+            {
+                const int cbType = index / kNumReportImages;
+                const int i      = index % kNumReportImages;
+
+                if (cbType != kIdentity && i != kReportOriginal)
+                    PerformImageOp(kReportImages[i].op, kCBTypeLMS[cbType], strength, kApplyLUT, &luts[index], 0, 0, 0);
+            }
+        );
+
+        std::vector<cReportFile> files(paths.size());
+        const std::vector<std::string> names = GetOutputNames(paths);
+
+        // The files already occupy every thread, so JPEGs are decoded and PNGs
+        // deflated serially
+        stbi_set_jpeg_parallel(0, 0);
+        stbi_set_write_png_parallel(0, 0);
+
+        WorkStealingFor(int(files.size()),
+            [&](int index)
+            {
+                cReportFile& file = files[index];
+                const char*  path = paths[index].c_str();
+
+                const char*  name = names[index].c_str();
+                file.name = name;
+
+                int w, h;
+                RGBA32* source = LoadImage(path, &w, &h, maxDim);
+
+                if (!source)
+                {
+                    fprintf(stderr, "Couldn't read %s\n", path);
+                    return;
+                }
+
+                std::string dir = std::string(outDir) + "/" + name;
+
+                if (makeDirs && !MakeDirectory(dir.c_str()))
+                {
+                    fprintf(stderr, "Couldn't create %s\n", dir.c_str());
+                    stbi_image_free(source);
+                    return;
+                }
+
+                const int n = w * h;
+
+                RGBA32* remapped = (RGBA32*) PoolAlloc(size_t(n) * sizeof(RGBA32));
+                RGBA32* results[kNumReportImages] = {};
+                bool allocated = remapped != 0;
+
+                for (int i = kReportDaltonised; i < kNumReportImages; i++)
+                    allocated &= (results[i] = (RGBA32*) PoolAlloc(size_t(n) * sizeof(RGBA32))) != 0;
+
+                if (!allocated)
+                {
+                    fprintf(stderr, "Out of memory for %s\n", path);
+
+                    for (RGBA32* result : results)
+                        PoolFree(result);
+
+                    PoolFree(remapped);
+                    stbi_image_free(source);
+                    return;
+                }
+
+                Transform(RemapLToS, n, source, remapped);
+
+                file.cellHeight = std::max(int(int64_t(h) * sReportSheetWidth / w), 1);
+
+                for (int cbType = kProtanope; cbType < kAll; cbType++)
+                {
+                    const RGBA32* original = (cbType == kTritanope) ? remapped : source;
+
+                    if (useLUTs)
+                    {
+                        const RGBA32 (*rgbLUTs[kNumReportImages])[kLUTSize][kLUTSize];
+
+                        for (int i = kReportDaltonised; i < kNumReportImages; i++)
+                            rgbLUTs[i] = luts[cbType * kNumReportImages + i].rgba;
+
+                        ApplyLUTs(rgbLUTs + kReportDaltonised, kNumReportImages - kReportDaltonised, n, original, results + kReportDaltonised);
+                    }
+                    else
+                        for (int i = kReportDaltonised; i < kNumReportImages; i++)
+                            PerformImageOp(kReportImages[i].op, kCBTypeLMS[cbType], strength, mode, 0, n, original, results[i]);
+
+                    for (int i = 0; i < kNumReportImages; i++)
+                    {
+                        const RGBA32* image = (i == kReportOriginal) ? original : results[i];
+
+                        char filename[300];
+                        snprintf(filename, sizeof(filename), "%s/%s_%s%s", dir.c_str(), name, kCBTypeNames[cbType], kReportImages[i].suffix);
+                        SaveImage(filename, w, h, image);
+
+                        if (sReportSheetWidth > 0)
+                            file.cells[cbType][i] = DownscaleImage(image, w, h, sReportSheetWidth, file.cellHeight);
+                    }
+                }
+
+                for (RGBA32* result : results)
+                    PoolFree(result);
+
+                PoolFree(remapped);
+                stbi_image_free(source);
+
+                file.loaded = true;
+            }
+        );
+
+        stbi_set_write_png_parallel(ParallelFor, 0);
+        if (sParallelJPEG)
+            stbi_set_jpeg_parallel(ParallelFor, 0);
+        delete[] luts;
+
+        int numLoaded = 0;
+
+        for (const cReportFile& file : files)
+            numLoaded += file.loaded;
+
+        for (int cbType = kProtanope; cbType < kAll; cbType++)
+        {
+            std::string text = std::string("Results for ") + kReportTitles[cbType] + "\n"
+                "-------\n"
+                "\n"
+                "From left to right: original, Daltonised (Fidaner), corrected (Willmott),\n"
+                "simulated colour blindness, Daltonised + simulated, corrected + simulated.\n"
+                "\n";
+
+            for (const cReportFile& file : files)
+            {
+                if (!file.loaded)
+                    continue;
+
+                text += file.name + "\n---\n\n";
+
+                for (const cReportImageInfo& image : kReportImages)
+                {
+                    char line[600];
+                    snprintf(line, sizeof(line), "<img src=\"%s/%s_%s%s.%s\" alt=\"%s\" width=\"%d\"/>\n",
+                        file.name.c_str(), file.name.c_str(), kCBTypeNames[cbType], image.suffix, kImageFormatNames[sOutputFormat], image.altText, sReportDisplayWidth);
+                    text += line;
+                }
+
+                text += "\n";
+            }
+
+            WriteTextFile(std::string(outDir) + "/results-" + kCBTypeNames[cbType] + ".md", text);
+
+            if (sReportSheetWidth > 0 && numLoaded > 0)
+                SaveReportSheet(outDir, tCBType(cbType), files);
+        }
+
+        for (cReportFile& file : files)
+            for (auto& cells : file.cells)
+                for (RGBA32* cell : cells)
+                    PoolFree(cell);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+        printf("Reported on %d files in %.2fs\n", numLoaded, seconds);
+
+        return numLoaded == int(files.size());
+    }
+
+#ifndef _MSC_VER
+    // Daemon mode, where images to transform arrive over a Unix socket, so
+    // callers don't pay for process startup and LUT construction each time.
+    // Each request is a cServeRequest, followed by 'size' bytes of w x h RGBA
+    // pixels, or with kServeEncoded, of an image file to decode. With
+    // kServeShared, the pixels are instead in a shared memory fd passed along
+    // with the request, and are transformed in place. Each request is answered
+    // by a cServeResponse, followed, unless shared, by the resulting pixels.
+    // A connection can make any number of requests, one after the other. All
+    // fields are in the host's byte order.
+    const uint32_t kServeMagic = 0x43424C01;
+
+    enum tServeFlags
+    {
+        kServeEncoded = 1,
+        kServeShared  = 2,
+    };
+
+    enum tServeStatus
+    {
+        kServeOK,
+        kServeBadRequest,       // unknown op, type, or mode, strength outside [0, 1], or bad size. The connection is closed after this.
+        kServeDecodeFailed,
+        kServeMapFailed,        // shared memory was too small, or couldn't be mapped or read
+        kNumServeStatuses
+    };
+
+    const char* kServeStatusNames[kNumServeStatuses] = { "ok", "bad request", "couldn't decode image", "couldn't map shared memory" };
+
+    struct cServeRequest
+    {
+        uint32_t magic;
+        int32_t  op;            // tImageOp
+        int32_t  cbType;        // tCBType, other than kAll
+        int32_t  mode;          // tApplyMode: kApplyLUT, kApplyShapedLUT, kApplyDirect, or kApplyFixed
+        int32_t  layout;        // tLUTLayout, for kApplyLUT
+        int32_t  flags;         // tServeFlags
+        float    strength;      // from 0 to 1
+        int32_t  w;             // of the pixels, ignored for kServeEncoded
+        int32_t  h;
+        uint32_t reserved;
+        uint64_t size;          // of what follows
+    };
+
+    struct cServeResponse
+    {
+        uint32_t magic;
+        int32_t  status;        // tServeStatus
+        int32_t  w;
+        int32_t  h;
+        uint64_t size;          // of the pixels that follow
+    };
+
+    // LUTs kept between requests. Each is created by the first request that
+    // needs it, with any others for it waiting on that, and once there are
+    // more than kServeCacheSize, the least recently used are dropped.
+    const size_t kServeCacheSize = 64;
+
+    struct cCachedLUTs
+    {
+        cBatchOp       batchOp;
+        std::once_flag created;
+        uint64_t       lastUsed = 0;
+
+        ~cCachedLUTs()
+        {
+            delete batchOp.layoutLUT;
+            delete batchOp.luts;
+        }
+    };
+
+    class cLUTCache
+    {
+    public:
+        std::shared_ptr<cCachedLUTs> Find(const cBatchOp& key, bool* cached);   // returns entry for key, with its LUTs created
+
+        std::atomic<int> mHits  {0};
+        std::atomic<int> mMisses{0};
+
+    protected:
+        std::mutex mMutex;
+        std::vector<std::shared_ptr<cCachedLUTs>> mEntries;
+        uint64_t   mClock = 0;
+    };
+
+    std::shared_ptr<cCachedLUTs> cLUTCache::Find(const cBatchOp& key, bool* cached)
+    {
+        std::shared_ptr<cCachedLUTs> entry;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            for (const std::shared_ptr<cCachedLUTs>& candidate : mEntries)
+            {
+                const cBatchOp& op = candidate->batchOp;
+
+                if (op.op == key.op && op.cbType == key.cbType && op.strength == key.strength && op.mode == key.mode && op.layout == key.layout)
+                {
+                    entry = candidate;
+                    break;
+                }
+            }
+
+            *cached = entry != 0;
+
+            if (!entry)
+            {
+                // Requests still using the evicted entry keep it alive until they're done
+                if (mEntries.size() >= kServeCacheSize)
+                    mEntries.erase(std::min_element(mEntries.begin(), mEntries.end(),
+                        [](const std::shared_ptr<cCachedLUTs>& a, const std::shared_ptr<cCachedLUTs>& b) { return a->lastUsed < b->lastUsed; }));
+
+                entry = std::make_shared<cCachedLUTs>();
+                entry->batchOp = key;
+                mEntries.push_back(entry);
+            }
+
+            entry->lastUsed = ++mClock;
+        }
+
+        (*cached ? mHits : mMisses)++;
+
+        std::call_once(entry->created, CreateBatchOpLUTs, &entry->batchOp);
+        return entry;
+    }
+
+    struct cServer
+    {
+        cLUTCache        cache;
+        ShaperLUT        shaper;
+        std::atomic<int> requests{0};
+
+        std::mutex       mutex;
+        std::vector<int> connections;   // accepted and not yet closed, so they can be shut down on exit
+        std::vector<std::pair<int, bool>> served;  // connections workers are done with, and whether to keep them open
+    };
+
+    const int kServeMaxConnections = 256;   // beyond this, new clients wait in the listen backlog
+    const int kServeIdleSeconds    = 60;    // how long a connection can go without sending a request
+    const int kServeRequestSeconds = 30;    // how long a worker spends on a request, however slowly the client sends or reads it
+    const size_t kServeMaxEncoded  = 256 << 20;   // largest image file accepted with kServeEncoded
+
+    typedef std::chrono::steady_clock tServeClock;
+    const tServeClock::time_point kNoDeadline = tServeClock::time_point::max();
+
+    volatile sig_atomic_t sServeStop = 0;   // set by SIGINT or SIGTERM during --serve
+    int sServeWakeFD = -1;                  // write end of the pipe that wakes the main thread from poll
+
+    void WakeServer()
+    {
+        char wake = 0;
+        ssize_t written = write(sServeWakeFD, &wake, 1);     // the pipe is non-blocking, and if it's full, a wake is already pending
+        (void) written;
+    }
+
+    void StopServing(int)
+    {
+        int savedErrno = errno;
+
+        sServeStop = 1;
+        WakeServer();
+
+        errno = savedErrno;
+    }
+
+    // Wait for 'socket' to have any of 'events', returning false if 'deadline' passes first
+    bool WaitForSocket(int socket, short events, tServeClock::time_point deadline)
+    {
+        while (true)
+        {
+            int64_t remainingMS = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - tServeClock::now()).count();
+
+            if (remainingMS <= 0)
+                return false;
+
+            pollfd polled = { socket, events, 0 };
+            int n = poll(&polled, 1, int(std::min<int64_t>(remainingMS, INT_MAX)));
+
+            if (n > 0)
+                return true;
+            if (n < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+    // Receive 'size' bytes, giving up if that's not done by 'deadline'. This
+    // bounds the whole transfer, so a client can't hold a worker by trickling.
+    bool RecvAll(int socket, void* data, size_t size, tServeClock::time_point deadline)
+    {
+        uint8_t* p = (uint8_t*) data;
+
+        while (size > 0)
+        {
+            ssize_t n = recv(socket, p, size, MSG_DONTWAIT);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (!WaitForSocket(socket, POLLIN, deadline))
+                    return false;
+                continue;
+            }
+            if (n <= 0)
+                return false;
+
+            p    += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    // As RecvAll, for sending
+    bool SendAll(int socket, const void* data, size_t size, tServeClock::time_point deadline)
+    {
+        const uint8_t* p = (const uint8_t*) data;
+
+        while (size > 0)
+        {
+            ssize_t n = send(socket, p, size, MSG_DONTWAIT);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (!WaitForSocket(socket, POLLOUT, deadline))
+                    return false;
+                continue;
+            }
+            if (n <= 0)
+                return false;
+
+            p    += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+    // Send 'request', along with 'sharedFD' if it's valid
+    bool SendRequest(int socket, const cServeRequest& request, int sharedFD)
+    {
+        if (sharedFD < 0)
+            return SendAll(socket, &request, sizeof(request), kNoDeadline);
+
+        union { cmsghdr header; char buffer[CMSG_SPACE(sizeof(int))]; } control;
+        memset(&control, 0, sizeof(control));
+
+        iovec  iov = { (void*) &request, sizeof(request) };
+        msghdr message = {};
+
+        message.msg_iov        = &iov;
+        message.msg_iovlen     = 1;
+        message.msg_control    = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type  = SCM_RIGHTS;
+        header->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &sharedFD, sizeof(int));
+
+        ssize_t n;
+
+        do
+            n = sendmsg(socket, &message, 0);
+        while (n < 0 && errno == EINTR);
+
+        // Any fd goes with the first byte, so the rest can be sent normally
+        return n > 0 && SendAll(socket, (const uint8_t*) &request + n, sizeof(request) - n, kNoDeadline);
+    }
+
+    // Receive the next request, and the fd sent with it, if any. Returns false
+    // once the connection is closed, if the client sent more fds than fit, or
+    // if the rest of the request doesn't arrive by 'deadline'. This is only
+    // called once the start of the request has arrived, so can't block for long.
+    bool RecvRequest(int socket, cServeRequest* request, int* sharedFD, tServeClock::time_point deadline)
+    {
+        // Room for a few fds, so any beyond the first can be closed rather than leaked
+        union { cmsghdr header; char buffer[CMSG_SPACE(4 * sizeof(int))]; } control;
+
+        iovec  iov = { request, sizeof(*request) };
+        msghdr message = {};
+
+        message.msg_iov        = &iov;
+        message.msg_iovlen     = 1;
+        message.msg_control    = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+
+    #ifdef MSG_CMSG_CLOEXEC
+        const int flags = MSG_CMSG_CLOEXEC;
+    #else
+        const int flags = 0;
+    #endif
+
+        ssize_t n;
+
+        do
+            n = recvmsg(socket, &message, flags);
+        while (n < 0 && errno == EINTR);
+
+        *sharedFD = -1;
+
+        if (n <= 0)
+            return false;
+
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            int numFDs = int((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+            for (int i = 0; i < numFDs; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+
+                if (*sharedFD < 0)
+                    *sharedFD = fd;
+                else
+                    close(fd);
+            }
+        }
+
+        if (message.msg_flags & MSG_CTRUNC)
+        {
+            if (*sharedFD >= 0)
+                close(*sharedFD);
+            *sharedFD = -1;
+            return false;
+        }
+
+        return RecvAll(socket, (uint8_t*) request + n, sizeof(*request) - n, deadline);
+    }
+
+    // Handle 'request', which has been received on 'socket', giving up on
+    // transfers not done by 'deadline'. Returns false if the connection should be closed.
+    bool ServeRequest(cServer* server, int socket, const cServeRequest& request, int sharedFD, tServeClock::time_point deadline)
+    {
+        auto startTime = std::chrono::steady_clock::now();
+
+        const bool encoded = request.flags & kServeEncoded;
+        const bool shared  = request.flags & kServeShared;
+        const bool sizeOK  = request.w > 0 && request.h > 0 && request.w <= (1 << 28) / request.h;
+        const size_t pixelsSize = sizeOK ? size_t(request.w) * request.h * sizeof(RGBA32) : 0;
+
+        const bool valid = request.magic == kServeMagic
+            && request.op >= kSimulate && request.op <= kPassThrough
+            && request.cbType >= kIdentity && request.cbType < kAll
+            && (request.mode == kApplyLUT || request.mode == kApplyShapedLUT || request.mode == kApplyDirect || request.mode == kApplyFixed)
+            && request.layout >= kLayoutLinear && request.layout <= kLayoutBricked
+            && std::isfinite(request.strength) && request.strength >= 0.0f && request.strength <= 1.0f    // a NaN would never match a cached LUT
+            && (request.flags & ~(kServeEncoded | kServeShared)) == 0
+            && !(encoded && shared)
+            && shared == (sharedFD >= 0)
+            && (encoded ? request.size <= kServeMaxEncoded : sizeOK && request.size == (shared ? 0 : pixelsSize));
+
+        cServeResponse response = { kServeMagic, kServeOK, 0, 0, 0 };
+
+        if (!valid)
+        {
+            // There's no telling where the next request starts
+            response.status = kServeBadRequest;
+            SendAll(socket, &response, sizeof(response), deadline);
+            return false;
+        }
+
+        RGBA32* data   = 0;
+        bool    mapped = false;
+        int w = request.w;
+        int h = request.h;
+
+        if (shared)
+        {
+            // The client could shrink the fd while it's mapped, and have our
+            // accesses fault, so it's only mapped if sealed against that.
+            // Otherwise the pixels are copied, which can't fault.
+            bool sealed = false;
+        #ifdef F_GET_SEALS
+            int seals = fcntl(sharedFD, F_GET_SEALS);
+            sealed = seals >= 0 && (seals & F_SEAL_SHRINK);
+        #endif
+
+            struct stat info;
+
+            if (fstat(sharedFD, &info) == 0 && uint64_t(info.st_size) >= pixelsSize)
+            {
+                if (sealed)
+                {
+                    data = (RGBA32*) mmap(0, pixelsSize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedFD, 0);
+                    mapped = data != MAP_FAILED;
+
+                    if (!mapped)
+                        data = 0;
+                }
+                else
+                {
+                    data = (RGBA32*) PoolAlloc(pixelsSize);
+
+                    if (data && pread(sharedFD, data, pixelsSize, 0) != ssize_t(pixelsSize))
+                    {
+                        PoolFree(data);
+                        data = 0;
+                    }
+                }
+            }
+
+            if (!data)
+                response.status = kServeMapFailed;
+        }
+        else
+        {
+            uint8_t* payload = (uint8_t*) PoolAlloc(request.size);
+
+            // Without room for the payload, the connection can't be kept in step, so is dropped
+            if (!payload || !RecvAll(socket, payload, request.size, deadline))
+            {
+                PoolFree(payload);
+                return false;
+            }
+
+            if (encoded)
+            {
+                data = LoadImageFromMemory(payload, request.size, &w, &h);
+                PoolFree(payload);
+
+                if (!data)
+                    response.status = kServeDecodeFailed;
+            }
+            else
+                data = (RGBA32*) payload;
+        }
+
+        bool cached = false;
+
+        if (data)
+        {
+            cBatchOp key;
+            key.op       = tImageOp(request.op);
+            key.cbType   = tCBType(request.cbType);
+            key.strength = request.strength;
+            key.mode     = tApplyMode(request.mode);
+            key.layout   = (key.mode == kApplyLUT) ? tLUTLayout(request.layout) : kLayoutLinear;
+
+            std::shared_ptr<cCachedLUTs> entry = server->cache.Find(key, &cached);
+            const cBatchOp& batchOp = entry->batchOp;
+
+            ApplyImageOp(batchOp.op, kCBTypeLMS[batchOp.cbType], batchOp.strength, batchOp.mode, batchOp.luts, server->shaper, *batchOp.layoutLUT, w * h, data, data);
+
+            response.w    = w;
+            response.h    = h;
+            response.size = shared ? 0 : size_t(w) * h * sizeof(RGBA32);
+
+            if (shared && !mapped && pwrite(sharedFD, data, pixelsSize, 0) != ssize_t(pixelsSize))
+                response.status = kServeMapFailed;
+        }
+
+        bool sent = SendAll(socket, &response, sizeof(response), deadline) && SendAll(socket, data, response.size, deadline);
+
+        if (mapped)
+            munmap(data, pixelsSize);
+        else
+            PoolFree(data);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+        const bool usesLUT = request.mode == kApplyLUT || request.mode == kApplyShapedLUT;
+
+        printf("%s%s %dx%d%s: %s in %.1fms%s\n", kCBTypeNames[request.cbType], kImageOpSuffixes[request.op], w, h,
+            encoded ? " (encoded)" : shared ? " (shared)" : "", kServeStatusNames[response.status], ms,
+            !data || !usesLUT ? "" : cached ? ", cached LUT" : ", new LUT");
+
+        server->requests++;
+        return sent;
+    }
+
+    // Handle the request that's arrived on 'socket', then hand the
+    // connection back to the main thread to wait for the next one
+    void ServeNextRequest(cServer* server, int socket)
+    {
+        cServeRequest request;
+        int sharedFD;
+
+        const tServeClock::time_point deadline = tServeClock::now() + std::chrono::seconds(kServeRequestSeconds);
+
+        bool keep = RecvRequest(socket, &request, &sharedFD, deadline) && ServeRequest(server, socket, request, sharedFD, deadline);
+
+        if (sharedFD >= 0)
+            close(sharedFD);
+
+        {
+            std::lock_guard<std::mutex> lock(server->mutex);
+            server->served.emplace_back(socket, keep);
+        }
+
+        WakeServer();
+    }
+
+    bool SetNonBlocking(int fd, bool nonBlocking)
+    {
+        int flags = fcntl(fd, F_GETFL);
+        return flags >= 0 && fcntl(fd, F_SETFL, nonBlocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0;
+    }
+
+    // Listen on the Unix socket at 'path' until SIGINT or SIGTERM. The main
+    // thread polls the listener and all idle connections, and only once a
+    // request arrives is its connection queued for a worker, which serves
+    // that one request and hands the connection back. So idle clients cost
+    // no more than an fd, and connections left idle too long are closed.
+    int Serve(const char* path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+
+        if (strlen(path) >= sizeof(address.sun_path))
+            return fprintf(stderr, "Socket path %s is too long\n", path);
+
+        strcpy(address.sun_path, path);
+
+        // Clear away a socket left behind by a previous run, but nothing else
+        struct stat info;
+
+        if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(path);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        int wakePipe[2] = { -1, -1 };
+
+        if (listener < 0 || bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 64) != 0
+         || !SetNonBlocking(listener, true) || pipe(wakePipe) != 0 || !SetNonBlocking(wakePipe[0], true) || !SetNonBlocking(wakePipe[1], true))
+        {
+            fprintf(stderr, "Couldn't listen on %s: %s\n", path, strerror(errno));
+
+            for (int fd : { listener, wakePipe[0], wakePipe[1] })
+                if (fd >= 0)
+                    close(fd);
+            return -1;
+        }
+
+        sServeWakeFD = wakePipe[1];
+
+        // A client going away mid-response shouldn't take the daemon with it
+        signal(SIGPIPE, SIG_IGN);
+
+        // SIGINT and SIGTERM are blocked while the workers are started, so
+        // only the main thread sees them. Their handler writes to the wake
+        // pipe, so one arriving just before poll isn't missed.
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+
+        struct sigaction action = {};
+        action.sa_handler = StopServing;
+        sigaction(SIGINT,  &action, 0);
+        sigaction(SIGTERM, &action, 0);
+
+        cServer server;
+        CreateShaperLUT(&server.shaper);
+
+        // Each connection is queued at most once, so this never fills, and
+        // the main thread never blocks pushing to it
+        cBoundedQueue<int> pending(kServeMaxConnections, 1);
+        const int numThreads = std::max(int(std::thread::hardware_concurrency()), 1);
+        std::vector<std::thread> threads;
+
+        pthread_sigmask(SIG_BLOCK, &stopSignals, 0);
+
+        for (int i = 0; i < numThreads; i++)
+            threads.emplace_back(
+                [&]()
+                {
+                    cPoolThreadScope scope;
+                    int connection;
+
+                    while (pending.Pop(&connection))
+                        ServeNextRequest(&server, connection);
+                }
+            );
+
+        pthread_sigmask(SIG_UNBLOCK, &stopSignals, 0);
+
+        printf("Serving on %s with %d threads\n", path, numThreads);
+        fflush(stdout);
+
+        typedef std::chrono::steady_clock tClock;
+
+        struct cIdleConnection
+        {
+            int               socket;
+            tClock::time_point since;
+        };
+
+        std::vector<cIdleConnection> idle;      // waiting for a request, in the order they became idle
+        std::vector<pollfd>          polled;
+        int                          numConnections = 0;
+
+        auto closeConnection =
+            [&](int connection)
+            {
+                // Out of the list before it's closed, as the fd may be reused straight away
+                {
+                    std::lock_guard<std::mutex> lock(server.mutex);
+                    server.connections.erase(std::find(server.connections.begin(), server.connections.end(), connection));
+                }
+
+                close(connection);
+                numConnections--;
+            };
+
+        while (!sServeStop)
+        {
+            polled.clear();
+            polled.push_back({ wakePipe[0], POLLIN, 0 });
+            polled.push_back({ numConnections < kServeMaxConnections ? listener : -1, POLLIN, 0 });     // poll ignores negative fds
+
+            for (const cIdleConnection& connection : idle)
+                polled.push_back({ connection.socket, POLLIN, 0 });
+
+            // Wake in time to close the longest-idle connection
+            int timeoutMS = -1;
+
+            if (!idle.empty())
+            {
+                auto wait = idle.front().since + std::chrono::seconds(kServeIdleSeconds) - tClock::now();
+                timeoutMS = int(std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1, 0));
+            }
+
+            if (poll(polled.data(), polled.size(), timeoutMS) < 0)
+                continue;   // interrupted by a signal
+
+            char wakes[64];
+            while (read(wakePipe[0], wakes, sizeof(wakes)) > 0)
+                ;
+
+            auto now = tClock::now();
+
+            // Hand off connections with a request waiting, or that have been
+            // closed by the client, which the worker will find out about
+            std::vector<cIdleConnection> stillIdle;
+
+            for (size_t i = 0; i < idle.size(); i++)
+                if (polled[i + 2].revents)
+                    pending.Push(idle[i].socket);
+                else if (now - idle[i].since >= std::chrono::seconds(kServeIdleSeconds))
+                    closeConnection(idle[i].socket);
+                else
+                    stillIdle.push_back(idle[i]);
+
+            idle.swap(stillIdle);
+
+            // Take back those the workers are done with
+            std::vector<std::pair<int, bool>> served;
+            {
+                std::lock_guard<std::mutex> lock(server.mutex);
+                served.swap(server.served);
+            }
+
+            for (const std::pair<int, bool>& connection : served)
+                if (connection.second)
+                    idle.push_back({ connection.first, now });
+                else
+                    closeConnection(connection.first);
+
+            if (polled[1].revents)
+            {
+                int connection = accept(listener, 0, 0);
+
+                if (connection >= 0)
+                {
+                    // Workers poll when they'd otherwise block, so they can enforce each request's deadline
+                    SetNonBlocking(connection, false);      // it may have inherited the listener's flag
+
+                    {
+                        std::lock_guard<std::mutex> lock(server.mutex);
+                        server.connections.push_back(connection);
+                    }
+
+                    numConnections++;
+                    idle.push_back({ connection, now });
+                }
+            }
+        }
+
+        close(listener);
+        unlink(path);
+
+        // Wake any workers waiting on their clients
+        {
+            std::lock_guard<std::mutex> lock(server.mutex);
+
+            for (int connection : server.connections)
+                shutdown(connection, SHUT_RDWR);
+        }
+
+        pending.Finish();
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (int connection : server.connections)
+            close(connection);
+
+        sServeWakeFD = -1;
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+
+        printf("Served %d requests, with %d LUT cache hits and %d misses\n", int(server.requests), int(server.cache.mHits), int(server.cache.mMisses));
+        return 0;
+    }
+
+    // Client side, for --client
+    enum tServeTransport
+    {
+        kTransportRaw,          // send decoded pixels
+        kTransportFile,         // send the source file as-is, for the daemon to decode
+        kTransportShared,       // pass decoded pixels via shared memory
+        kNumServeTransports
+    };
+
+    const char* kServeTransportNames[kNumServeTransports] = { "raw", "file", "shm" };
+
+    int             sServeClient = -1;                  // connection to a daemon that ops are sent to, set by --client
+    tServeTransport sServeTransport = kTransportRaw;    // how source images are sent, set by --client
+
+    int ConnectToServer(const char* path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+
+        if (strlen(path) >= sizeof(address.sun_path))
+            return -1;
+
+        strcpy(address.sun_path, path);
+
+        int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (connection >= 0 && connect(connection, (sockaddr*) &address, sizeof(address)) != 0)
+        {
+            close(connection);
+            connection = -1;
+        }
+
+        // As for the daemon, a lost connection is reported rather than being fatal
+        signal(SIGPIPE, SIG_IGN);
+
+        return connection;
+    }
+
+    // Returns an fd for 'size' bytes of anonymous shared memory, or -1. On
+    // Linux, it's sealed against shrinking, so the daemon can map it safely.
+    int CreateSharedMemory(size_t size)
+    {
+    #ifdef __linux__
+        int fd = memfd_create("cblutgen", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    #else
+        static std::atomic<int> counter{0};
+        char name[64];
+        snprintf(name, sizeof(name), "/cblutgen-%d-%d", int(getpid()), counter++);
+
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+            shm_unlink(name);
+    #endif
+
+        if (fd >= 0 && ftruncate(fd, off_t(size)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+
+    #ifdef __linux__
+        if (fd >= 0)
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK);  // if this fails, the daemon copies the pixels instead
+    #endif
+
+        return fd;
+    }
+
+    // As CreateImage, but has the daemon connected to by --client do the work.
+    // Returns false if the request couldn't be made, or the daemon failed it.
+    bool CreateImageViaServer(tImageOp op, tCBType cbType, float strength, tApplyMode mode, tLUTLayout layout, int w, int h, const RGBA32* dataIn, const char* dataInFile, const char* dataInName)
+    {
+        if (cbType == kAll)
+        {
+            bool ok = CreateImageViaServer(op, kProtanope,   strength, mode, layout, w, h, dataIn, dataInFile, dataInName);
+            ok     &= CreateImageViaServer(op, kDeuteranope, strength, mode, layout, w, h, dataIn, dataInFile, dataInName);
+            ok     &= CreateImageViaServer(op, kTritanope,   strength, mode, layout, w, h, dataIn, dataInFile, dataInName);
+            return ok;
+        }
+
+        if (sServeTransport == kTransportFile ? !dataInFile : !dataIn)
+        {
+            fprintf(stderr, "--client needs a source image, given by -f\n");
+            return false;
+        }
+
+        // The daemon only does whole images
+        if (mode != kApplyShapedLUT && mode != kApplyDirect && mode != kApplyFixed)
+            mode = kApplyLUT;
+
+        cServeRequest request = { kServeMagic, op, cbType, mode, layout, 0, strength, w, h, 0, 0 };
+        const size_t pixelsSize = size_t(w) * h * sizeof(RGBA32);
+
+        uint8_t* payload  = 0;
+        RGBA32*  shared   = 0;
+        int      sharedFD = -1;
+
+        if (sServeTransport == kTransportFile)
+        {
+            size_t size;
+            payload = ReadFile(dataInFile, &size);
+
+            if (!payload)
+            {
+                fprintf(stderr, "Couldn't read %s\n", dataInFile);
+                return false;
+            }
+
+            request.flags = kServeEncoded;
+            request.size  = size;
+        }
+        else if (sServeTransport == kTransportShared)
+        {
+            sharedFD = CreateSharedMemory(pixelsSize);
+
+            if (sharedFD >= 0)
+                shared = (RGBA32*) mmap(0, pixelsSize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedFD, 0);
+
+            if (!shared || shared == MAP_FAILED)
+            {
+                fprintf(stderr, "Couldn't create shared memory\n");
+
+                if (sharedFD >= 0)
+                    close(sharedFD);
+                return false;
+            }
+
+            memcpy(shared, dataIn, pixelsSize);
+            request.flags = kServeShared;
+        }
+        else
+            request.size = pixelsSize;
+
+        const void* data = payload ? (const void*) payload : shared ? 0 : (const void*) dataIn;
+
+        cServeResponse response;
+        bool ok = SendRequest(sServeClient, request, sharedFD) && SendAll(sServeClient, data, request.size, kNoDeadline)
+               && RecvAll(sServeClient, &response, sizeof(response), kNoDeadline) && response.magic == kServeMagic;
+
+        PoolFree(payload);
+
+        if (sharedFD >= 0)
+            close(sharedFD);
+
+        RGBA32* dataOut = shared;
+        bool outOfMemory = false;
+
+        if (ok && response.status == kServeOK && !shared)
+        {
+            dataOut = (RGBA32*) PoolAlloc(response.size);
+            outOfMemory = !dataOut;
+            ok = response.size == size_t(response.w) * response.h * sizeof(RGBA32) && dataOut && RecvAll(sServeClient, dataOut, response.size, kNoDeadline);
+        }
+
+        if (outOfMemory)
+            fprintf(stderr, "Out of memory for the result of %s\n", dataInName);
+        else if (!ok)
+            fprintf(stderr, "Lost connection to daemon\n");
+        else if (response.status != kServeOK)
+        {
+            ok = false;
+            fprintf(stderr, "Daemon couldn't process %s: %s\n", dataInName, response.status < kNumServeStatuses ? kServeStatusNames[response.status] : "unknown error");
+        }
+        else
+        {
+            char filename[256];
+            snprintf(filename, sizeof(filename), "%s_%s%s", dataInName, kCBTypeNames[cbType], kImageOpSuffixes[op]);
+
+            SaveImage(filename, response.w, response.h, dataOut);
+        }
+
+        if (shared)
+            munmap(shared, pixelsSize);
+        else
+            PoolFree(dataOut);
+
+        return ok;
+    }
+#endif
+
+    void CreateImage(const cLayoutLUT& layoutLUT, int w, int h, const RGBA32* dataIn)
+    {
+        int n = w * h;
+        RGBA32* dataOut = (RGBA32*) PoolAlloc(n * sizeof(RGBA32));
+
+        if (dataOut)
+            layoutLUT.Apply(n, dataIn, dataOut);
+        
+        SaveImage("apply_lut", w, h, dataOut);
+
+        PoolFree(dataOut);
+    }
+}
+
+
+namespace
+{
+    // Mono LUT processing
+    struct cMonoLUTEntry { const char* name; const uint8_t (*lut)[4]; } kMonoLUTs[]  = 
+    {
+        "cividis", kCividisLUT,
+        "viridis", kViridisLUT,
+        "magma",   kMagmaLUT  ,
+        "inferno", kInfernoLUT,
+        "plasma",  kPlasmaLUT ,
+    };
+
+    void PrintMonoLUT(const char* name, const RGBA32 monoLUT[256])
+    {
+        printf("const unsigned char k%s[256][4] =\n{\n", name);
+
+        for (int i = 0; i < 256; i++)
+        {
+            const uint8_t* c = monoLUT[i].c;
+            printf("    %3d, %3d, %3d, %3d,\n", c[0], c[1], c[2], c[3]);
+        } 
+
+        printf("};\n");
+    }
+
+    void CreateImageWithMonoLUT(const RGBA32 monoLUT[256], const char* lutName, int w, int h, const RGBA32* dataIn, const char* dataName, int channel)
+    {
+        RGBA32* dataOut = 0;
+
+        if (dataIn)
+        {
+            dataOut = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+            if (dataOut)
+                ApplyMonoLUT(monoLUT, w * h, dataIn, dataOut, channel);
+        }
+        else
+        {
+            w = 256;
+            h = 8;
+            dataOut = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+            for (int i = 0; dataOut && i < h; i++)
+                memcpy(dataOut + i * w, monoLUT, w * sizeof(RGBA32));
+        }
+        
+        char filename[256];
+        
+        if (dataIn)
+            snprintf(filename, sizeof(filename), "%s_%s", dataName, lutName);
+        else
+            snprintf(filename, sizeof(filename), "%s_lut", lutName);
+        
+        SaveImage(filename, w, h, dataOut);
+
+        PoolFree(dataOut);
+    }
+}
+
+namespace
+{
+    // Benchmarking
+    template<class T> double TimeBest(T fn, int reps = 3)  // returns best time in seconds
+    {
+        double best = 1e30;
+
+        for (int i = 0; i < reps; i++)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            fn();
+            auto t1 = std::chrono::steady_clock::now();
+
+            double t = std::chrono::duration<double>(t1 - t0).count();
+            if (best > t)
+                best = t;
+        }
+
+        return best;
+    }
+
+    void ReportError(const char* name, int n, const RGBA32* dataRef, const RGBA32* dataOut, double t)
+    {
+        int64_t errorSum = 0;
+        int     errorMax = 0;
+
+        for (int i = 0; i < n; i++)
+        for (int j = 0; j < 3; j++)
+        {
+            int e = abs(dataRef[i].c[j] - dataOut[i].c[j]);
+
+            errorSum += e;
+            if (errorMax < e)
+                errorMax = e;
+        }
+
+        printf("  %-10s  mean error %6.3f  max error %3d  %8.1f MP/s\n", name, errorSum / (3.0 * n), errorMax, n / (t * 1e6));
+    }
+
+    template<class T, class E> void BenchLUTFormat(const char* name, T xform, E (*encode)(Vec3f), int n, const RGBA32* dataIn, const RGBA32* dataRef, RGBA32* dataOut)
+    {
+        E* lut = new E[kLUTSize * kLUTSize * kLUTSize];
+        E (*lut3)[kLUTSize][kLUTSize] = (E (*)[kLUTSize][kLUTSize]) lut;
+
+        CreateLUT(xform, lut3, encode);
+
+        double t = TimeBest([=]{ ApplyLUT(lut3, n, dataIn, dataOut); });
+        ReportError(name, n, dataRef, dataOut, t);
+
+        delete[] lut;
+    }
+
+    template<class T> void BenchLUTLayouts(T xform, int n, const RGBA32* dataIn, const RGBA32* dataRef, RGBA32* dataOut)
+    {
+        RGBA32 (*lut)[kLUTSize][kLUTSize] = new RGBA32[kLUTSize][kLUTSize][kLUTSize];
+        RGBA32*     mortonLUT = new RGBA32[kLUTEntries];
+        RGBA32 (*brickLUT)[8] = new RGBA32[kLUTCells][8];
+        double t;
+
+        CreateLUT(xform, lut);
+        ConvertLUTToMorton (lut, mortonLUT);
+        ConvertLUTToBricked(lut, brickLUT);
+
+        t = TimeBest([=]{ ApplyLUTMorton(mortonLUT, n, dataIn, dataOut); });
+        ReportError("Morton", n, dataRef, dataOut, t);
+        t = TimeBest([=]{ ApplyLUTTrilinear(lut, n, dataIn, dataOut); });
+        ReportError("Trilinear", n, dataRef, dataOut, t);
+        t = TimeBest([=]{ ApplyLUTBricked(brickLUT, n, dataIn, dataOut); });
+        ReportError("Bricked", n, dataRef, dataOut, t);
+
+        delete[] brickLUT;
+        delete[] mortonLUT;
+        delete[] lut;
+    }
+
+    template<class T> void BenchShapedLUT(T xform, int n, const RGBA32* dataIn, const RGBA32* dataRef, RGBA32* dataOut)
+    {
+        RGBA32 (*lut)[kShapedLUTSize][kShapedLUTSize] = new RGBA32[kShapedLUTSize][kShapedLUTSize][kShapedLUTSize];
+        ShaperLUT shaper;
+        char name[32];
+
+        const float powers[] = { kShaperPower, 2.2f };  // default, and linear light
+
+        for (float power : powers)
+        {
+            CreateShaperLUT(&shaper, power);
+            CreateShapedLUT(xform, lut, power);
+
+            double t = TimeBest([&]{ ApplyShapedLUT(shaper, lut, n, dataIn, dataOut); });
+
+            snprintf(name, sizeof(name), "Shaped %d^3 p=%g", kShapedLUTSize, power);
+            ReportError(name, n, dataRef, dataOut, t);
         }
+
+        delete[] lut;
     }
 
-    void CreateImage(const RGBA32* rgbaLUT, int w, int h, const RGBA32* dataIn)
+    template<class T> void BenchLUTFormats(const char* opName, T xform, int n, const RGBA32* dataIn, RGBA32* dataRef, RGBA32* dataOut)
     {
-        int n = w * h;
-        RGBA32* dataOut = new RGBA32[n];
+        printf("%s: LUT size %d^3\n", opName, kLUTSize);
 
-        ApplyLUT(* (RGBA32 (*)[kLUTSize][kLUTSize][kLUTSize]) (RGBA32*) rgbaLUT, w * h, dataIn, dataOut);
-        
-        char filename[256] = "apply_lut";
-        
-        printf("Saving %s\n", filename);
-        strcat(filename, ".png");
+        Transform(xform, n, dataIn, dataRef);
 
-        stbi_write_png(filename, w, h, 4, dataOut, 0);
+        BenchLUTFormat("RGBA32",  xform, ToRGBA32u,  n, dataIn, dataRef, dataOut);
+        BenchLUTFormat("RGB565",  xform, ToRGB565u,  n, dataIn, dataRef, dataOut);
+        BenchLUTFormat("RGB10A2", xform, ToRGB10A2u, n, dataIn, dataRef, dataOut);
+        BenchLUTFormat("RGB16",   xform, ToRGB16u,   n, dataIn, dataRef, dataOut);
 
-        delete[] dataOut;
+        BenchLUTLayouts(xform, n, dataIn, dataRef, dataOut);
+
+        FixedXform fixedXform = CreateFixedXform(xform);
+        double t = TimeBest([&]{ ApplyFixed(fixedXform, n, dataIn, dataOut); });
+        ReportError("Fixed", n, dataRef, dataOut, t);
+
+        BenchShapedLUT(xform, n, dataIn, dataRef, dataOut);
     }
-}
 
+    struct cPNGPreset
+    {
+        const char* name;
+        int         filter;
+        int         level;
+        int         rle;
+    };
 
-namespace
-{
-    // Mono LUT processing
-    struct cMonoLUTEntry { const char* name; const uint8_t (*lut)[4]; } kMonoLUTs[]  = 
+    const cPNGPreset kPNGPresets[] =
     {
-        "cividis", kCividisLUT,
-        "viridis", kViridisLUT,
-        "magma",   kMagmaLUT  ,
-        "inferno", kInfernoLUT,
-        "plasma",  kPlasmaLUT ,
+        { "default",  -1, 8, 0 },
+        { "level 1",  -1, 1, 0 },
+        { "paeth",     4, 8, 0 },
+        { "sub rle",   1, 8, 1 },
+        { "stored",    0, 0, 0 },
     };
 
-    void PrintMonoLUT(const char* name, const RGBA32 monoLUT[256])
+    // Time PNG encoding of the given image with each preset
+    void BenchPNGPresets(int w, int h, const RGBA32* data)
     {
-        printf("const unsigned char k%s[256][4] =\n{\n", name);
+        printf("PNG presets:\n");
 
-        for (int i = 0; i < 256; i++)
+        int filter = stbi_write_force_png_filter;
+        int level  = stbi_write_png_compression_level;
+        int rle    = stbi_write_png_rle;
+
+        double rawBytes = w * h * 4.0;
+
+        for (const cPNGPreset& preset : kPNGPresets)
         {
-            const uint8_t* c = monoLUT[i].c;
-            printf("    %3d, %3d, %3d, %3d,\n", c[0], c[1], c[2], c[3]);
-        } 
+            stbi_write_force_png_filter      = preset.filter;
+            stbi_write_png_compression_level = preset.level;
+            stbi_write_png_rle               = preset.rle;
 
-        printf("};\n");
+            int len = 0;
+            double t = TimeBest([&]
+            {
+                stbi_uc* png = stbi_write_png_to_mem((stbi_uc*) data, 0, w, h, 4, &len);
+                PoolFree(png);
+            }, 1);
+
+            printf("  %-10s  %8.1f MB/s  ratio %5.2f\n", preset.name, rawBytes / (t * 1e6), len ? rawBytes / len : 0.0);
+        }
+
+        stbi_write_force_png_filter      = filter;
+        stbi_write_png_compression_level = level;
+        stbi_write_png_rle               = rle;
     }
 
-    void CreateImageWithMonoLUT(const RGBA32 monoLUT[256], const char* lutName, int w, int h, const RGBA32* dataIn, const char* dataName, int channel)
+    void Benchmark(tCBType cbType, float strength, int w, int h, const RGBA32* dataIn)
     {
-        RGBA32* dataOut = 0;
+        RGBA32* dataAll = 0;
 
-        if (dataIn)
+        if (!dataIn)    // default to every 24-bit colour
         {
-            dataOut = new RGBA32[w * h];
-            ApplyMonoLUT(monoLUT, w * h, dataIn, dataOut, channel);
+            w = 4096;
+            h = 4096;
+            dataAll = new RGBA32[w * h];
+
+            for (int i = 0; i < w * h; i++)
+                dataAll[i].u32 = 0xFF000000 | i;
+
+            dataIn = dataAll;
         }
-        else
+
+        int n = w * h;
+        RGBA32* dataRef = new RGBA32[n];
+        RGBA32* dataOut = new RGBA32[n];
+
+        const char* typeNames[] = { "protanope", "deuteranope", "tritanope" };
+        char opName[64];
+
+        for (int type = kProtanope; type <= kTritanope; type++)
         {
-            w = 256;
-            h = 8;
-            dataOut = new RGBA32[w * h];
-            for (int i = 0; i < h; i++)
-                memcpy(dataOut + i * w, monoLUT, w * sizeof(RGBA32));
+            if (cbType != kAll && cbType != type)
+                continue;
+
+            tLMS lmsType = tLMS(type - kProtanope);
+
+            snprintf(opName, sizeof(opName), "%s simulate", typeNames[lmsType]);
+            BenchLUTFormats(opName, [lmsType, strength](Vec3f c) { return Simulate(c, lmsType, strength); }, n, dataIn, dataRef, dataOut);
+            snprintf(opName, sizeof(opName), "%s daltonise", typeNames[lmsType]);
+            BenchLUTFormats(opName, [lmsType, strength](Vec3f c) { return Daltonise(c, lmsType, strength); }, n, dataIn, dataRef, dataOut);
+            snprintf(opName, sizeof(opName), "%s correct", typeNames[lmsType]);
+            BenchLUTFormats(opName, [lmsType, strength](Vec3f c) { return Correct(c, lmsType, strength); }, n, dataIn, dataRef, dataOut);
         }
-        
-        char filename[256];
-        
-        if (dataIn)
-            snprintf(filename, sizeof(filename), "%s_%s.png", dataName, lutName);
-        else
-            snprintf(filename, sizeof(filename), "%s_lut.png", lutName);
-        
-        printf("Saving %s\n", filename);
-        stbi_write_png(filename, w, h, 4, dataOut, 0);
+
+        BenchPNGPresets(w, h, dataIn);
 
         delete[] dataOut;
+        delete[] dataRef;
+        delete[] dataAll;
     }
 }
 
@@ -367,13 +4686,38 @@ namespace
             "\n"
             "Options:\n"
             "  -h        : this help\n"
-            "  -f <path> : set image to process rather than emitting lut\n"
+            "  -f <path> : set image to process rather than emitting lut. Paletted PNGs are processed via their palette\n"
             "  -p        : emit protanope image or lut\n"
             "  -d        : emit deuteranope image or lut\n"
             "  -t        : emit tritanope image or lut\n"
             "  -a        : emit image or lut for all the above types (default)\n"
-            "  -m <str>  : specify strength of colour blindness to correct for. Default = 1 (affected channel is completely lost.)\n" 
+            "  -m <str>  : specify strength of colour blindness to correct for, from 0 to 1. Default = 1 (affected channel is completely lost.)\n" 
             "  -n        : directly transform input image rather than using a LUT\n"
+            "  -q        : directly transform input image using the integer-only fixed-point path\n"
+            "  -S        : use a shaped 16^3 LUT rather than the standard 32^3 one\n"
+            "  -j        : apply LUT to each scanline as the JPEG given by a following -f is decoded\n"
+            "  -J        : as -j, but with a YCbCr-indexed LUT that replaces the decoder's colour conversion\n"
+            "  -P        : decode JPEGs that have restart markers in parallel (use before -f)\n"
+            "  -o <ext>  : output image format: png (default) or qoi\n"
+            "  -z <lvl>  : PNG compression level, from 1 (fastest) up, 'rle' for runs only, or 'store' for none. Default = 8\n"
+            "  -I        : write PNGs with at most 256 colours in paletted form\n"
+            "  -w <name> : PNG filter for all rows: none, sub, up, average, paeth, or best (per row, default)\n"
+            "  --max-dim <n> : shrink the image given by a following -f to fit in n x n, e.g., for previews\n"
+            "  --band <n>    : stream the image given by a following -f through in bands of n rows, for images too large for memory\n"
+            "  --frames <w>x<h> <rgba|rgb24> : with no -f, transform raw frames of this size from stdin to stdout by a single op, e.g., for video\n"
+            "  --frames y4m  : as above, but for a Y4M stream, which is transformed in YCbCr via a LUT, with chroma at its own resolution\n"
+            "  --tile-diff <n> : with raw --frames, only transform n x n tiles that differ from the previous frame, e.g., for screen captures\n"
+            "  --batch <src> : apply the ops that follow to every image in a directory, pattern (quoted), or file list, on all threads\n"
+            "  --stages <d>,<t>,<e> : run --batch as a decode/transform/encode pipeline with these thread counts, and report stage utilisation\n"
+            "  --io-depth <n> : with --batch, keep up to n file reads and writes in flight via io_uring where available. 0 = blocking I/O. Default = 32\n"
+            "  --output <path> : write all output images into a single uncompressed .tar or .zip archive, rather than individual files\n"
+            "  --report <src> <dir> : write original, daltonised, corrected, and simulated versions of each image in src for all types to dir, with results-*.md. Honours -m, -n, and -q\n"
+            "  --sheet <n>   : with a following --report, also composite each type's results into one sheet, with images scaled to n wide\n"
+            "  --display-width <n> : with a following --report, show images n wide in results-*.md. Default = 256\n"
+            "  --serve <socket> : run as a daemon, transforming images sent to this Unix socket, with LUTs cached between requests\n"
+            "  --client <socket> <raw|file|shm> : send the ops that follow to a --serve daemon, with the source as pixels, the -f file as-is, or pixels in shared memory\n"
+            "  --pool-mb <n>  : keep up to n MB of freed image buffers for reuse, rather than returning them to the system. Default = 64\n"
+            "  -L <name> : memory layout to convert 32^3 LUTs to when applying: linear (default), morton, bricked (trilinear)\n"
             "  -g[LMS]   : swap LM/MS/LS channels of input image before processing\n"
             "  -r[LM]    : remap L or M channels to S, converting a prot/deuter test image to tritanope.\n"
             "\n"
@@ -386,6 +4730,7 @@ namespace
             "  -e        : error between original colour and simulated version\n"
             "  -i        : emit identity image or lut (for testing)\n"
             "  -l <path> : apply the given LUT to source (requires -f)\n"
+            "  -b        : benchmark LUT formats against direct transformation, and PNG presets, on the source image if given, or all 24-bit colours\n"
             "\n"
             "  -c <name> [<channel>] : apply given greyscale lut: cividis, viridis (cb-savvy). magma, inferno, plasma (standard)\n"
             "                          'name' can also be the path of a 256-wide LUT in image form\n"
@@ -393,7 +4738,15 @@ namespace
             "\nExample:\n"
             "  %s -f image.png -p -sxy\n"
             "      # emit simulated, daltonised, and corrected version of image.png for protanopia only.\n"
-            , command, command
+            "  ffmpeg -i in.mp4 -f rawvideo -pix_fmt rgb24 - | %s --frames 1280x720 rgb24 -d -y | ffmpeg -f rawvideo -pix_fmt rgb24 -s 1280x720 -i - out.mp4\n"
+            "      # correct a video for deuteranopia.\n"
+            "  %s --batch 'tests/*.png' -sy\n"
+            "      # emit simulated and corrected versions of all test images, for all types, building each LUT only once.\n"
+            "  %s --sheet 256 --report tests out\n"
+            "      # regenerate the results for the test images in 'out', with a contact sheet per type.\n"
+            "  %s --serve /tmp/cblutgen.sock &  %s --client /tmp/cblutgen.sock shm -f image.png -p -sy\n"
+            "      # start a daemon, and have it simulate and correct image.png for protanopia.\n"
+            , command, command, command, command, command, command, command
         );
 
         return 0;
@@ -415,23 +4768,91 @@ namespace
         if (lastDot)
             *lastDot = 0;
     }
+
+    // Finish loading a source whose decode was deferred by -j/-J, for options that need its pixels
+    bool LoadDeferred(const char** path, int maxDim, RGBA32** data, int* w, int* h)
+    {
+        if (!*path || *data)
+            return true;
+
+        *data = LoadImage(*path, w, h, maxDim);
+
+        if (!*data)
+        {
+            fprintf(stderr, "Couldn't read %s\n", *path);
+            return false;
+        }
+
+        *path = 0;
+        return true;
+    }
 }
 
-int main(int argc, const char* argv[])
+void CBLut::SetOutputCallback(tOutputCallback* callback, void* user)
+{
+    sCallbackSink.reset(callback ? new cCallbackSink(callback, user) : 0);
+    sDefaultSink = callback ? (cOutputSink*) sCallbackSink.get() : &sFileSink;
+}
+
+int CBLut::RunCBLutGen(int argc, const char* argv[])
 {
     const char* command = argv[0];
     argv++; argc--;
 
+    // Any --output archive from a previous run is gone
+    sOutputSink = sDefaultSink;
+
     if (argc == 0)
         return Help(command);
 
+    // Large PNGs are filtered and deflated in parallel chunks
+    stbi_set_write_png_parallel(ParallelFor, 0);
+
     tCBType cbType = kAll;
     int w;
     int h;
     RGBA32* dataIn = 0;
+    cPalettedImage paletted;        // set if dataIn came from a paletted PNG
+    const char* dataInPath = 0;     // set if decoding has been deferred
+    const char* dataInFile = 0;     // path given by -f, for --client file
+    int maxDim = 0;                 // preview size, if set
     char dataInName[256] = "unknown";
     float strength = 1.0f;
-    bool noLUT = false;
+    tApplyMode mode = kApplyLUT;
+    tLUTLayout layout = kLayoutLinear;
+
+    std::vector<std::string> batchPaths;    // set by --batch
+    std::vector<cBatchOp>    batchOps;
+
+    std::unique_ptr<cArchiveSink> archive;  // set by --output, and finished off on exit
+
+    bool     clientFailed = false;  // set if a --client request was refused or failed
+
+    int      numFrameOps = 0;       // ops given without a source in --frames mode
+    cBatchOp frameOp;               // the one that's run on stdin once the options are read
+
+    // In batch mode, ops are queued up to be run over all files at the end
+    auto createImage = [&](tImageOp op, tCBType type)
+    {
+        if (!batchPaths.empty())
+            AddBatchOps(&batchOps, op, type, strength, mode, layout);
+    #ifndef _MSC_VER
+        else if (sServeClient >= 0)
+            clientFailed |= !CreateImageViaServer(op, type, strength, mode, layout, w, h, dataIn, dataInFile, dataInName);
+    #endif
+        else if (sFrameWidth > 0 && !dataIn && !dataInPath)
+        {
+            // There's only the one stdin stream, so it's left until we know there's only one op for it
+            frameOp.op       = op;
+            frameOp.cbType   = type;
+            frameOp.strength = strength;
+            frameOp.mode     = mode;
+            frameOp.layout   = layout;
+            numFrameOps++;
+        }
+        else
+            CreateImage(op, type, strength, w, h, dataIn, &paletted, dataInPath, maxDim, dataInName, mode, layout);
+    };
 
     // Options
     while (argc > 0 && argv[0][0] == '-')
@@ -439,6 +4860,183 @@ int main(int argc, const char* argv[])
         const char* option = argv[0] + 1;
         argv++; argc--;
 
+        if (option[0] == '-')
+        {
+            if (strcmp(option, "-max-dim") == 0)
+            {
+                if (argc <= 0 || (maxDim = atoi(argv[0])) <= 0)
+                    return fprintf(stderr, "Expecting size > 0 with --max-dim\n");
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-band") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting row count with --band\n");
+                sBandRows = std::max(atoi(argv[0]), 0);
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-batch") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting directory, pattern, or file list with --batch\n");
+
+                if (!FindBatchFiles(argv[0], &batchPaths))
+                    return fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                if (batchPaths.empty())
+                    return fprintf(stderr, "No images found for %s\n", argv[0]);
+
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-report") == 0)
+            {
+                if (argc <= 1)
+                    return fprintf(stderr, "Expecting source and output directory with --report\n");
+
+                // The report's results are all built from plain LUTs, or directly
+                if ((mode != kApplyLUT && mode != kApplyDirect && mode != kApplyFixed) || layout != kLayoutLinear)
+                    return fprintf(stderr, "--report only supports -n and -q, not -S, -j, -J, or -L\n");
+
+                std::vector<std::string> reportPaths;
+
+                if (!FindBatchFiles(argv[0], &reportPaths))
+                    return fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                if (reportPaths.empty())
+                    return fprintf(stderr, "No images found for %s\n", argv[0]);
+
+                if (!RunReport(reportPaths, argv[1], strength, mode, maxDim))
+                    return -1;
+
+                argv += 2; argc -= 2;
+            }
+            else if (strcmp(option, "-sheet") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting width with --sheet\n");
+                sReportSheetWidth = std::max(atoi(argv[0]), 0);
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-display-width") == 0)
+            {
+                if (argc <= 0 || (sReportDisplayWidth = atoi(argv[0])) <= 0)
+                    return fprintf(stderr, "Expecting width > 0 with --display-width\n");
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-serve") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting socket path with --serve\n");
+            #ifdef _MSC_VER
+                return fprintf(stderr, "--serve isn't supported on this platform\n");
+            #else
+                return Serve(argv[0]);
+            #endif
+            }
+            else if (strcmp(option, "-client") == 0)
+            {
+                if (argc <= 1)
+                    return fprintf(stderr, "Expecting socket path and raw, file, or shm with --client\n");
+            #ifdef _MSC_VER
+                return fprintf(stderr, "--client isn't supported on this platform\n");
+            #else
+                int i = 0;
+                while (i < kNumServeTransports && strcmp(argv[1], kServeTransportNames[i]) != 0)
+                    i++;
+
+                if (i == kNumServeTransports)
+                    return fprintf(stderr, "Unknown transport %s, expecting raw, file, or shm\n", argv[1]);
+
+                sServeTransport = tServeTransport(i);
+
+                if (sServeClient >= 0)
+                    close(sServeClient);
+
+                sServeClient = ConnectToServer(argv[0]);
+
+                if (sServeClient < 0)
+                    return fprintf(stderr, "Couldn't connect to %s\n", argv[0]);
+
+                argv += 2; argc -= 2;
+            #endif
+            }
+            else if (strcmp(option, "-stages") == 0)
+            {
+                int* threads = sBatchStageThreads;
+
+                if (argc <= 0 || sscanf(argv[0], "%d,%d,%d", &threads[kStageDecode], &threads[kStageTransform], &threads[kStageEncode]) != 3
+                 || threads[kStageDecode] <= 0 || threads[kStageTransform] <= 0 || threads[kStageEncode] <= 0)
+                    return fprintf(stderr, "Expecting <decode>,<transform>,<encode> thread counts with --stages\n");
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-output") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting .tar or .zip path with --output\n");
+
+                archive.reset(new cArchiveSink);
+
+                if (!archive->Open(argv[0]))
+                    return fprintf(stderr, "Couldn't create %s\n", argv[0]);
+
+                sOutputSink = archive.get();
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-pool-mb") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting size in MB with --pool-mb\n");
+                sBufferPool.mLimit = size_t(std::max(atoi(argv[0]), 0)) << 20;
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-io-depth") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting count with --io-depth\n");
+                sAsyncIODepth = std::max(atoi(argv[0]), 0);
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-tile-diff") == 0)
+            {
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting tile size with --tile-diff\n");
+                sFrameTileSize = std::max(atoi(argv[0]), 0);
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-frames") == 0 && argc > 0 && strcmp(argv[0], "y4m") == 0)
+            {
+            #ifdef _MSC_VER
+                _setmode(_fileno(stdin), _O_BINARY);
+            #endif
+                // The stream header gives the frame size
+                if (!y4m_read_header(stdin, &sFrameY4MInfo))
+                    return fprintf(stderr, "Couldn't read a supported Y4M header from stdin\n");
+                if (sFrameY4MInfo.w > (1 << 28) / sFrameY4MInfo.h)
+                    return fprintf(stderr, "Y4M frames of %dx%d are too large\n", sFrameY4MInfo.w, sFrameY4MInfo.h);
+
+                sFrameY4M = true;
+                sFrameWidth  = sFrameY4MInfo.w;
+                sFrameHeight = sFrameY4MInfo.h;
+                argv++; argc--;
+            }
+            else if (strcmp(option, "-frames") == 0)
+            {
+                if (argc <= 1 || sscanf(argv[0], "%dx%d", &sFrameWidth, &sFrameHeight) != 2 || sFrameWidth <= 0 || sFrameHeight <= 0 || sFrameWidth > (1 << 28) / sFrameHeight)
+                    return fprintf(stderr, "Expecting <w>x<h> <rgba|rgb24> with --frames\n");
+
+                if (strcmp(argv[1], "rgba") == 0)
+                    sFrameComp = 4;
+                else if (strcmp(argv[1], "rgb24") == 0)
+                    sFrameComp = 3;
+                else
+                    return fprintf(stderr, "Unknown frame format %s, expecting rgba or rgb24\n", argv[1]);
+
+                argv += 2; argc -= 2;
+            }
+            else
+                return fprintf(stderr, "Unknown option -%s\n", option);
+
+            continue;
+        }
+
         while (option[0])
         {
             switch (option[0])
@@ -459,6 +5057,9 @@ int main(int argc, const char* argv[])
                         return -1;
                     }
 
+                    if (!LoadDeferred(&dataInPath, maxDim, &dataIn, &w, &h))
+                        return -1;
+
                     for (cMonoLUTEntry& entry : kMonoLUTs)
                         if (strcmp(argv[0], entry.name) == 0)
                         {
@@ -470,7 +5071,7 @@ int main(int argc, const char* argv[])
                     if (!lutTable)
                     {
                         int lw, lh;
-                        lutTable = (RGBA32*) stbi_load(argv[0], &lw, &lh, 0, 4);
+                        lutTable = LoadImage(argv[0], &lw, &lh);
 
                         static char lutNameStore[256];
                         GetFileName(lutNameStore, sizeof(lutNameStore), argv[0]);
@@ -506,15 +5107,35 @@ int main(int argc, const char* argv[])
                 if (argc <= 0)
                     return fprintf(stderr, "Expecting filename with -f\n");
 
-                dataIn = (RGBA32*) stbi_load(argv[0], &w, &h, 0, 4);
-                
-                if (!dataIn)
+                stbi_image_free(paletted.indices);
+                paletted.indices = 0;
+
+                if (mode == kApplyDecodeLUT || mode == kApplyDecodeYCbCrLUT || (sBandRows > 0 && maxDim == 0))
                 {
-                    fprintf(stderr, "Couldn't read %s\n", argv[0]);
-                    return -1;
+                    // Leave decoding to the ops, which apply their LUT as they go, or stream the image through
+                    if (!GetImageInfo(argv[0], &w, &h))
+                    {
+                        fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                        return -1;
+                    }
+
+                    dataIn = 0;
+                    dataInPath = argv[0];
+                }
+                else
+                {
+                    dataIn = LoadImage(argv[0], &w, &h, maxDim, &paletted);
+                    dataInPath = 0;
+
+                    if (!dataIn)
+                    {
+                        fprintf(stderr, "Couldn't read %s\n", argv[0]);
+                        return -1;
+                    }
                 }
 
                 GetFileName(dataInName, sizeof(dataInName), argv[0]);
+                dataInFile = argv[0];
 
                 argv++; argc--;
                 break;
@@ -525,7 +5146,15 @@ int main(int argc, const char* argv[])
                     // protanope correction testing.
                     w = 256;
                     h = 256;
-                    dataIn = new RGBA32[w * h];
+                    dataIn = (RGBA32*) PoolAlloc(size_t(w) * h * sizeof(RGBA32));
+
+                    if (!dataIn)
+                        return fprintf(stderr, "Out of memory for swatch\n");
+
+                    stbi_image_free(paletted.indices);
+                    paletted.indices = 0;
+                    dataInPath = 0;
+                    dataInFile = 0;
                     strcpy(dataInName, "swatch");
 
                     RGBA32* p = dataIn;
@@ -564,52 +5193,66 @@ int main(int argc, const char* argv[])
                 break;
 
             case 'm':
-                if (argc <= 0)
-                    return fprintf(stderr, "Expecting strength for -m <float>\n");
-                strength = (float) atof(argv[0]);
+                if (argc <= 0 || !((strength = (float) atof(argv[0])) >= 0.0f && strength <= 1.0f))
+                    return fprintf(stderr, "Expecting strength from 0 to 1 for -m <float>\n");
                 argv++; argc--;
                 break;
 
             case 's':
-                CreateImage(kSimulate,          cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kSimulate,          cbType);
                 break;
 
             case 'e':
-                CreateImage(kError,             cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kError,             cbType);
                 break;
 
             case 'x':
-                CreateImage(kDaltonise,         cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kDaltonise,         cbType);
                 break;
             case 'X':
-                CreateImage(kDaltoniseSimulate, cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kDaltoniseSimulate, cbType);
                 break;
 
             case 'y':
-                CreateImage(kCorrect,           cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kCorrect,           cbType);
                 break;
             case 'Y':
-                CreateImage(kCorrectSimulate,   cbType, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kCorrectSimulate,   cbType);
                 break;
 
             case 'i':
-                CreateImage(kPassThrough, kIdentity, strength, w, h, dataIn, dataInName, noLUT);
+                createImage(kPassThrough,        kIdentity);
+                break;
+
+            case 'b':
+                if (!LoadDeferred(&dataInPath, maxDim, &dataIn, &w, &h))
+                    return -1;
+                Benchmark(cbType, strength, w, h, dataIn);
                 break;
 
             case 'g':
-                if (option[1] == 'l' or option[1] == 'L')
-                    Transform([](Vec3f c){ return LMSSwap(c, kL); }, w * h, dataIn, dataIn);
-                else if (option[1] == 'm' or option[1] == 'M')
-                    Transform([](Vec3f c){ return LMSSwap(c, kM); }, w * h, dataIn, dataIn);
-                else
-                    Transform([](Vec3f c){ return LMSSwap(c, kS); }, w * h, dataIn, dataIn);
+                if (!LoadDeferred(&dataInPath, maxDim, &dataIn, &w, &h))
+                    return -1;
+                {
+                    tLMS swap = (option[1] == 'l' or option[1] == 'L') ? kL : (option[1] == 'm' or option[1] == 'M') ? kM : kS;
+                    auto swapOp = [swap](Vec3f c){ return LMSSwap(c, swap); };
+
+                    Transform(swapOp, w * h, dataIn, dataIn);
+                    if (paletted.indices)
+                        Transform(swapOp, paletted.paletteSize, paletted.palette, paletted.palette);
+                }
                 option++;
 
             case 'r':
-                if (option[1] == 'm' or option[1] == 'M')
-                    Transform([](Vec3f c){ return RemapMToS(c); }, w * h, dataIn, dataIn);
-                else
-                    Transform([](Vec3f c){ return RemapLToS(c); }, w * h, dataIn, dataIn);
+                if (!LoadDeferred(&dataInPath, maxDim, &dataIn, &w, &h))
+                    return -1;
+                {
+                    Vec3f (*remapOp)(Vec3f) = (option[1] == 'm' or option[1] == 'M') ? RemapMToS : RemapLToS;
+
+                    Transform(remapOp, w * h, dataIn, dataIn);
+                    if (paletted.indices)
+                        Transform(remapOp, paletted.paletteSize, paletted.palette, paletted.palette);
+                }
                 option++;
                 break;
 
@@ -630,18 +5273,114 @@ int main(int argc, const char* argv[])
                 break;
                 
             case 'n':
-                noLUT = true;
+                mode = kApplyDirect;
+                break;
+
+            case 'S':
+                mode = kApplyShapedLUT;
+                break;
+
+            case 'q':
+                mode = kApplyFixed;
+                break;
+
+            case 'j':
+                mode = kApplyDecodeLUT;
+                break;
+
+            case 'J':
+                mode = kApplyDecodeYCbCrLUT;
+                break;
+
+            case 'P':
+                sParallelJPEG = true;
+                stbi_set_jpeg_parallel(ParallelFor, 0);
+                break;
+
+            case 'z':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting level with -z\n");
+
+                stbi_write_png_rle = 0;
+
+                if (strcmp(argv[0], "store") == 0)
+                    stbi_write_png_compression_level = 0;
+                else if (strcmp(argv[0], "rle") == 0)
+                    stbi_write_png_rle = 1;
+                else
+                    stbi_write_png_compression_level = atoi(argv[0]);
+
+                argv++; argc--;
+                break;
+
+            case 'o':
+                {
+                    if (argc <= 0)
+                        return fprintf(stderr, "Expecting format with -o\n");
+
+                    int i = 0;
+                    while (i < kNumImageFormats && strcmp(argv[0], kImageFormatNames[i]) != 0)
+                        i++;
+
+                    if (i == kNumImageFormats)
+                        return fprintf(stderr, "Unknown output format %s\n", argv[0]);
+
+                    sOutputFormat = tImageFormat(i);
+                    argv++; argc--;
+                }
+                break;
+
+            case 'I':
+                sIndexedOutput = true;
+                break;
+
+            case 'w':
+                {
+                    if (argc <= 0)
+                        return fprintf(stderr, "Expecting filter with -w\n");
+
+                    const char* filterNames[] = { "none", "sub", "up", "average", "paeth" };
+                    stbi_write_force_png_filter = -1;
+
+                    for (int i = 0; i < 5; i++)
+                        if (strcmp(argv[0], filterNames[i]) == 0)
+                            stbi_write_force_png_filter = i;
+
+                    if (stbi_write_force_png_filter < 0 && strcmp(argv[0], "best") != 0)
+                        return fprintf(stderr, "Unknown filter %s\n", argv[0]);
+
+                    argv++; argc--;
+                }
+                break;
+
+            case 'L':
+                if (argc <= 0)
+                    return fprintf(stderr, "Expecting layout with -L\n");
+
+                if (strcmp(argv[0], "linear") == 0)
+                    layout = kLayoutLinear;
+                else if (strcmp(argv[0], "morton") == 0)
+                    layout = kLayoutMorton;
+                else if (strcmp(argv[0], "bricked") == 0)
+                    layout = kLayoutBricked;
+                else
+                    return fprintf(stderr, "Unknown layout %s\n", argv[0]);
+
+                argv++; argc--;
                 break;
 
             case 'l':
                 if (argc <= 0)
                     return fprintf(stderr, "Expecting filename with -l\n");
 
+                if (!LoadDeferred(&dataInPath, maxDim, &dataIn, &w, &h))
+                    return -1;
+
                 if (!dataIn)
                     return fprintf(stderr, "No input file to apply lut to\n");
 
                 int lw, lh;
-                RGBA32* lut = (RGBA32*) stbi_load(argv[0], &lw, &lh, 0, 4);
+                RGBA32* lut = LoadImage(argv[0], &lw, &lh);
                 
                 if (!lut)
                 {
@@ -661,7 +5400,13 @@ int main(int argc, const char* argv[])
                     return -1;
                 }
 
-                CreateImage(lut, w, h, dataIn);
+                // Converted to 'layout' as it's loaded
+                {
+                    const cLayoutLUT layoutLUT((const RGBA32 (*)[kLUTSize][kLUTSize]) lut, layout);
+                    CreateImage(layoutLUT, w, h, dataIn);
+                }
+
+                PoolFree(lut);
                 
                 argv++; argc--;
                 break;
@@ -672,12 +5417,37 @@ int main(int argc, const char* argv[])
 
     if (dataIn)
         stbi_image_free(dataIn);
+    stbi_image_free(paletted.indices);
 
     if (argc > 0)
     {
         fprintf(stderr, "Unrecognised arguments starting with %s\n", argv[0]);
         return -1;
     }
-        
+
+    if (!batchOps.empty())
+        RunBatch(batchPaths, batchOps, maxDim);
+
+    if (clientFailed)
+        return -1;
+
+    if (numFrameOps > 1)
+        return fprintf(stderr, "--frames only supports a single op, as there's only the one stdin stream\n");
+
+    if (numFrameOps > 0)
+    {
+        if (frameOp.cbType == kAll)
+            return fprintf(stderr, "--frames needs a single type: -p, -d, or -t\n");
+
+        CreateImage(frameOp.op, frameOp.cbType, frameOp.strength, 0, 0, 0, 0, 0, 0, "", frameOp.mode, frameOp.layout);
+    }
+
     return 0;
 }
+
+#ifndef CBLUT_NO_MAIN
+int main(int argc, const char* argv[])
+{
+    return RunCBLutGen(argc, argv);
+}
+#endif
@@ -0,0 +1,35 @@
+//
+//  File:       CBLutGen.h
+//
+//  Function:   Interface for embedding the cblutgen tool in another program
+//
+//  Copyright:  Andrew Willmott 2018
+//
+//  Compile CBLutGen.cpp with CBLUT_NO_MAIN defined to leave out its main(),
+//  and run the tool via RunCBLutGen instead.
+//
+
+#ifndef CB_LUT_GEN_H
+#define CB_LUT_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace CBLut
+{
+    // Receives an encoded image, along with the filename it would otherwise
+    // have been saved as. 'data' is only valid for the duration of the call.
+    // During --batch this can be called from several threads at once.
+    typedef void tOutputCallback(void* user, const char* filename, const uint8_t* data, size_t size);
+
+    // Have images from later runs passed to 'callback' rather than written to
+    // files, or if it's 0, go back to files. "--output" still takes precedence.
+    void SetOutputCallback(tOutputCallback* callback, void* user);
+
+    // Run the tool with the given command line, as main() does, with argv[0]
+    // the command name. Returns 0 on success. Settings made by options, such
+    // as -z or --band, carry over to later runs.
+    int RunCBLutGen(int argc, const char* argv[]);
+}
+
+#endif
@@ -11,6 +11,8 @@
 #include <math.h>
 #include <assert.h>
 
+#include <algorithm>
+
 using namespace CBLut;
 
 // --- Colour-blind support ---------------------------------------------------
@@ -280,6 +282,85 @@ Vec3f CBLut::Correct(Vec3f rgb, tLMS lmsType, float strength)
 }
 
 
+// Specialised versions
+
+namespace
+{
+    template<tLMS kType> inline const Mat3f& DaltonLMSTransform()
+    {
+        return kType == kL ? kLMSProtanopeV : kType == kM ? kLMSDeuteranopeV : kLMSTritanopeV;
+    }
+
+    template<tLMS kType> inline const Mat3f& DaltonErrorToDelta()
+    {
+        return kType == kL ? kDaltonErrorToDeltaP : kType == kM ? kDaltonErrorToDeltaD : kDaltonErrorToDeltaT;
+    }
+}
+
+template<tLMS kType, bool kFullStrength> Vec3f CBLut::Simulate(Vec3f rgb, float strength)
+{
+    Vec3f lms = kLMSFromRGB * rgb;
+
+    float&      eltx   = elt(lms, kType);
+    const float simElt = dot(row(kLMSSimulate, kType), lms);
+
+    if (kFullStrength)
+        eltx = simElt;
+    else
+        eltx += strength * (simElt - eltx);
+
+    return kRGBFromLMS * lms;
+}
+
+template<tLMS kType, bool kFullStrength> Vec3f CBLut::Daltonise(Vec3f rgb, float strength)
+{
+    Vec3f rgbSim   = SimulateV(rgb, DaltonLMSTransform<kType>());
+    Vec3f rgbError = rgb - rgbSim;
+
+    if (!kFullStrength)
+        rgbError = strength * rgbError;
+
+    return rgb + DaltonErrorToDelta<kType>() * rgbError;
+}
+
+template<tLMS kType, bool kFullStrength> Vec3f CBLut::Correct(Vec3f rgb, float strength)
+{
+    if (kFullStrength)
+        strength = 1.0f;
+
+    const Vec3f lms = kLMSFromRGB * rgb;
+
+    const float orgElt = elt(lms, kType);
+    const float simElt = dot(row(kLMSSimulate, kType), lms);
+    const float error  = strength * (orgElt - simElt);
+
+    const float mc = strength * strength;
+    const float ms = 1.0f - strength;
+
+    const Vec3f amount3Recip = { -0.25f, -0.3f, -0.07f };
+    const float amount = elt(amount3Recip, kType);
+
+    Vec3f correct = mc * amount * col(kNCDeltaRecip, kType);
+    elt(correct, kType) = ms * 2.0f;
+
+    return kRGBFromLMS * (lms + error * correct);
+}
+
+#define CB_INSTANTIATE_OP(OP)                                           \
+    template Vec3f CBLut::OP<kL, false>(Vec3f rgb, float strength);     \
+    template Vec3f CBLut::OP<kL, true >(Vec3f rgb, float strength);     \
+    template Vec3f CBLut::OP<kM, false>(Vec3f rgb, float strength);     \
+    template Vec3f CBLut::OP<kM, true >(Vec3f rgb, float strength);     \
+    template Vec3f CBLut::OP<kS, false>(Vec3f rgb, float strength);     \
+    template Vec3f CBLut::OP<kS, true >(Vec3f rgb, float strength);
+
+CB_INSTANTIATE_OP(Simulate)
+CB_INSTANTIATE_OP(Daltonise)
+CB_INSTANTIATE_OP(Correct)
+
+#undef CB_INSTANTIATE_OP
+
+
 // --- RGB LUT support ---------------------------------------------------------
 
 namespace
@@ -305,6 +386,26 @@ namespace
 
         return uint8_t(f * 256.0f);
     }
+
+    inline uint16_t ToU10u(float f) // 10-bit equivalent of ToU8u
+    {
+        if (f <= 0.0f)
+            return 0;
+        if (f >= 1.0f)
+            return 1023;
+
+        return uint16_t(f * 1024.0f);
+    }
+
+    inline uint16_t ToU16u(float f) // 16-bit equivalent of ToU8u
+    {
+        if (f <= 0.0f)
+            return 0;
+        if (f >= 1.0f)
+            return 65535;
+
+        return uint16_t(f * 65536.0f);
+    }
 }
 
 RGBA32 CBLut::ToRGBA32(Vec3f c)
@@ -344,6 +445,52 @@ Vec3f CBLut::FromRGBA32u(RGBA32 rgb)
     Vec3f c = { rgb.c[0] / 256.0f, rgb.c[1] / 256.0f, rgb.c[2] / 256.0f };
     return pow(c, kGamma);
 }
+
+RGB565 CBLut::ToRGB565u(Vec3f c)
+{
+    RGBA32 c8 = ToRGBA32u(c);
+
+    // round to nearest so that bit replication on expansion gets us back close to c8
+    int r = (c8.c[0] * 31 + 127) / 255;
+    int g = (c8.c[1] * 63 + 127) / 255;
+    int b = (c8.c[2] * 31 + 127) / 255;
+
+    return { uint16_t(r << 11 | g << 5 | b) };
+}
+
+RGB10A2 CBLut::ToRGB10A2u(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+
+    uint32_t r = ToU10u(c.x);
+    uint32_t g = ToU10u(c.y);
+    uint32_t b = ToU10u(c.z);
+
+    return { r | g << 10 | b << 20 | 3u << 30 };
+}
+
+RGB16 CBLut::ToRGB16u(Vec3f c)
+{
+    c = pow(c, 1.0f / kGamma);
+    return { ToU16u(c.x), ToU16u(c.y), ToU16u(c.z) };
+}
+
+RGB16 CBLut::ToRGB16(RGBA32 c)
+{
+    return { uint16_t(c.c[0] << 8), uint16_t(c.c[1] << 8), uint16_t(c.c[2] << 8) };
+}
+
+RGBA32 CBLut::ToRGBA32(RGB16 c)
+{
+    RGBA32 result;
+
+    result.c[0] = c.c[0] >> 8;
+    result.c[1] = c.c[1] >> 8;
+    result.c[2] = c.c[2] >> 8;
+    result.c[3] = 255;
+
+    return result;
+}
     
 
 void CBLut::CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
@@ -366,25 +513,26 @@ void CBLut::CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize])
 
 #define EXTRAPOLATE_LUT 1
 
-void CBLut::ApplyLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+namespace
 {
-    constexpr int lutShift = kLUTBits;
-    constexpr int lutSize  = 1 << lutShift;
-    constexpr int fShift   = 8 - lutShift;
-    constexpr int fHalf    = 1 << (fShift - 1);
-    constexpr int fMask    = (1 << fShift) - 1;
-
-    for (int i = 0; i < n; i++)
+    // Find the two LUT entries to lerp between for each channel of 'ci', and
+    // the lerp factors, in 1/8ths
+    inline void LUTCoords(const uint8_t ci[4], int i0[3], int i1[3], int s[3])
     {
-        const uint8_t* ci = dataIn[i].c;
-
-        int co[3] = { ci[0] + fHalf,   ci[1] + fHalf,   ci[2] + fHalf   };
-        int i1[3] = { co[0] >> fShift, co[1] >> fShift, co[2] >> fShift };
-        int i0[3] = { i1[0] - 1,       i1[1] - 1,       i1[2] - 1       };
-        int s [3] = { co[0] & fMask,   co[1] & fMask,   co[2] & fMask   };
+        constexpr int lutShift = kLUTBits;
+        constexpr int lutSize  = 1 << lutShift;
+        constexpr int fShift   = 8 - lutShift;
+        constexpr int fHalf    = 1 << (fShift - 1);
+        constexpr int fMask    = (1 << fShift) - 1;
 
         for (int j = 0; j < 3; j++)
         {
+            int co = ci[j] + fHalf;
+
+            i1[j] = co >> fShift;
+            i0[j] = i1[j] - 1;
+            s [j] = co & fMask;
+
             if (i0[j] < 0)
             {
                 i0[j]++;
@@ -406,7 +554,10 @@ void CBLut::ApplyLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const R
             assert(0 <= i0[j] && i0[j] < kLUTSize);
             assert(0 <= i1[j] && i1[j] < kLUTSize);
         }
-        
+    }
+
+    inline RGBA32 LerpLUT(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], const int i0[3], const int i1[3], const int s[3])
+    {
         RGBA32 lutC0 = rgbLUT[i0[2]][i0[1]][i0[0]];
         RGBA32 lutC1 = rgbLUT[i1[2]][i1[1]][i1[0]];
 
@@ -424,14 +575,41 @@ void CBLut::ApplyLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const R
         assert(0 <= ch1 && ch1 <= 255);
         assert(0 <= ch2 && ch2 <= 255);
 
-        dataOut[i].c[0] = ch0;
-        dataOut[i].c[1] = ch1;
-        dataOut[i].c[2] = ch2;
-        dataOut[i].c[3] = 255;
+        RGBA32 result;
+
+        result.c[0] = ch0;
+        result.c[1] = ch1;
+        result.c[2] = ch2;
+        result.c[3] = 255;
+
+        return result;
+    }
+}
+
+void CBLut::ApplyLUT(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        int i0[3], i1[3], s[3];
+        LUTCoords(dataIn[i].c, i0, i1, s);
+
+        dataOut[i] = LerpLUT(rgbLUT, i0, i1, s);
     }
 }
 
-void CBLut::ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+void CBLut::ApplyLUTs(const RGBA32 (* const rgbLUTs[])[kLUTSize][kLUTSize], int numLUTs, int n, const RGBA32 dataIn[], RGBA32* const dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        int i0[3], i1[3], s[3];
+        LUTCoords(dataIn[i].c, i0, i1, s);
+
+        for (int j = 0; j < numLUTs; j++)
+            dataOut[j][i] = LerpLUT(rgbLUTs[j], i0, i1, s);
+    }
+}
+
+void CBLut::ApplyLUTNoLerp(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
 {
     constexpr int fShift = 8 - kLUTBits;
 
@@ -443,6 +621,739 @@ void CBLut::ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, c
     }
 }
 
+namespace
+{
+    // Finds the two LUT entries to lerp between for channel value 'c', which
+    // has kFBits of sub-entry precision, and the lerp factor 's' in the same
+    // precision. This is the per-channel setup from ApplyLUT above.
+    template<int kFBits> inline void LerpSetup(int c, int& i0, int& i1, int& s)
+    {
+        constexpr int fHalf = 1 << (kFBits - 1);
+        constexpr int fMask = (1 << kFBits) - 1;
+        constexpr int fOne  = 1 << kFBits;
+
+        int co = c + fHalf;
+
+        i1 = co >> kFBits;
+        i0 = i1 - 1;
+        s  = co & fMask;
+
+        if (i0 < 0)
+        {
+            i0++;
+        #ifdef EXTRAPOLATE_LUT
+            i1++;
+            s -= fOne;
+        #endif
+        }
+        else
+        if (i1 >= kLUTSize)
+        {
+            i1--;
+        #ifdef EXTRAPOLATE_LUT
+            i0--;
+            s += fOne;
+        #endif
+        }
+
+        assert(0 <= i0 && i0 < kLUTSize);
+        assert(0 <= i1 && i1 < kLUTSize);
+    }
+
+    inline int ClampChannel(int c, int maxC)
+    {
+        return c < 0 ? 0 : c > maxC ? maxC : c;
+    }
+
+    constexpr int kFBits8  = 8  - kLUTBits;     // sub-entry precision for 8-bit input
+    constexpr int kFBits16 = 16 - kLUTBits;     // sub-entry precision for RGB16 input
+
+    // RGB16 LUT kernel, used for all the input/output combinations.
+    inline void Load(const RGBA32& c, int ch[3]) { ch[0] = c.c[0] << 8; ch[1] = c.c[1] << 8; ch[2] = c.c[2] << 8; }
+    inline void Load(const RGB16&  c, int ch[3]) { ch[0] = c.c[0];      ch[1] = c.c[1];      ch[2] = c.c[2];      }
+
+    inline void Store(RGBA32& c, const int ch[3]) { c.c[0] = ch[0] >> 8; c.c[1] = ch[1] >> 8; c.c[2] = ch[2] >> 8; c.c[3] = 255; }
+    inline void Store(RGB16&  c, const int ch[3]) { c.c[0] = ch[0];      c.c[1] = ch[1];      c.c[2] = ch[2];      }
+
+    template<class tIn, class tOut> void ApplyLUT16(const RGB16 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const tIn dataIn[], tOut dataOut[])
+    {
+        constexpr int fOne = 1 << kFBits16;
+
+        for (int i = 0; i < n; i++)
+        {
+            int ci[3], i0[3], i1[3], s[3];
+            Load(dataIn[i], ci);
+
+            for (int j = 0; j < 3; j++)
+                LerpSetup<kFBits16>(ci[j], i0[j], i1[j], s[j]);
+
+            const RGB16& lutC0 = rgbLUT[i0[2]][i0[1]][i0[0]];
+            const RGB16& lutC1 = rgbLUT[i1[2]][i1[1]][i1[0]];
+
+            int co[3];
+            for (int j = 0; j < 3; j++)
+                co[j] = ClampChannel(((fOne - s[j]) * lutC0.c[j] + s[j] * lutC1.c[j]) >> kFBits16, 65535);
+
+            Store(dataOut[i], co);
+        }
+    }
+}
+
+void CBLut::ApplyLUT(const RGB565 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    constexpr int fOne = 1 << kFBits8;
+
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t* ci = dataIn[i].c;
+        int i0[3], i1[3], s[3];
+
+        for (int j = 0; j < 3; j++)
+            LerpSetup<kFBits8>(ci[j], i0[j], i1[j], s[j]);
+
+        uint32_t lutC0 = rgbLUT[i0[2]][i0[1]][i0[0]].u16;
+        uint32_t lutC1 = rgbLUT[i1[2]][i1[1]][i1[0]].u16;
+
+        // expand to 8 bits via bit replication
+        int r0 = (lutC0 >> 11) << 3 | (lutC0 >> 13);
+        int r1 = (lutC1 >> 11) << 3 | (lutC1 >> 13);
+        int g0 = (lutC0 >> 3 & 0xFC) | (lutC0 >> 9 & 0x3);
+        int g1 = (lutC1 >> 3 & 0xFC) | (lutC1 >> 9 & 0x3);
+        int b0 = (lutC0 << 3 & 0xF8) | (lutC0 >> 2 & 0x7);
+        int b1 = (lutC1 << 3 & 0xF8) | (lutC1 >> 2 & 0x7);
+
+        dataOut[i].c[0] = ClampChannel(((fOne - s[0]) * r0 + s[0] * r1) >> kFBits8, 255);
+        dataOut[i].c[1] = ClampChannel(((fOne - s[1]) * g0 + s[1] * g1) >> kFBits8, 255);
+        dataOut[i].c[2] = ClampChannel(((fOne - s[2]) * b0 + s[2] * b1) >> kFBits8, 255);
+        dataOut[i].c[3] = 255;
+    }
+}
+
+void CBLut::ApplyLUT(const RGB10A2 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    constexpr int fOne   = 1 << kFBits8;
+    constexpr int oShift = kFBits8 + 2;   // lerp result has 10 + kFBits8 bits
+
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t* ci = dataIn[i].c;
+        int i0[3], i1[3], s[3];
+
+        for (int j = 0; j < 3; j++)
+            LerpSetup<kFBits8>(ci[j], i0[j], i1[j], s[j]);
+
+        uint32_t lutC0 = rgbLUT[i0[2]][i0[1]][i0[0]].u32;
+        uint32_t lutC1 = rgbLUT[i1[2]][i1[1]][i1[0]].u32;
+
+        int r0 = lutC0 & 0x3FF, g0 = lutC0 >> 10 & 0x3FF, b0 = lutC0 >> 20 & 0x3FF;
+        int r1 = lutC1 & 0x3FF, g1 = lutC1 >> 10 & 0x3FF, b1 = lutC1 >> 20 & 0x3FF;
+
+        dataOut[i].c[0] = ClampChannel(((fOne - s[0]) * r0 + s[0] * r1) >> oShift, 255);
+        dataOut[i].c[1] = ClampChannel(((fOne - s[1]) * g0 + s[1] * g1) >> oShift, 255);
+        dataOut[i].c[2] = ClampChannel(((fOne - s[2]) * b0 + s[2] * b1) >> oShift, 255);
+        dataOut[i].c[3] = 255;
+    }
+}
+
+void CBLut::ApplyLUT(const RGB16 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    ApplyLUT16(rgbLUT, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUT(const RGB16 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGB16 dataOut[])
+{
+    ApplyLUT16(rgbLUT, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUT(const RGB16 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGB16 dataIn[], RGB16 dataOut[])
+{
+    ApplyLUT16(rgbLUT, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyLUT(const RGB16 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGB16 dataIn[], RGBA32 dataOut[])
+{
+    ApplyLUT16(rgbLUT, n, dataIn, dataOut);
+}
+
+// --- LUT layouts -------------------------------------------------------------
+
+namespace
+{
+    // Spreads the kLUTBits of i out so there are two zero bits between each
+    constexpr uint32_t MortonSpread(uint32_t i, int bit = 0)
+    {
+        return bit >= kLUTBits ? 0 : ((i >> bit & 1) << (3 * bit)) | MortonSpread(i, bit + 1);
+    }
+
+    struct cMortonTable
+    {
+        uint32_t spread[kLUTSize];
+
+        cMortonTable()
+        {
+            for (int i = 0; i < kLUTSize; i++)
+                spread[i] = MortonSpread(i);
+        }
+    };
+
+    const cMortonTable kMorton;
+
+    inline int MortonIndex(int r, int g, int b)
+    {
+        return kMorton.spread[r] | kMorton.spread[g] << 1 | kMorton.spread[b] << 2;
+    }
+
+    inline int CellIndex(int r, int g, int b)
+    {
+        return (b * (kLUTSize - 1) + g) * (kLUTSize - 1) + r;
+    }
+
+    // Sets up the cell and per-axis lerp factors for a trilinear lookup
+    inline void ChannelSetup(int c, int& i0, int& s)
+    {
+        int i1;
+        LerpSetup<kFBits8>(c, i0, i1, s);
+
+        if (i0 == i1)    // only without EXTRAPOLATE_LUT, at the edges
+        {
+            if (i0 > 0)
+                i0--;
+            s = i1 == 0 ? 0 : 1 << kFBits8;
+        }
+    }
+
+    inline void CellSetup(const uint8_t ci[3], int i0[3], int s[3])
+    {
+        for (int j = 0; j < 3; j++)
+            ChannelSetup(ci[j], i0[j], s[j]);
+    }
+
+    // Trilinear interpolation between 8 corners, indexed by r | g << 1 | b << 2.
+    template<class T> inline void Trilinear(const T& corner, const int s[3], RGBA32& out)
+    {
+        constexpr int fOne = 1 << kFBits8;
+
+        for (int j = 0; j < 3; j++)
+        {
+            int a00 = corner(0).c[j] * fOne + (corner(1).c[j] - corner(0).c[j]) * s[0];
+            int a01 = corner(2).c[j] * fOne + (corner(3).c[j] - corner(2).c[j]) * s[0];
+            int a10 = corner(4).c[j] * fOne + (corner(5).c[j] - corner(4).c[j]) * s[0];
+            int a11 = corner(6).c[j] * fOne + (corner(7).c[j] - corner(6).c[j]) * s[0];
+
+            int b0 = a00 * fOne + (a01 - a00) * s[1];
+            int b1 = a10 * fOne + (a11 - a10) * s[1];
+
+            int c = b0 * fOne + (b1 - b0) * s[2];
+
+            out.c[j] = ClampChannel(c >> (3 * kFBits8), 255);
+        }
+
+        out.c[3] = 255;
+    }
+}
+
+void CBLut::ConvertLUTToMorton(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], RGBA32 mortonLUT[kLUTEntries])
+{
+    for (int i = 0; i < kLUTSize; i++)
+    for (int j = 0; j < kLUTSize; j++)
+    for (int k = 0; k < kLUTSize; k++)
+        mortonLUT[MortonIndex(k, j, i)] = rgbLUT[i][j][k];
+}
+
+void CBLut::ConvertLUTToBricked(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], RGBA32 brickLUT[kLUTCells][8])
+{
+    for (int i = 0; i < kLUTSize - 1; i++)
+    for (int j = 0; j < kLUTSize - 1; j++)
+    for (int k = 0; k < kLUTSize - 1; k++)
+    {
+        RGBA32* brick = brickLUT[CellIndex(k, j, i)];
+
+        for (int c = 0; c < 8; c++)
+            brick[c] = rgbLUT[i + (c >> 2)][j + (c >> 1 & 1)][k + (c & 1)];
+    }
+}
+
+void CBLut::ApplyLUTMorton(const RGBA32 mortonLUT[kLUTEntries], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    constexpr int fOne = 1 << kFBits8;
+
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t* ci = dataIn[i].c;
+        int i0[3], i1[3], s[3];
+
+        for (int j = 0; j < 3; j++)
+            LerpSetup<kFBits8>(ci[j], i0[j], i1[j], s[j]);
+
+        RGBA32 lutC0 = mortonLUT[MortonIndex(i0[0], i0[1], i0[2])];
+        RGBA32 lutC1 = mortonLUT[MortonIndex(i1[0], i1[1], i1[2])];
+
+        for (int j = 0; j < 3; j++)
+            dataOut[i].c[j] = ClampChannel(((fOne - s[j]) * lutC0.c[j] + s[j] * lutC1.c[j]) >> kFBits8, 255);
+
+        dataOut[i].c[3] = 255;
+    }
+}
+
+void CBLut::ApplyLUTTrilinear(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        int i0[3], s[3];
+        CellSetup(dataIn[i].c, i0, s);
+
+        const RGBA32 (*cell)[kLUTSize][kLUTSize] = (const RGBA32 (*)[kLUTSize][kLUTSize]) &rgbLUT[i0[2]][i0[1]][i0[0]];
+
+        Trilinear([cell](int c) -> const RGBA32& { return cell[c >> 2][c >> 1 & 1][c & 1]; }, s, dataOut[i]);
+    }
+}
+
+void CBLut::ApplyLUTBricked(const RGBA32 brickLUT[kLUTCells][8], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        int i0[3], s[3];
+        CellSetup(dataIn[i].c, i0, s);
+
+        const RGBA32* brick = brickLUT[CellIndex(i0[0], i0[1], i0[2])];
+
+        Trilinear([brick](int c) -> const RGBA32& { return brick[c]; }, s, dataOut[i]);
+    }
+}
+
+// --- YCbCr LUT support ------------------------------------------------------
+
+namespace
+{
+    // Limited-range scales, as per BT.601
+    constexpr float kYScale = 219.0f / 255.0f;
+    constexpr float kCScale = 224.0f / 255.0f;
+
+    Vec3f FromYCbCrf(float y, float cb, float cr)
+    {
+        Vec3f c =
+        {
+            y + 1.40200f * cr,
+            y - 0.34414f * cb - 0.71414f * cr,
+            y + 1.77200f * cb
+        };
+
+        c.x = c.x < 0.0f ? 0.0f : c.x > 255.0f ? 255.0f : c.x;
+        c.y = c.y < 0.0f ? 0.0f : c.y > 255.0f ? 255.0f : c.y;
+        c.z = c.z < 0.0f ? 0.0f : c.z > 255.0f ? 255.0f : c.z;
+
+        c = { c.x / 256.0f, c.y / 256.0f, c.z / 256.0f };
+        return pow(c, kGamma);
+    }
+
+    // Returns full-range y, cb, cr, with cb and cr centred on 0. As for
+    // ToRGBA32u, 'c' is clamped to the RGB gamut first.
+    Vec3f ToYCbCrf(Vec3f c)
+    {
+        c.x = c.x < 0.0f ? 0.0f : c.x > 1.0f ? 1.0f : c.x;
+        c.y = c.y < 0.0f ? 0.0f : c.y > 1.0f ? 1.0f : c.y;
+        c.z = c.z < 0.0f ? 0.0f : c.z > 1.0f ? 1.0f : c.z;
+
+        c = pow(c, 1.0f / kGamma);
+        c = { c.x * 256.0f, c.y * 256.0f, c.z * 256.0f };
+
+        float y = 0.299f * c.x + 0.587f * c.y + 0.114f * c.z;
+
+        return { y, (c.z - y) / 1.772f, (c.x - y) / 1.402f };
+    }
+
+    inline uint8_t RoundU8(float f)
+    {
+        return f <= 0.0f ? 0 : f >= 255.0f ? 255 : uint8_t(f + 0.5f);
+    }
+}
+
+Vec3f CBLut::FromYCbCru(RGBA32 ycc)
+{
+    return FromYCbCrf(ycc.c[0], ycc.c[1] - 128.0f, ycc.c[2] - 128.0f);
+}
+
+Vec3f CBLut::FromYCbCrLimitedu(RGBA32 ycc)
+{
+    return FromYCbCrf((ycc.c[0] - 16.0f) / kYScale, (ycc.c[1] - 128.0f) / kCScale, (ycc.c[2] - 128.0f) / kCScale);
+}
+
+RGBA32 CBLut::ToYCbCru(Vec3f c)
+{
+    Vec3f ycc = ToYCbCrf(c);
+    return { RoundU8(ycc.x), RoundU8(ycc.y + 128.0f), RoundU8(ycc.z + 128.0f), 255 };
+}
+
+RGBA32 CBLut::ToYCbCrLimitedu(Vec3f c)
+{
+    Vec3f ycc = ToYCbCrf(c);
+    return { RoundU8(ycc.x * kYScale + 16.0f), RoundU8(ycc.y * kCScale + 128.0f), RoundU8(ycc.z * kCScale + 128.0f), 255 };
+}
+
+void CBLut::ApplyYCbCrLUT(const RGBA32 yccLUT[kLUTSize][kLUTSize][kLUTSize], int n, const uint8_t y[], const uint8_t cb[], const uint8_t cr[], RGBA32 dataOut[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t ci[3] = { y[i], cb[i], cr[i] };
+        int i0[3], s[3];
+        CellSetup(ci, i0, s);
+
+        const RGBA32 (*cell)[kLUTSize][kLUTSize] = (const RGBA32 (*)[kLUTSize][kLUTSize]) &yccLUT[i0[2]][i0[1]][i0[0]];
+
+        Trilinear([cell](int c) -> const RGBA32& { return cell[c >> 2][c >> 1 & 1][c & 1]; }, s, dataOut[i]);
+    }
+}
+
+namespace
+{
+    // Cell setup for all 8-bit channel values
+    struct cCellSetupTable
+    {
+        int  i0[256];
+        int  s [256];
+        bool extrapolated[256];     // if set, s is outside 0-1 and so results need clamping
+
+        cCellSetupTable()
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                ChannelSetup(c, i0[c], s[c]);
+                extrapolated[c] = s[c] < 0 || s[c] > (1 << kFBits8);
+            }
+        }
+    };
+
+    // Transform the chroma blocks [cx0, cx1) x [cy0, cy1) of YCbCr planes.
+    // All the luma samples in a block share the same Cb/Cr lerp, so each Y
+    // slice of the LUT that the block touches is bilinearly interpolated
+    // once, leaving only a lerp between two slices per sample. The arithmetic
+    // is exact until the final shift, so luma matches Trilinear. kBlockW/H are
+    // the block size for the interior, or 0 to handle partial blocks at the edges.
+    template<int kBlockW, int kBlockH> void ApplyYCbCrLUTBlocks
+    (
+        const RGBA32 yccLUT[kLUTSize][kLUTSize][kLUTSize], const cCellSetupTable& setup,
+        int w, int h, int shiftX, int shiftY, int cx0, int cx1, int cy0, int cy1,
+        uint8_t y[], uint8_t cb[], uint8_t cr[]
+    )
+    {
+        constexpr int fOne   = 1 << kFBits8;
+        constexpr int fShift = 3 * kFBits8;
+        constexpr int kMaxSum = 255 << fShift;     // channel maximum before the final shift
+        constexpr int kMaxBlock = 16;
+
+        const int cw = (w + (1 << shiftX) - 1) >> shiftX;
+
+        int slices[kLUTSize][3];
+
+        for (int cy = cy0; cy < cy1; cy++)
+        for (int cx = cx0; cx < cx1; cx++)
+        {
+            const int block = cy * cw + cx;
+
+            const int s1 = setup.s[cb[block]];
+            const int s2 = setup.s[cr[block]];
+
+            const RGBA32 (*cell)[kLUTSize][kLUTSize] = (const RGBA32 (*)[kLUTSize][kLUTSize]) &yccLUT[setup.i0[cr[block]]][setup.i0[cb[block]]][0];
+
+            const int x0 = cx << shiftX, x1 = kBlockW ? x0 + kBlockW : std::min(x0 + (1 << shiftX), w);
+            const int y0 = cy << shiftY, y1 = kBlockH ? y0 + kBlockH : std::min(y0 + (1 << shiftY), h);
+
+            uint8_t* samples[kMaxBlock];
+            int count = 0;
+            int kMin = kLUTSize;
+            int kMax = 0;
+            bool extrapolated = setup.extrapolated[cb[block]] || setup.extrapolated[cr[block]];
+
+            for (int ly = y0; ly < y1; ly++)
+            for (int lx = x0; lx < x1; lx++)
+            {
+                uint8_t* sample = y + ly * w + lx;
+                int k = setup.i0[*sample];
+
+                kMin = std::min(k, kMin);
+                kMax = std::max(k, kMax);
+                extrapolated |= setup.extrapolated[*sample];
+                samples[count++] = sample;
+            }
+
+            for (int k = kMin; k <= kMax + 1; k++)
+            for (int j = 0; j < 3; j++)
+            {
+                int b0 = cell[0][0][k].c[j] * fOne + (cell[0][1][k].c[j] - cell[0][0][k].c[j]) * s1;
+                int b1 = cell[1][0][k].c[j] * fOne + (cell[1][1][k].c[j] - cell[1][0][k].c[j]) * s1;
+
+                slices[k][j] = b0 * fOne + (b1 - b0) * s2;
+            }
+
+            int sumCb = 0;
+            int sumCr = 0;
+
+            // Interpolating between LUT entries stays within their range, so
+            // only extrapolation at the edges of the LUT needs clamping
+            if (extrapolated)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    const int  s0 = setup.s[*samples[i]];
+                    const int* c0 = slices[setup.i0[*samples[i]]];
+                    const int* c1 = c0 + 3;
+
+                    *samples[i] = uint8_t(ClampChannel((c0[0] * fOne + (c1[0] - c0[0]) * s0) >> fShift, 255));
+                    sumCb +=              ClampChannel( c0[1] * fOne + (c1[1] - c0[1]) * s0, kMaxSum);
+                    sumCr +=              ClampChannel( c0[2] * fOne + (c1[2] - c0[2]) * s0, kMaxSum);
+                }
+            }
+            else
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    const int  s0 = setup.s[*samples[i]];
+                    const int* c0 = slices[setup.i0[*samples[i]]];
+                    const int* c1 = c0 + 3;
+
+                    *samples[i] = uint8_t((c0[0] * fOne + (c1[0] - c0[0]) * s0) >> fShift);
+                    sumCb +=               c0[1] * fOne + (c1[1] - c0[1]) * s0;
+                    sumCr +=               c0[2] * fOne + (c1[2] - c0[2]) * s0;
+                }
+            }
+
+            // Average at full precision, rounding to nearest
+            const int scale = (kBlockW ? kBlockW * kBlockH : count) << fShift;
+
+            cb[block] = uint8_t((sumCb + scale / 2) / scale);
+            cr[block] = uint8_t((sumCr + scale / 2) / scale);
+        }
+    }
+}
+
+void CBLut::ApplyYCbCrLUTPlanar(const RGBA32 yccLUT[kLUTSize][kLUTSize][kLUTSize], int w, int h, int shiftX, int shiftY, uint8_t y[], uint8_t cb[], uint8_t cr[])
+{
+    assert(0 <= shiftX && shiftX <= 2 && 0 <= shiftY && shiftY <= 2);
+
+    static const cCellSetupTable setup;
+
+    // Blocks wholly inside the image, specialised on the common subsamplings
+    const int cw = w >> shiftX;
+    const int ch = h >> shiftY;
+
+    if (shiftX == 1 && shiftY == 1)         // 4:2:0
+        ApplyYCbCrLUTBlocks<2, 2>(yccLUT, setup, w, h, shiftX, shiftY, 0, cw, 0, ch, y, cb, cr);
+    else if (shiftX == 1 && shiftY == 0)    // 4:2:2
+        ApplyYCbCrLUTBlocks<2, 1>(yccLUT, setup, w, h, shiftX, shiftY, 0, cw, 0, ch, y, cb, cr);
+    else if (shiftX == 0 && shiftY == 0)    // 4:4:4
+        ApplyYCbCrLUTBlocks<1, 1>(yccLUT, setup, w, h, shiftX, shiftY, 0, cw, 0, ch, y, cb, cr);
+    else
+        ApplyYCbCrLUTBlocks<0, 0>(yccLUT, setup, w, h, shiftX, shiftY, 0, cw, 0, ch, y, cb, cr);
+
+    // Partial blocks along the right and bottom edges
+    const int cwAll = (w + (1 << shiftX) - 1) >> shiftX;
+    const int chAll = (h + (1 << shiftY) - 1) >> shiftY;
+
+    ApplyYCbCrLUTBlocks<0, 0>(yccLUT, setup, w, h, shiftX, shiftY, cw, cwAll, 0, ch,    y, cb, cr);
+    ApplyYCbCrLUTBlocks<0, 0>(yccLUT, setup, w, h, shiftX, shiftY, 0,  cwAll, ch, chAll, y, cb, cr);
+}
+
+// --- Shaped LUT support -----------------------------------------------------
+
+void CBLut::CreateShaperLUT(ShaperLUT* shaper, float power)
+{
+    constexpr float scale = float((kShapedLUTSize - 1) << kShaperFBits);
+
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t coord = uint16_t(powf(i / 255.0f, power) * scale + 0.5f);
+
+        shaper->c[0][i] = coord;
+        shaper->c[1][i] = coord;
+        shaper->c[2][i] = coord;
+    }
+}
+
+Vec3f CBLut::FromShaped(Vec3f t, float power)
+{
+    return pow(t, kGamma / power);
+}
+
+void CBLut::ApplyShapedLUT(const ShaperLUT& shaper, const RGBA32 rgbLUT[kShapedLUTSize][kShapedLUTSize][kShapedLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    constexpr int fMask = (1 << kShaperFBits) - 1;
+    constexpr int fOne  = 1 << kShaperFBits;
+    constexpr int iMax  = kShapedLUTSize - 2;   // last cell
+
+    for (int i = 0; i < n; i++)
+    {
+        const uint8_t* ci = dataIn[i].c;
+        int i0[3], f[3];
+
+        for (int j = 0; j < 3; j++)
+        {
+            int coord = shaper.c[j][ci[j]];
+
+            i0[j] = coord >> kShaperFBits;
+            f [j] = coord & fMask;
+
+            if (i0[j] > iMax)
+            {
+                i0[j] = iMax;
+                f [j] = fOne;
+            }
+        }
+
+        const RGBA32* c000 = &rgbLUT[i0[2]    ][i0[1]    ][i0[0]];
+        const RGBA32* c010 = &rgbLUT[i0[2]    ][i0[1] + 1][i0[0]];
+        const RGBA32* c100 = &rgbLUT[i0[2] + 1][i0[1]    ][i0[0]];
+        const RGBA32* c110 = &rgbLUT[i0[2] + 1][i0[1] + 1][i0[0]];
+
+        for (int j = 0; j < 3; j++)
+        {
+            // lerp in x, then y (kShaperFBits extra precision each), then z
+            int a00 = (c000[0].c[j] << kShaperFBits) + (c000[1].c[j] - c000[0].c[j]) * f[0];
+            int a01 = (c010[0].c[j] << kShaperFBits) + (c010[1].c[j] - c010[0].c[j]) * f[0];
+            int a10 = (c100[0].c[j] << kShaperFBits) + (c100[1].c[j] - c100[0].c[j]) * f[0];
+            int a11 = (c110[0].c[j] << kShaperFBits) + (c110[1].c[j] - c110[0].c[j]) * f[0];
+
+            int b0 = ((a00 << kShaperFBits) + (a01 - a00) * f[1]) >> kShaperFBits;
+            int b1 = ((a10 << kShaperFBits) + (a11 - a10) * f[1]) >> kShaperFBits;
+
+            int c = (b0 << kShaperFBits) + (b1 - b0) * f[2];
+
+            dataOut[i].c[j] = (c + (1 << (2 * kShaperFBits - 1))) >> (2 * kShaperFBits);
+        }
+
+        dataOut[i].c[3] = 255;
+    }
+}
+
+// --- Fixed-point support -----------------------------------------------------
+
+namespace
+{
+    constexpr int kFixedOne = 1 << kFixedLinearBits;
+
+    // Gamma decode/encode tables. These are the only place floating point is
+    // used, and could be baked into ROM for FPU-less targets.
+    struct cFixedGammaTables
+    {
+        uint16_t decode[256];           // gamma-encoded 8-bit -> linear Q14
+        uint8_t  encode[kFixedOne + 1]; // linear Q14 -> gamma-encoded 8-bit
+
+        cFixedGammaTables()
+        {
+            for (int i = 0; i < 256; i++)
+                decode[i] = uint16_t(powf(i / 255.0f, kGamma) * kFixedOne + 0.5f);
+
+            for (int i = 0; i <= kFixedOne; i++)
+                encode[i] = ToU8(powf(i / float(kFixedOne), 1.0f / kGamma));
+        }
+    };
+
+    const cFixedGammaTables kFixedGamma;
+
+    inline int16_t SaturateLinear(int32_t c)
+    {
+        return c < 0 ? 0 : c > kFixedOne ? kFixedOne : int16_t(c);
+    }
+
+    // Transform 'n' pixels held as planar Q14 r/g/b, in place
+    inline void TransformFixed(const FixedXform& xform, int n, int16_t r[], int16_t g[], int16_t b[])
+    {
+        const int32_t round = 1 << (xform.shift - 1);
+
+        for (int i = 0; i < n; i++)
+        {
+            int32_t ri = r[i], gi = g[i], bi = b[i];
+
+            r[i] = SaturateLinear((xform.m[0][0] * ri + xform.m[0][1] * gi + xform.m[0][2] * bi + round) >> xform.shift);
+            g[i] = SaturateLinear((xform.m[1][0] * ri + xform.m[1][1] * gi + xform.m[1][2] * bi + round) >> xform.shift);
+            b[i] = SaturateLinear((xform.m[2][0] * ri + xform.m[2][1] * gi + xform.m[2][2] * bi + round) >> xform.shift);
+        }
+    }
+
+    // Linear ops are fully captured by their action on the RGB basis vectors
+    FixedXform FixedFromLinear(Vec3f (*op)(Vec3f, tLMS, float), tLMS lmsType, float strength)
+    {
+        Vec3f c0 = op({ 1, 0, 0 }, lmsType, strength);
+        Vec3f c1 = op({ 0, 1, 0 }, lmsType, strength);
+        Vec3f c2 = op({ 0, 0, 1 }, lmsType, strength);
+
+        return ToFixedXform({ { c0.x, c1.x, c2.x }, { c0.y, c1.y, c2.y }, { c0.z, c1.z, c2.z } });
+    }
+}
+
+FixedXform CBLut::ToFixedXform(const Mat3f& m)
+{
+    const float* mf = &m.x.x;
+    float maxCoeff = 0.0f;
+
+    for (int i = 0; i < 9; i++)
+        maxCoeff = fmaxf(maxCoeff, fabsf(mf[i]));
+
+    FixedXform result;
+    result.shift = kFixedMatrixBits;
+
+    while (result.shift > 1 && maxCoeff * (1 << result.shift) > 32767.0f)
+        result.shift--;
+
+    for (int i = 0; i < 9; i++)
+        result.m[i / 3][i % 3] = int16_t(lrintf(mf[i] * (1 << result.shift)));
+
+    return result;
+}
+
+FixedXform CBLut::FixedSimulate(tLMS lmsType, float strength)
+{
+    return FixedFromLinear(Simulate, lmsType, strength);
+}
+
+FixedXform CBLut::FixedDaltonise(tLMS lmsType, float strength)
+{
+    return FixedFromLinear(Daltonise, lmsType, strength);
+}
+
+FixedXform CBLut::FixedCorrect(tLMS lmsType, float strength)
+{
+    return FixedFromLinear(Correct, lmsType, strength);
+}
+
+void CBLut::ApplyFixed(const FixedXform& xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    ApplyFixed(&xform, 1, n, dataIn, dataOut);
+}
+
+void CBLut::ApplyFixed(const FixedXform xforms[], int numXforms, int n, const RGBA32 dataIn[], RGBA32 dataOut[])
+{
+    // Work in blocks converted to planar form, so the matrix step vectorises
+    constexpr int kBlockSize = 64;
+    int16_t r[kBlockSize], g[kBlockSize], b[kBlockSize];
+
+    for (int i = 0; i < n; i += kBlockSize)
+    {
+        int blockSize = n - i < kBlockSize ? n - i : kBlockSize;
+
+        for (int j = 0; j < blockSize; j++)
+        {
+            const uint8_t* ci = dataIn[i + j].c;
+
+            r[j] = kFixedGamma.decode[ci[0]];
+            g[j] = kFixedGamma.decode[ci[1]];
+            b[j] = kFixedGamma.decode[ci[2]];
+        }
+
+        for (int k = 0; k < numXforms; k++)
+            TransformFixed(xforms[k], blockSize, r, g, b);
+
+        for (int j = 0; j < blockSize; j++)
+        {
+            uint8_t* co = dataOut[i + j].c;
+
+            co[0] = kFixedGamma.encode[r[j]];
+            co[1] = kFixedGamma.encode[g[j]];
+            co[2] = kFixedGamma.encode[b[j]];
+            co[3] = 255;
+        }
+    }
+}
+
 // --- Mono LUT support --------------------------------------------------------
 
 void CBLut::ApplyMonoLUT(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel)
@@ -37,6 +37,12 @@ namespace CBLut
     Vec3f Daltonise(Vec3f rgb, tLMS lmsType, float strength = 1.0f); ///< "Daltonise" 'rgb' to enhance it for the given type of colour blindness, using Fidaner et al.
     Vec3f Correct  (Vec3f rgb, tLMS lmsType, float strength = 1.0f); ///< Correct image for given type of colour blindness using a mixture of amplification and hue shifting.
 
+    // Versions of the above specialised on colour blindness type, for inner
+    // loops. If kFullStrength is set, 'strength' is ignored and taken to be 1.
+    template<tLMS kType, bool kFullStrength = false> Vec3f Simulate (Vec3f rgb, float strength = 1.0f);
+    template<tLMS kType, bool kFullStrength = false> Vec3f Daltonise(Vec3f rgb, float strength = 1.0f);
+    template<tLMS kType, bool kFullStrength = false> Vec3f Correct  (Vec3f rgb, float strength = 1.0f);
+
 
     // Simple 32-bit RGBA handling
     struct RGBA32
@@ -58,8 +64,110 @@ namespace CBLut
     constexpr int kLUTSize = 1 << kLUTBits;
 
     void CreateIdentityLUT(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize]);    // Create identity
-    void ApplyLUT      (RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image 
-    void ApplyLUTNoLerp(RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image, using point sampling
+    void ApplyLUT      (const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image 
+    void ApplyLUTNoLerp(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply lut to the given image, using point sampling
+    void ApplyLUTs     (const RGBA32 (* const rgbLUTs[])[kLUTSize][kLUTSize], int numLUTs, int n, const RGBA32 dataIn[], RGBA32* const dataOut[]); ///< Apply each of numLUTs luts to the given image, writing to the corresponding dataOut, in one pass
+
+    // Alternative LUT entry formats
+    struct RGB565  { uint16_t u16; };   ///< 5:6:5 packed, half the footprint of RGBA32, so e.g. a 64^3 LUT fits in 512KB of L2
+    struct RGB10A2 { uint32_t u32; };   ///< 10:10:10:2 packed, same footprint as RGBA32 but with higher-precision output
+    struct RGB16   { uint16_t c[3]; };  ///< 16 bits per channel, for chaining LUTs without intermediate 8-bit quantisation
+
+    RGB565  ToRGB565u (Vec3f c);        ///< Variants of ToRGBA32u for LUT construction
+    RGB10A2 ToRGB10A2u(Vec3f c);
+    RGB16   ToRGB16u  (Vec3f c);
+
+    RGB16   ToRGB16   (RGBA32 c);       ///< Expand 8-bit pixel to the RGB16 LUT input domain
+    RGBA32  ToRGBA32  (RGB16 c);        ///< Truncate RGB16 pixel back to 8 bits
+
+    void ApplyLUT(const RGB565  rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);
+    void ApplyLUT(const RGB10A2 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);
+    void ApplyLUT(const RGB16   rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);
+    void ApplyLUT(const RGB16   rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGB16  dataOut[]); ///< First stage of a chain
+    void ApplyLUT(const RGB16   rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGB16  dataIn[], RGB16  dataOut[]); ///< Intermediate stage of a chain
+    void ApplyLUT(const RGB16   rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGB16  dataIn[], RGBA32 dataOut[]); ///< Final stage of a chain
+
+    // Alternative LUT memory layouts. The standard layout is blue-major, so the
+    // entries for a lookup are up to kLUTSize^2 apart.
+    enum tLUTLayout
+    {
+        kLayoutLinear,      ///< rgbLUT[b][g][r], as above
+        kLayoutMorton,      ///< Z-order, with the r, g, b index bits interleaved, so neighbouring entries are mostly close in memory
+        kLayoutBricked,     ///< The 8 corners of each cell stored contiguously, so a trilinear lookup touches a single cache line
+    };
+
+    constexpr int kLUTEntries = kLUTSize * kLUTSize * kLUTSize;
+    constexpr int kLUTCells   = (kLUTSize - 1) * (kLUTSize - 1) * (kLUTSize - 1);
+
+    void ConvertLUTToMorton (const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], RGBA32 mortonLUT[kLUTEntries]);
+    void ConvertLUTToBricked(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], RGBA32 brickLUT[kLUTCells][8]);
+
+    void ApplyLUTMorton   (const RGBA32 mortonLUT[kLUTEntries], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);                 ///< Equivalent to ApplyLUT, for a Morton-order LUT
+    void ApplyLUTTrilinear(const RGBA32 rgbLUT[kLUTSize][kLUTSize][kLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);  ///< Apply lut using full trilinear interpolation
+    void ApplyLUTBricked  (const RGBA32 brickLUT[kLUTCells][8], int n, const RGBA32 dataIn[], RGBA32 dataOut[]);                ///< Equivalent to ApplyLUTTrilinear, for a bricked LUT
+
+    // YCbCr-indexed LUTs. These have the standard layout, but are indexed by
+    // full-range (JFIF) Y, Cb, Cr rather than R, G, B, so samples from a JPEG
+    // decoder can be looked up directly, skipping YCbCr->RGB conversion.
+    // Every output channel depends on all three inputs, so lookups are
+    // trilinear. YCbCr values outside the RGB gamut are clamped to it first.
+    Vec3f FromYCbCru(RGBA32 ycc);   ///< Convert YCbCr in channels 0-2 to linear RGB, as for FromRGBA32u, for LUT construction
+
+    void ApplyYCbCrLUT(const RGBA32 yccLUT[kLUTSize][kLUTSize][kLUTSize], int n, const uint8_t y[], const uint8_t cb[], const uint8_t cr[], RGBA32 dataOut[]); ///< Apply lut to planar YCbCr samples
+
+    // For video, LUTs can also produce YCbCr, so planar frames can be
+    // transformed without conversion to RGB. Video is usually limited range,
+    // with Y in 16-235 and Cb/Cr in 16-240, so there are variants for that.
+    RGBA32 ToYCbCru          (Vec3f c);         ///< Convert linear RGB to full-range YCbCr in channels 0-2, the inverse of FromYCbCru
+    RGBA32 ToYCbCrLimitedu   (Vec3f c);         ///< As ToYCbCru, but producing limited-range YCbCr
+    Vec3f  FromYCbCrLimitedu (RGBA32 ycc);      ///< As FromYCbCru, but for limited-range YCbCr
+
+    void ApplyYCbCrLUTPlanar(const RGBA32 yccLUT[kLUTSize][kLUTSize][kLUTSize], int w, int h, int shiftX, int shiftY, uint8_t y[], uint8_t cb[], uint8_t cr[]); ///< Apply YCbCr -> YCbCr lut in place to w x h planes, with chroma subsampled by 1 << shiftX/Y. Each chroma sample is set to the average over its luma samples
+
+    // Shaped LUT support. A per-channel 1D shaper LUT maps input to cube
+    // coordinates, followed by a trilinear lookup into a smaller cube whose
+    // samples include both endpoints. The cube's output is gamma-encoded, so
+    // shaping all the way to linear light (power = 2.2) just moves the
+    // curvature to the output side -- measured with -b, the gamma-space
+    // default gives lower error for all ops, and at 16^3 beats the 32^3 LUT.
+    constexpr int   kShapedLUTBits = 4;         // 16 x 16 x 16, 16KB, fits in L1
+    constexpr int   kShapedLUTSize = 1 << kShapedLUTBits;
+    constexpr int   kShaperFBits   = 8;         // fractional bits of shaper output
+    constexpr float kShaperPower   = 1.0f;      // default shaper curve, see CreateShaperLUT
+
+    struct ShaperLUT { uint16_t c[3][256]; };   ///< Per channel, maps 8-bit input to a cube coordinate with kShaperFBits of fraction
+
+    void  CreateShaperLUT(ShaperLUT* shaper, float power = kShaperPower);   ///< Create shaper with coord = (c / 255)^power * (kShapedLUTSize - 1)
+    Vec3f FromShaped(Vec3f t, float power = kShaperPower);                  ///< Convert shaped-domain 0-1 coordinates to linear RGB, for cube construction
+
+    void ApplyShapedLUT(const ShaperLUT& shaper, const RGBA32 rgbLUT[kShapedLUTSize][kShapedLUTSize][kShapedLUTSize], int n, const RGBA32 dataIn[], RGBA32 dataOut[]); ///< Apply shaper + trilinear cube lookup to the given image
+
+    // Fixed-point support: an integer-only alternative to the float path, for
+    // targets with slow FPUs. For a given type and strength, Simulate,
+    // Daltonise and Correct are all linear in linear RGB, so each fuses to a
+    // single 3x3 matrix. This is applied between table-driven gamma decode and
+    // encode, with saturation, using only 16-bit inputs and 32-bit
+    // accumulators, so it maps onto 16-bit SIMD lanes (e.g. pmaddwd).
+    // Measured over all 24-bit colours against the float functions, the mean
+    // error is around 0.01, and the maximum error 5, in the darkest values,
+    // where Q14 linear light can't fully resolve 8-bit gamma steps. See -b.
+    constexpr int kFixedLinearBits = 14;    ///< Linear values are unsigned Q14, so 0-16384
+    constexpr int kFixedMatrixBits = 12;    ///< Maximum precision of matrix coefficients
+
+    struct FixedXform
+    {
+        int16_t m[3][3];    ///< Fused linear RGB transform
+        int     shift;      ///< Fractional bits in m, reduced from kFixedMatrixBits if necessary to fit large coefficients
+    };
+
+    FixedXform ToFixedXform(const Mat3f& m);    ///< Convert linear-RGB float matrix
+
+    FixedXform FixedSimulate (tLMS lmsType, float strength = 1.0f);     ///< Fixed-point version of Simulate
+    FixedXform FixedDaltonise(tLMS lmsType, float strength = 1.0f);     ///< Fixed-point version of Daltonise
+    FixedXform FixedCorrect  (tLMS lmsType, float strength = 1.0f);     ///< Fixed-point version of Correct
+
+    void ApplyFixed(const FixedXform& xform, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);  ///< Apply fixed-point transform to the given image
+    void ApplyFixed(const FixedXform xforms[], int numXforms, int n, const RGBA32 dataIn[], RGBA32 dataOut[]);   ///< Apply sequence of transforms, clamping to 0-1 between each, e.g., correct then simulate
 
     // Mono LUT support
     void ApplyMonoLUT(const RGBA32 monoLUT[256], int n, const RGBA32 dataIn[], RGBA32 dataOut[], int channel = -1);
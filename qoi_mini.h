@@ -0,0 +1,502 @@
+//
+//  File:       qoi_mini.h
+//
+//  Function:   Reader and writer for QOI ("Quite OK Image") files, a simple
+//              lossless format that encodes and decodes much faster than PNG.
+//              See https://qoiformat.org/qoi-specification.pdf
+//
+//  Copyright:  Andrew Willmott 2018
+//
+//  Like stb_image_mini.h, this includes the implementation, unless
+//  QOI_DECLARATION is defined. Returned buffers are allocated with QOI_MALLOC,
+//  which defaults to malloc, and so can be freed with QOI_FREE. As with
+//  STBI_MALLOC, define both to supply your own allocator.
+//
+
+#ifndef QOI_MINI_H
+#define QOI_MINI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// returns 1 if data starts with a QOI header, and if so, fills in the image's
+// dimensions and number of channels (3 or 4). Any of w/h/comp may be 0.
+extern int qoi_info_from_memory(const unsigned char *data, int len, int *w, int *h, int *comp);
+
+// decode the given QOI data to 8-bit pixels with req_comp channels, 3 or 4, or
+// the file's own channel count if req_comp is 0. *comp is set to the latter.
+// Returns 0 on failure.
+extern unsigned char *qoi_load_from_memory(const unsigned char *data, int len, int *w, int *h, int *comp, int req_comp);
+
+// encode the given 3 or 4 channel pixels, returning the file data. Returns 0 on failure.
+extern unsigned char *qoi_write_to_mem(const unsigned char *pixels, int w, int h, int comp, int *out_len);
+
+// as above, but writes to the given file. Returns 1 on success.
+extern int qoi_write(const char *filename, int w, int h, int comp, const void *data);
+
+// Streaming versions, which read or write a band of rows at a time, so memory
+// use depends on the band size rather than the image size. qoi_read_rows
+// returns the number of rows read, and qoi_write_end returns 1 if the file was
+// written successfully, and all h rows were supplied.
+typedef struct qoi_reader qoi_reader;
+typedef struct qoi_writer qoi_writer;
+
+extern qoi_reader *qoi_read_begin(const char *filename, int *w, int *h, int *comp);
+extern int         qoi_read_rows (qoi_reader *reader, unsigned char *pixels, int count, int req_comp);
+extern void        qoi_read_end  (qoi_reader *reader);
+
+extern qoi_writer *qoi_write_begin(const char *filename, int w, int h, int comp);
+extern int         qoi_write_rows (qoi_writer *writer, const void *pixels, int count);
+extern int         qoi_write_end  (qoi_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
+#ifndef QOI_DECLARATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(QOI_MALLOC) != defined(QOI_FREE)
+#error "Must define both or none of QOI_MALLOC and QOI_FREE."
+#endif
+
+#ifndef QOI_MALLOC
+#define QOI_MALLOC(sz) malloc(sz)
+#define QOI_FREE(p)    free(p)
+#endif
+
+#define QOI__OP_INDEX  0x00
+#define QOI__OP_DIFF   0x40
+#define QOI__OP_LUMA   0x80
+#define QOI__OP_RUN    0xc0
+#define QOI__OP_RGB    0xfe
+#define QOI__OP_RGBA   0xff
+#define QOI__MASK_2    0xc0
+
+#define QOI__HEADER_SIZE  14
+#define QOI__PADDING_SIZE 8
+
+// keep w*h*4 plus worst-case encoding overhead well within an int
+#define QOI__MAX_PIXELS   400000000
+
+#define qoi__hash(p) (((p)[0]*3 + (p)[1]*5 + (p)[2]*7 + (p)[3]*11) & 63)
+
+static unsigned int qoi__read32(const unsigned char *p)
+{
+   return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+}
+
+static unsigned char *qoi__write32(unsigned char *p, unsigned int v)
+{
+   p[0] = (unsigned char) (v >> 24);
+   p[1] = (unsigned char) (v >> 16);
+   p[2] = (unsigned char) (v >> 8);
+   p[3] = (unsigned char) v;
+   return p + 4;
+}
+
+int qoi_info_from_memory(const unsigned char *data, int len, int *w, int *h, int *comp)
+{
+   unsigned int x, y;
+   if (len < QOI__HEADER_SIZE || memcmp(data, "qoif", 4) != 0)
+      return 0;
+   x = qoi__read32(data + 4);
+   y = qoi__read32(data + 8);
+   if (x == 0 || y == 0 || x > 0x7fffffff || y > 0x7fffffff || (data[12] != 3 && data[12] != 4) || data[13] > 1)
+      return 0;
+   if (w) *w = (int) x;
+   if (h) *h = (int) y;
+   if (comp) *comp = data[12];
+   return 1;
+}
+
+// Codec state carried from one run of pixels to the next
+typedef struct
+{
+   unsigned char index[64][4];
+   unsigned char px[4];
+   int run;
+} qoi__state;
+
+static void qoi__init(qoi__state *s)
+{
+   memset(s->index, 0, sizeof(s->index));
+   s->px[0] = s->px[1] = s->px[2] = 0;
+   s->px[3] = 255;
+   s->run = 0;
+}
+
+// Decode pixels into [o, o_end) from the ops at *pp. If 'more' is set, further
+// data may follow 'end', so this stops early rather than start an op that may
+// be incomplete. Otherwise running out of data just repeats the last pixel.
+// Returns where output stopped.
+static unsigned char *qoi__decode(qoi__state *s, const unsigned char **pp, const unsigned char *end, int more, unsigned char *o, unsigned char *o_end, int req_comp)
+{
+   const unsigned char *p = *pp;
+   unsigned char *px = s->px;
+
+   for (; o < o_end; o += req_comp) {
+      if (s->run > 0)
+         s->run--;
+      else if (more && end - p < 5)
+         break;
+      else if (p < end) {
+         int b1 = *p++;
+
+         if (b1 == QOI__OP_RGB) {
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+            p += 3;
+         } else if (b1 == QOI__OP_RGBA) {
+            px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; px[3] = p[3];
+            p += 4;
+         } else if ((b1 & QOI__MASK_2) == QOI__OP_INDEX) {
+            memcpy(px, s->index[b1], 4);
+         } else if ((b1 & QOI__MASK_2) == QOI__OP_DIFF) {
+            px[0] += ((b1 >> 4) & 3) - 2;
+            px[1] += ((b1 >> 2) & 3) - 2;
+            px[2] += ( b1       & 3) - 2;
+         } else if ((b1 & QOI__MASK_2) == QOI__OP_LUMA) {
+            int b2 = *p++;
+            int vg = (b1 & 0x3f) - 32;
+            px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 +  (b2       & 0x0f);
+         } else // QOI__OP_RUN
+            s->run = b1 & 0x3f;
+
+         memcpy(s->index[qoi__hash(px)], px, 4);
+      }
+      // a truncated file just repeats the last pixel
+
+      o[0] = px[0];
+      o[1] = px[1];
+      o[2] = px[2];
+      if (req_comp == 4)
+         o[3] = px[3];
+   }
+
+   *pp = p;
+   return o;
+}
+
+unsigned char *qoi_load_from_memory(const unsigned char *data, int len, int *w, int *h, int *comp, int req_comp)
+{
+   qoi__state s;
+   const unsigned char *p;
+   unsigned char *out;
+   int x, y, n;
+
+   if (!qoi_info_from_memory(data, len, &x, &y, &n))
+      return 0;
+   if ((double) x * y > QOI__MAX_PIXELS)
+      return 0;
+   if (req_comp == 0)
+      req_comp = n;
+   if (req_comp != 3 && req_comp != 4)
+      return 0;
+
+   out = (unsigned char *) QOI_MALLOC((size_t) x * y * req_comp);
+   if (!out)
+      return 0;
+
+   qoi__init(&s);
+   p = data + QOI__HEADER_SIZE;
+   qoi__decode(&s, &p, data + len - QOI__PADDING_SIZE, 0, out, out + (size_t) x * y * req_comp, req_comp);
+
+   *w = x;
+   *h = y;
+   if (comp) *comp = n;
+   return out;
+}
+
+// Encode the pixels in [p, p_end) to o, returning the new end of the output.
+// If 'last' is set, these are the final pixels, so any pending run is written.
+static unsigned char *qoi__encode(qoi__state *s, const unsigned char *p, const unsigned char *p_end, int comp, int last, unsigned char *o)
+{
+   unsigned char *px_prev = s->px;
+   unsigned char px[4];
+
+   px[3] = px_prev[3];
+
+   for (; p < p_end; p += comp) {
+      px[0] = p[0];
+      px[1] = p[1];
+      px[2] = p[2];
+      if (comp == 4)
+         px[3] = p[3];
+
+      if (memcmp(px, px_prev, 4) == 0) {
+         s->run++;
+         if (s->run == 62 || (last && p + comp == p_end)) {
+            *o++ = (unsigned char) (QOI__OP_RUN | (s->run - 1));
+            s->run = 0;
+         }
+         continue;
+      }
+
+      if (s->run > 0) {
+         *o++ = (unsigned char) (QOI__OP_RUN | (s->run - 1));
+         s->run = 0;
+      }
+
+      {
+         int i = qoi__hash(px);
+
+         if (memcmp(s->index[i], px, 4) == 0)
+            *o++ = (unsigned char) (QOI__OP_INDEX | i);
+         else {
+            memcpy(s->index[i], px, 4);
+
+            if (px[3] == px_prev[3]) {
+               signed char vr = (signed char) (px[0] - px_prev[0]);
+               signed char vg = (signed char) (px[1] - px_prev[1]);
+               signed char vb = (signed char) (px[2] - px_prev[2]);
+               signed char vg_r = (signed char) (vr - vg);
+               signed char vg_b = (signed char) (vb - vg);
+
+               if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                  *o++ = (unsigned char) (QOI__OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+               else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                  *o++ = (unsigned char) (QOI__OP_LUMA | (vg + 32));
+                  *o++ = (unsigned char) ((vg_r + 8) << 4 | (vg_b + 8));
+               } else {
+                  *o++ = QOI__OP_RGB;
+                  *o++ = px[0];
+                  *o++ = px[1];
+                  *o++ = px[2];
+               }
+            } else {
+               *o++ = QOI__OP_RGBA;
+               memcpy(o, px, 4);
+               o += 4;
+            }
+         }
+      }
+
+      memcpy(px_prev, px, 4);
+   }
+
+   return o;
+}
+
+static unsigned char *qoi__write_header(unsigned char *o, int w, int h, int comp)
+{
+   memcpy(o, "qoif", 4);
+   o = qoi__write32(o + 4, (unsigned int) w);
+   o = qoi__write32(o, (unsigned int) h);
+   *o++ = (unsigned char) comp;
+   *o++ = 0; // sRGB with linear alpha
+   return o;
+}
+
+static const unsigned char qoi__padding[QOI__PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+unsigned char *qoi_write_to_mem(const unsigned char *pixels, int w, int h, int comp, int *out_len)
+{
+   qoi__state s;
+   unsigned char *out, *o;
+
+   if (w <= 0 || h <= 0 || (comp != 3 && comp != 4) || (double) w * h > QOI__MAX_PIXELS)
+      return 0;
+
+   // worst case is every pixel as QOI__OP_RGBA
+   out = (unsigned char *) QOI_MALLOC(QOI__HEADER_SIZE + (size_t) w * h * (comp + 1) + QOI__PADDING_SIZE);
+   if (!out)
+      return 0;
+
+   qoi__init(&s);
+   o = qoi__write_header(out, w, h, comp);
+   o = qoi__encode(&s, pixels, pixels + (size_t) w * h * comp, comp, 1, o);
+
+   memcpy(o, qoi__padding, QOI__PADDING_SIZE);
+   o += QOI__PADDING_SIZE;
+
+   *out_len = (int) (o - out);
+   return out;
+}
+
+int qoi_write(const char *filename, int w, int h, int comp, const void *data)
+{
+   FILE *f;
+   int len, ok;
+   unsigned char *qoi = qoi_write_to_mem((const unsigned char *) data, w, h, comp, &len);
+   if (!qoi) return 0;
+   f = fopen(filename, "wb");
+   if (!f) { QOI_FREE(qoi); return 0; }
+   ok = fwrite(qoi, 1, len, f) == (size_t) len;
+   fclose(f);
+   QOI_FREE(qoi);
+   return ok;
+}
+
+#define QOI__READ_BUFFER (1 << 16)
+
+struct qoi_reader
+{
+   FILE *f;
+   qoi__state s;
+   int w, h, comp, rows_read, eof;
+   const unsigned char *p, *end;
+   unsigned char buffer[QOI__READ_BUFFER];
+};
+
+struct qoi_writer
+{
+   FILE *f;
+   qoi__state s;
+   int w, h, comp, rows_written, ok;
+   unsigned char *out;       // encoding buffer, big enough for 'capacity' rows
+   int capacity;
+};
+
+qoi_reader *qoi_read_begin(const char *filename, int *w, int *h, int *comp)
+{
+   unsigned char header[QOI__HEADER_SIZE];
+   qoi_reader *r;
+   FILE *f = fopen(filename, "rb");
+   if (!f)
+      return 0;
+
+   if (fread(header, 1, QOI__HEADER_SIZE, f) != QOI__HEADER_SIZE || !qoi_info_from_memory(header, QOI__HEADER_SIZE, w, h, comp)) {
+      fclose(f);
+      return 0;
+   }
+
+   r = (qoi_reader *) QOI_MALLOC(sizeof(qoi_reader));
+   if (!r) {
+      fclose(f);
+      return 0;
+   }
+
+   r->f = f;
+   qoi__init(&r->s);
+   r->w = *w;
+   r->h = *h;
+   r->comp = comp ? *comp : 0;
+   r->rows_read = 0;
+   r->eof = 0;
+   r->p = r->end = r->buffer;
+   return r;
+}
+
+int qoi_read_rows(qoi_reader *r, unsigned char *pixels, int count, int req_comp)
+{
+   unsigned char *o = pixels, *o_end;
+
+   if (count > r->h - r->rows_read)
+      count = r->h - r->rows_read;
+   if (count <= 0 || (req_comp != 3 && req_comp != 4))
+      return 0;
+
+   o_end = pixels + (size_t) count * r->w * req_comp;
+
+   for (;;) {
+      o = qoi__decode(&r->s, &r->p, r->end, !r->eof, o, o_end, req_comp);
+      if (o == o_end)
+         break;
+
+      // keep any partial op, and top up the buffer
+      {
+         size_t left = r->end - r->p, n;
+         memmove(r->buffer, r->p, left);
+         n = fread(r->buffer + left, 1, QOI__READ_BUFFER - left, r->f);
+         r->p = r->buffer;
+         r->end = r->buffer + left + n;
+         if (n == 0)
+            r->eof = 1;
+      }
+   }
+
+   r->rows_read += count;
+   return count;
+}
+
+void qoi_read_end(qoi_reader *r)
+{
+   if (r) {
+      fclose(r->f);
+      QOI_FREE(r);
+   }
+}
+
+qoi_writer *qoi_write_begin(const char *filename, int w, int h, int comp)
+{
+   unsigned char header[QOI__HEADER_SIZE];
+   qoi_writer *wr;
+
+   if (w <= 0 || h <= 0 || (comp != 3 && comp != 4) || w > 0x7fffffff / (comp + 1))
+      return 0;
+
+   wr = (qoi_writer *) QOI_MALLOC(sizeof(qoi_writer));
+   if (!wr)
+      return 0;
+
+   wr->f = fopen(filename, "wb");
+   if (!wr->f) {
+      QOI_FREE(wr);
+      return 0;
+   }
+
+   qoi__init(&wr->s);
+   wr->w = w;
+   wr->h = h;
+   wr->comp = comp;
+   wr->rows_written = 0;
+   wr->out = 0;
+   wr->capacity = 0;
+
+   qoi__write_header(header, w, h, comp);
+   wr->ok = fwrite(header, 1, QOI__HEADER_SIZE, wr->f) == QOI__HEADER_SIZE;
+   return wr;
+}
+
+int qoi_write_rows(qoi_writer *wr, const void *pixels, int count)
+{
+   const unsigned char *p = (const unsigned char *) pixels;
+   unsigned char *o;
+   size_t n;
+
+   if (count > wr->h - wr->rows_written)
+      count = wr->h - wr->rows_written;
+   if (!wr->ok || count <= 0)
+      return wr->ok;
+
+   if (count > wr->capacity) {
+      QOI_FREE(wr->out);
+      wr->out = (unsigned char *) QOI_MALLOC((size_t) count * wr->w * (wr->comp + 1));
+      wr->capacity = count;
+      if (!wr->out)
+         return wr->ok = 0;
+   }
+
+   n = (size_t) count * wr->w * wr->comp;
+   wr->rows_written += count;
+   o = qoi__encode(&wr->s, p, p + n, wr->comp, wr->rows_written == wr->h, wr->out);
+
+   if (fwrite(wr->out, 1, o - wr->out, wr->f) != (size_t) (o - wr->out))
+      wr->ok = 0;
+
+   return wr->ok;
+}
+
+int qoi_write_end(qoi_writer *wr)
+{
+   int ok;
+   if (!wr)
+      return 0;
+
+   ok = wr->ok && wr->rows_written == wr->h && fwrite(qoi__padding, 1, QOI__PADDING_SIZE, wr->f) == QOI__PADDING_SIZE;
+   ok = fclose(wr->f) == 0 && ok;
+   QOI_FREE(wr->out);
+   QOI_FREE(wr);
+   return ok;
+}
+
+#endif // QOI_DECLARATION
@@ -9,6 +9,14 @@
 // - unused functions
 // - doc comments
 // + STB_IMAGE_DECLARATION if you only want the declarations
+// + SSE2 jpeg kernels restored from upstream (STBI_NO_SIMD to disable)
+// + AVX2 YCbCr->RGB and 2x2 upsample, chosen at runtime (STBI_NO_AVX2 to disable)
+// + jpeg scanline hooks and parallel decode (stbi_set_jpeg_*)
+// + jpeg decoding at 1/2, 1/4, 1/8 size via reduced IDCTs (stbi_set_jpeg_scale_denom)
+// + png compression level and parallel chunked deflate (stbi_set_write_png_parallel)
+// + png fixed filter, rle-only and stored presets (stbi_write_force_png_filter etc.)
+// + paletted png load and store without expansion (stbi_*_png_indexed*)
+// + png decoding and encoding in bands of rows (stbi_load_png_bands, stbi_write_png_begin etc.)
 //
 // stb_image - v2.19 - public domain image loader - http://nothings.org/stb/stb_image.h
 //                                  no warranty implied; use at your own risk
@@ -90,6 +98,47 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// jpeg decode hooks, called as each output scanline is produced, so a
+// caller can process pixels while they're still in cache. The ycbcr hook
+// replaces the built-in YCbCr->RGB conversion (out has 'step' bytes per
+// pixel); the row hook sees every finished scanline, whatever the source
+// colour space. Pass 0 to remove. Like stbi_set_jpeg_scale_denom, these apply
+// to decodes on the calling thread only, but with stbi_set_jpeg_parallel, they
+// may be called concurrently for different rows, from other threads.
+typedef void stbi_jpeg_ycbcr_callback(void *user, stbi_uc *out, const stbi_uc *y, const stbi_uc *cb, const stbi_uc *cr, int count, int step);
+typedef void stbi_jpeg_row_callback  (void *user, stbi_uc *row, int y, int count, int comp);
+
+STBIDEF void stbi_set_jpeg_ycbcr_callback(stbi_jpeg_ycbcr_callback *fn, void *user);
+STBIDEF void stbi_set_jpeg_row_callback  (stbi_jpeg_row_callback   *fn, void *user);
+
+// parallel jpeg decoding. If set, baseline jpegs loaded from memory that have
+// restart markers are split at them, and the intervals decoded concurrently
+// via fn, which must call task(task_data, i) for each i in [0, count) and
+// only return once all have completed. Other jpegs are entropy decoded
+// serially. Upsampling and colour conversion are done in parallel for all.
+typedef void stbi_parallel_for_callback(void *user, void (*task)(void *task_data, int index), void *task_data, int count);
+
+STBIDEF void stbi_set_jpeg_parallel(stbi_parallel_for_callback *fn, void *user);
+
+// decode jpegs at 1/denom of their size, where denom is 1, 2, 4 or 8, by
+// running a reduced IDCT on just the low-frequency coefficients of each block.
+// Output dimensions are rounded up. stbi_info still reports the full size.
+// Other formats are unaffected. This applies to the calling thread only.
+STBIDEF void stbi_set_jpeg_scale_denom(int denom);
+
+// load a paletted png without expanding it, returning one palette index per
+// pixel, and filling in the RGBA palette and its length. Returns 0 if the png
+// isn't paletted, as well as on failure.
+STBIDEF stbi_uc *stbi_load_png_indexed_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_uc palette[256*4], int *palette_len);
+
+// decode a png from f in bands of up to band_rows RGBA rows, calling fn with
+// each, so memory use depends on the band size rather than the image size.
+// fn returns 0 to stop decoding. Returns 0 on failure, or if the png isn't one
+// this handles (e.g., interlaced), in which case fn won't have been called.
+typedef int stbi_band_callback(void *user, stbi_uc *rows, int y, int count);
+
+STBIDEF int stbi_load_png_bands(FILE *f, int band_rows, stbi_band_callback *fn, void *user);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -108,6 +157,41 @@ STBIDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const v
 
 STBIDEF stbi_uc *stbi_write_png_to_mem(stbi_uc *pixels, int stride_bytes, int x, int y, int n, int *out_len);
 
+// png compression level, i.e., how hard the deflater searches for matches.
+// 1 is fastest, default is 8, and larger values give smaller files more slowly.
+// 0 stores the data uncompressed.
+STBIDEF int stbi_write_png_compression_level;
+
+// if set, the deflater only looks for runs of repeated bytes, like zlib's
+// Z_RLE. This is much faster than searching for matches, but larger.
+STBIDEF int stbi_write_png_rle;
+
+// filter to use for every png row, 0-4 (none, sub, up, average, paeth), rather
+// than picking the best for each row, which takes five times as long. The
+// default, -1, picks per row.
+STBIDEF int stbi_write_force_png_filter;
+
+// parallel png writing. If set, rows are filtered in bands, and the filtered
+// data is deflated in 1MB chunks concurrently via fn (see stbi_set_jpeg_parallel),
+// pigz-style: each chunk can match against the 32K before it, and chunks are
+// joined with sync flushes. The output doesn't depend on the thread count.
+STBIDEF void stbi_set_write_png_parallel(stbi_parallel_for_callback *fn, void *user);
+
+// write a paletted png from one palette index per pixel, and an RGBA palette
+// of up to 256 entries. Alpha is only stored if some entry isn't opaque.
+STBIDEF int stbi_write_png_indexed(char const *filename, int w, int h, const stbi_uc *indices, const stbi_uc *palette, int palette_len);
+STBIDEF stbi_uc *stbi_write_png_indexed_to_mem(const stbi_uc *indices, int w, int h, const stbi_uc *palette, int palette_len, int *out_len);
+
+// write a png a band of rows at a time, starting from the top. Each band is
+// filtered and deflated as it arrives, and written as its own IDAT chunk.
+// stbi_write_png_end returns 1 if the file was written successfully, and
+// all h rows were supplied.
+typedef struct stbi_png_writer stbi_png_writer;
+
+STBIDEF stbi_png_writer *stbi_write_png_begin(char const *filename, int w, int h, int comp);
+STBIDEF int stbi_write_png_rows(stbi_png_writer *writer, const void *rows, int count);
+STBIDEF int stbi_write_png_end(stbi_png_writer *writer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -200,11 +284,51 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI__X86_TARGET
 #endif
 
+// SSE2 is part of the x64 baseline, so we only enable it on x86 when the
+// compiler has been told it can assume it. AVX2 kernels are compiled
+// separately and selected at runtime in stbi__setup_jpeg.
+#if !defined(STBI_NO_SIMD) && (defined(STBI__X64_TARGET) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBI_SSE2
+#include <emmintrin.h>
 
+#ifdef _MSC_VER
+#define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
+#else
+#define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
+#endif
 
+#if !defined(STBI_NO_AVX2)
+   #if defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 5)
+   #define STBI_AVX2
+   #define STBI__AVX2_TARGET __attribute__((target("avx2")))
+   #include <immintrin.h>
+   #elif defined(_MSC_VER) && _MSC_VER >= 1800
+   #define STBI_AVX2
+   #define STBI__AVX2_TARGET
+   #include <immintrin.h>
+   #include <intrin.h>
+   #endif
+#endif
 
-// ARM NEON
-
+#ifdef STBI_AVX2
+static int stbi__avx2_available(void)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7)
+      return 0;
+   __cpuid(info, 1);
+   if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) // OSXSAVE, OS saves ymm state
+      return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] & (1 << 5)) != 0;
+#else
+   return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+#endif
 
 #ifndef STBI_SIMD_ALIGN
 #define STBI_SIMD_ALIGN(type, name) type name
@@ -324,8 +448,20 @@ static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
 
 
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// per-thread state, so that images can be loaded on several threads at once
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL thread_local
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL __declspec(thread)
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL __thread
+   #else
+      #define STBI_THREAD_LOCAL
+   #endif
+#endif
+
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -794,6 +930,13 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift;   // log2 of stbi_set_jpeg_scale_denom
+
+// scanline hooks, from the decoding thread's stbi_set_jpeg_*_callback
+   stbi_jpeg_ycbcr_callback *ycbcr_hook;
+   void *ycbcr_hook_user;
+   stbi_jpeg_row_callback *row_hook;
+   void *row_hook_user;
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -1310,6 +1453,244 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced IDCTs for scaled decoding. An NxN output block is the N-point
+// inverse transform of the top-left NxN coefficients, which approximates the
+// 8x8 block box-filtered down to NxN. As in the full idct, the column pass
+// keeps 2 extra bits of precision.
+#define STBI__IDCT_4(s0,s1,s2,s3) \
+   int t0,t1,p0,p1;                                         \
+   t0 = ((s0) + (s2)) * stbi__f2f(0.353553391f);            \
+   t1 = ((s0) - (s2)) * stbi__f2f(0.353553391f);            \
+   p0 = (s1)*stbi__f2f(0.461939766f) + (s3)*stbi__f2f(0.191341716f); \
+   p1 = (s1)*stbi__f2f(0.191341716f) - (s3)*stbi__f2f(0.461939766f); \
+   x0 = t0+p0; x3 = t0-p0;                                  \
+   x1 = t1+p1; x2 = t1-p1;
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,v[16],*w;
+   short *d = data;
+   for (i=0; i < 4; ++i, ++d) {
+      int x0,x1,x2,x3;
+      STBI__IDCT_4(d[0],d[8],d[16],d[24])
+      v[i   ] = (x0+512) >> 10;
+      v[i+ 4] = (x1+512) >> 10;
+      v[i+ 8] = (x2+512) >> 10;
+      v[i+12] = (x3+512) >> 10;
+   }
+   for (i=0, w=v; i < 4; ++i, w+=4, out+=out_stride) {
+      int x0,x1,x2,x3;
+      STBI__IDCT_4(w[0],w[1],w[2],w[3])
+      x0 += (1 << 13) + (128 << 14);
+      x1 += (1 << 13) + (128 << 14);
+      x2 += (1 << 13) + (128 << 14);
+      x3 += (1 << 13) + (128 << 14);
+      out[0] = stbi__clamp(x0 >> 14);
+      out[1] = stbi__clamp(x1 >> 14);
+      out[2] = stbi__clamp(x2 >> 14);
+      out[3] = stbi__clamp(x3 >> 14);
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   // every 2-point factor is 1/sqrt(8), so the whole transform is exact in integers
+   int a = data[0] + data[8], b = data[0] - data[8];
+   int c = data[1] + data[9], d = data[1] - data[9];
+   out[0]            = stbi__clamp(((a + c + 4) >> 3) + 128);
+   out[1]            = stbi__clamp(((a - c + 4) >> 3) + 128);
+   out[out_stride  ] = stbi__clamp(((b + d + 4) >> 3) + 128);
+   out[out_stride+1] = stbi__clamp(((b - d + 4) >> 3) + 128);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   // the DC term is 8x the block average
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
 
 
 #define STBI__MARKER_none  0xff
@@ -1346,8 +1727,180 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// parallel decoding of baseline scans with restart markers. Each restart
+// interval resets the entropy decoder and DC prediction, and covers a known
+// range of MCUs, so once the interval boundaries have been found by scanning
+// for RST markers, the intervals can be decoded independently. This needs the
+// whole scan in memory, so is only used for memory-backed contexts.
+
+static stbi_parallel_for_callback *stbi__jpeg_parallel_for = 0;
+static void *stbi__jpeg_parallel_user = 0;
+
+STBIDEF void stbi_set_jpeg_parallel(stbi_parallel_for_callback *fn, void *user)
+{
+   stbi__jpeg_parallel_for = fn;
+   stbi__jpeg_parallel_user = user;
+}
+
+// idct a block into component n's output, given the block's full-size
+// position (x,y); scaled decodes write a reduced block to the reduced plane
+static void stbi__jpeg_idct(stbi__jpeg *z, int n, int x, int y, short data[64])
+{
+   int stride = z->img_comp[n].w2 >> z->scale_shift;
+   z->idct_block_kernel(z->img_comp[n].data + stride*(y >> z->scale_shift) + (x >> z->scale_shift), stride, data);
+}
+
+// number of units in a baseline scan, where a unit is an MCU, or a single
+// block for non-interleaved scans; these are what restart_interval counts
+static int stbi__jpeg_scan_units(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode units [first, last) of a baseline scan, without restart handling
+static int stbi__jpeg_decode_units(stbi__jpeg *z, int first, int last)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int u,k,x,y;
+   for (u = first; u < last; ++u) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = u % w, j = u / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         stbi__jpeg_idct(z, n, i*8, j*8, data);
+      } else {
+         int i = u % z->img_mcu_x, j = u / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  stbi__jpeg_idct(z, n, x2, y2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+// record where each restart interval's data starts, plus the end of the scan.
+// returns 0 unless we find exactly num_intervals, with RSTn in sequence.
+static int stbi__jpeg_find_intervals(stbi__context *s, stbi_uc **starts, int num_intervals)
+{
+   stbi_uc *p = s->img_buffer, *end = s->img_buffer_end;
+   int n = 0;
+   starts[n++] = p;
+   for (;;) {
+      p = (stbi_uc *) memchr(p, 0xff, end - p);
+      if (!p || p + 1 >= end) return 0;
+      if (p[1] == 0x00 || p[1] == 0xff) { // stuffed byte, or fill
+         p += 1;
+      } else if (STBI__RESTART(p[1])) {
+         if (n >= num_intervals || ((n - 1) & 7) != (p[1] & 7)) return 0;
+         p += 2;
+         starts[n++] = p;
+      } else
+         break;
+   }
+   starts[n] = p;
+   return n == num_intervals;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **starts;
+   int num_units, num_intervals, intervals_per_task;
+   int *ok;
+} stbi__jpeg_parallel_scan;
+
+static void stbi__jpeg_decode_intervals(void *task_data, int task)
+{
+   stbi__jpeg_parallel_scan *p = (stbi__jpeg_parallel_scan *) task_data;
+   int k, first = task * p->intervals_per_task, last = first + p->intervals_per_task;
+   stbi__context s;
+   // each task needs its own decoder state; it's too big for worker stacks
+   stbi__jpeg *j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   p->ok[task] = 0;
+   if (!j) return;
+   memcpy(j, p->z, sizeof(*j));
+   j->s = &s;
+   if (last > p->num_intervals) last = p->num_intervals;
+   for (k = first; k < last; ++k) {
+      int u0 = k * j->restart_interval;
+      int u1 = u0 + j->restart_interval;
+      if (u1 > p->num_units) u1 = p->num_units;
+      stbi__start_mem(&s, p->starts[k], (int) (p->starts[k+1] - p->starts[k]));
+      stbi__jpeg_reset(j);
+      if (!stbi__jpeg_decode_units(j, u0, u1)) break;
+   }
+   p->ok[task] = k == last;
+   STBI_FREE(j);
+}
+
+// returns -1 if this scan can't be decoded in parallel
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_parallel_scan p;
+   int i, num_tasks, result = 1;
+
+   if (!stbi__jpeg_parallel_for || z->progressive || !z->restart_interval || z->s->read_from_callbacks)
+      return -1;
+
+   p.z = z;
+   p.num_units = stbi__jpeg_scan_units(z);
+   p.num_intervals = (p.num_units + z->restart_interval - 1) / z->restart_interval;
+   if (p.num_intervals < 2)
+      return -1;
+
+   p.starts = (stbi_uc **) stbi__malloc_mad2(p.num_intervals + 1, sizeof(*p.starts), 0);
+   if (!p.starts)
+      return -1;
+   if (!stbi__jpeg_find_intervals(z->s, p.starts, p.num_intervals)) {
+      STBI_FREE(p.starts);
+      return -1; // no markers, or not where we expect them, so let the serial path deal with it
+   }
+
+   // batch intervals so small restart intervals don't mean lots of tiny tasks
+   p.intervals_per_task = (p.num_intervals + 255) / 256;
+   num_tasks = (p.num_intervals + p.intervals_per_task - 1) / p.intervals_per_task;
+   p.ok = (int *) stbi__malloc_mad2(num_tasks, sizeof(int), 0);
+   if (!p.ok) {
+      STBI_FREE(p.starts);
+      return -1;
+   }
+
+   stbi__jpeg_parallel_for(stbi__jpeg_parallel_user, stbi__jpeg_decode_intervals, &p, num_tasks);
+
+   for (i = 0; i < num_tasks; ++i)
+      if (!p.ok[i])
+         result = 0;
+
+   // leave the stream at the marker that ended the scan, as the serial path does
+   z->s->img_buffer = p.starts[p.num_intervals];
+   z->marker = STBI__MARKER_none;
+
+   STBI_FREE(p.ok);
+   STBI_FREE(p.starts);
+   return result;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   int parallel = stbi__parse_entropy_coded_data_parallel(z);
+   if (parallel >= 0)
+      return parallel;
+
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
@@ -1364,7 +1917,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, n, i*8, j*8, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -1392,7 +1945,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                         int y2 = (j*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        stbi__jpeg_idct(z, n, x2, y2, data);
                      }
                   }
                }
@@ -1489,7 +2042,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, n, i*8, j*8, data);
             }
          }
       }
@@ -1724,7 +2277,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      // the decoded planes are reduced when scaling
+      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2 >> z->scale_shift, z->img_comp[i].h2 >> z->scale_shift, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
@@ -1777,6 +2331,21 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 }
 
 // decode image to YCbCr format
+// once decoded, switch the image and component sizes over to the reduced
+// planes, so resampling and colour conversion work on those
+static void stbi__jpeg_scale_geometry(stbi__jpeg *z)
+{
+   int i, s = z->scale_shift, r = (1 << s) - 1;
+   z->s->img_x = (z->s->img_x + r) >> s;
+   z->s->img_y = (z->s->img_y + r) >> s;
+   for (i=0; i < z->s->img_n; ++i) {
+      z->img_comp[i].x = (z->img_comp[i].x + r) >> s;
+      z->img_comp[i].y = (z->img_comp[i].y + r) >> s;
+      z->img_comp[i].w2 >>= s;
+      z->img_comp[i].h2 >>= s;
+   }
+}
+
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
    int m;
@@ -1814,6 +2383,8 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    }
    if (j->progressive)
       stbi__jpeg_finish(j);
+   if (j->scale_shift)
+      stbi__jpeg_scale_geometry(j);
    return 1;
 }
 
@@ -1897,6 +2468,150 @@ static stbi_uc *stbi__resample_row_hv_2(stbi_uc *out, stbi_uc *in_near, stbi_uc
    return out;
 }
 
+#ifdef STBI_SSE2
+static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   // process groups of 8 pixels for as long as we can.
+   // note we can't handle the last pixel in a row in this loop
+   // because we need to handle the filter boundary conditions.
+   for (; i < ((w-1) & ~7); i += 8) {
+      // load and perform the vertical filtering pass
+      // this uses 3*x + y = 4*x + (y - x)
+      __m128i zero  = _mm_setzero_si128();
+      __m128i farb  = _mm_loadl_epi64((__m128i *) (in_far + i));
+      __m128i nearb = _mm_loadl_epi64((__m128i *) (in_near + i));
+      __m128i farw  = _mm_unpacklo_epi8(farb, zero);
+      __m128i nearw = _mm_unpacklo_epi8(nearb, zero);
+      __m128i diff  = _mm_sub_epi16(farw, nearw);
+      __m128i nears = _mm_slli_epi16(nearw, 2);
+      __m128i curr  = _mm_add_epi16(nears, diff); // current row
+
+      // horizontal filter works the same based on shifted vers of current
+      // row. "prev" is current row shifted right by 1 pixel; we need to
+      // insert the previous pixel value (from t1).
+      // "next" is current row shifted left by 1 pixel, with first pixel
+      // of next block of 8 pixels added in.
+      __m128i prv0 = _mm_slli_si128(curr, 2);
+      __m128i nxt0 = _mm_srli_si128(curr, 2);
+      __m128i prev = _mm_insert_epi16(prv0, t1, 0);
+      __m128i next = _mm_insert_epi16(nxt0, 3*in_near[i+8] + in_far[i+8], 7);
+
+      // horizontal filter, polyphase implementation since it's convenient:
+      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+      // note the shared term.
+      __m128i bias  = _mm_set1_epi16(8);
+      __m128i curs = _mm_slli_epi16(curr, 2);
+      __m128i prvd = _mm_sub_epi16(prev, curr);
+      __m128i nxtd = _mm_sub_epi16(next, curr);
+      __m128i curb = _mm_add_epi16(curs, bias);
+      __m128i even = _mm_add_epi16(prvd, curb);
+      __m128i odd  = _mm_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, then undo scaling.
+      __m128i int0 = _mm_unpacklo_epi16(even, odd);
+      __m128i int1 = _mm_unpackhi_epi16(even, odd);
+      __m128i de0  = _mm_srli_epi16(int0, 4);
+      __m128i de1  = _mm_srli_epi16(int1, 4);
+
+      // pack and write output
+      __m128i outv = _mm_packus_epi16(de0, de1);
+      _mm_storeu_si128((__m128i *) (out + i*2), outv);
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+7] + in_far[i+7];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // as for the sse2 version, but 16 pixels at a time. 256-bit shifts don't
+   // cross lanes, so rather than shifting "curr" we build prev/next from
+   // loads offset by one pixel, which also avoids the boundary inserts.
+   int i,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t0 = 3*in_near[0] + in_far[0];
+   t1 = 3*in_near[1] + in_far[1];
+   out[0] = stbi__div4(t0+2);
+   out[1] = stbi__div16(3*t0 + t1 + 8);
+
+   #define stbi__avx2_row(o) \
+      _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i + (o)))), 2), \
+         _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far  + i + (o)))), \
+                          _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i + (o))))))
+
+   for (i=1; i + 16 < w; i += 16) {
+      // vertical pass for this block and its neighbours one pixel either side
+      __m256i prev = stbi__avx2_row(-1);
+      __m256i curr = stbi__avx2_row( 0);
+      __m256i next = stbi__avx2_row( 1);
+
+      // horizontal pass, even = 3*cur + prev, odd = 3*cur + next
+      __m256i curb = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), _mm256_set1_epi16(8));
+      __m256i even = _mm256_add_epi16(_mm256_sub_epi16(prev, curr), curb);
+      __m256i odd  = _mm256_add_epi16(_mm256_sub_epi16(next, curr), curb);
+
+      // interleave and pack work within each 128-bit lane, which leaves
+      // pixels 0-7 in the low lane and 8-15 in the high one, as required.
+      __m256i int0 = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4);
+      __m256i int1 = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4);
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(int0, int1));
+   }
+
+   #undef stbi__avx2_row
+
+   // leave no dirty upper ymm state behind, or every later sse instruction pays for it
+   _mm256_zeroupper();
+
+   // finish with the generic loop; out[i*2-1] may be rewritten with the same value
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
 
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
@@ -1937,6 +2652,154 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
    }
 }
 
+#ifdef STBI_SSE2
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   // step == 3 is pretty ugly on the final interleave, and i'm not convinced
+   // it's useful in practice (you wouldn't use it for textures, for example).
+   // so just accelerate step == 4 case.
+   if (step == 4) {
+      // this is a fairly straightforward implementation and not super-optimized.
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
+      __m128i xw = _mm_set1_epi16(255); // alpha channel
+
+      for (; i+7 < count; i += 8) {
+         // load
+         __m128i y_bytes = _mm_loadl_epi64((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadl_epi64((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadl_epi64((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // unpack to short (and left-shift cr, cb by 8)
+         __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
+         __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
+         __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
+
+         // color transform
+         __m128i yws = _mm_srli_epi16(yw, 4);
+         __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+         __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+         __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+         __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+         __m128i rws = _mm_add_epi16(cr0, yws);
+         __m128i gwt = _mm_add_epi16(cb0, yws);
+         __m128i bws = _mm_add_epi16(yws, cb1);
+         __m128i gws = _mm_add_epi16(gwt, cr1);
+
+         // descale
+         __m128i rw = _mm_srai_epi16(rws, 4);
+         __m128i bw = _mm_srai_epi16(bws, 4);
+         __m128i gw = _mm_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m128i brb = _mm_packus_epi16(rw, bw);
+         __m128i gxb = _mm_packus_epi16(gw, xw);
+
+         // transpose to interleave channels
+         __m128i t0 = _mm_unpacklo_epi8(brb, gxb);
+         __m128i t1 = _mm_unpackhi_epi8(brb, gxb);
+         __m128i o0 = _mm_unpacklo_epi16(t0, t1);
+         __m128i o1 = _mm_unpackhi_epi16(t0, t1);
+
+         // store
+         _mm_storeu_si128((__m128i *) (out + 0), o0);
+         _mm_storeu_si128((__m128i *) (out + 16), o1);
+         out += 32;
+      }
+   }
+
+   stbi__YCbCr_to_RGB_row(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+#endif
+
+#ifdef STBI_AVX2
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   // 16 pixels at a time. Same arithmetic as the sse2 version, so the
+   // results still match stbi__YCbCr_to_RGB_row exactly.
+   int i = 0;
+
+   if (step == 4) {
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i c_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // widen to short: y << 8 | 128, (c - 128) << 8
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (y+i))), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcr+i))), c_bias), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcb+i))), c_bias), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i rws = _mm256_add_epi16(_mm256_mulhi_epi16(cr_const0, crw), yws);
+         __m256i gwt = _mm256_add_epi16(_mm256_mulhi_epi16(cb_const0, cbw), yws);
+         __m256i bws = _mm256_add_epi16(yws, _mm256_mulhi_epi16(cbw, cb_const1));
+         __m256i gws = _mm256_add_epi16(gwt, _mm256_mulhi_epi16(crw, cr_const1));
+
+         // descale and pack; packs work per 128-bit lane
+         __m256i brb = _mm256_packus_epi16(_mm256_srai_epi16(rws, 4), _mm256_srai_epi16(bws, 4));
+         __m256i gxb = _mm256_packus_epi16(_mm256_srai_epi16(gws, 4), xw);
+
+         // interleave channels: o0 holds pixels 0-3 | 8-11, o1 4-7 | 12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store, putting the lanes back in order
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+
+      // as in stbi__resample_row_hv_2_avx2, before any sse code runs again
+      _mm256_zeroupper();
+   }
+
+   stbi__YCbCr_to_RGB_row(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+#endif
+
+
+// applies to the calling thread only, and is copied into stbi__jpeg by stbi__setup_jpeg
+static STBI_THREAD_LOCAL stbi_jpeg_ycbcr_callback *stbi__jpeg_ycbcr_hook = 0;
+static STBI_THREAD_LOCAL void *stbi__jpeg_ycbcr_hook_user = 0;
+static STBI_THREAD_LOCAL stbi_jpeg_row_callback *stbi__jpeg_row_hook = 0;
+static STBI_THREAD_LOCAL void *stbi__jpeg_row_hook_user = 0;
+
+STBIDEF void stbi_set_jpeg_ycbcr_callback(stbi_jpeg_ycbcr_callback *fn, void *user)
+{
+   stbi__jpeg_ycbcr_hook = fn;
+   stbi__jpeg_ycbcr_hook_user = user;
+}
+
+STBIDEF void stbi_set_jpeg_row_callback(stbi_jpeg_row_callback *fn, void *user)
+{
+   stbi__jpeg_row_hook = fn;
+   stbi__jpeg_row_hook_user = user;
+}
+
+// applies to the calling thread only
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_shift_setting = 0;
+
+STBIDEF void stbi_set_jpeg_scale_denom(int denom)
+{
+   stbi__jpeg_scale_shift_setting = denom == 8 ? 3 : denom == 4 ? 2 : denom == 2 ? 1 : 0;
+}
 
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
@@ -1945,7 +2808,29 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
+#ifdef STBI_SSE2
+   j->idct_block_kernel = stbi__idct_simd;
+   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+#endif
+
+#ifdef STBI_AVX2
+   // the IDCT stays sse2: a single 8x8 block doesn't fill 256-bit registers
+   // without a lane-crossing transpose, which eats the gain.
+   if (stbi__avx2_available()) {
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
 
+   j->scale_shift = stbi__jpeg_scale_shift_setting;
+   j->ycbcr_hook = stbi__jpeg_ycbcr_hook;
+   j->ycbcr_hook_user = stbi__jpeg_ycbcr_hook_user;
+   j->row_hook = stbi__jpeg_row_hook;
+   j->row_hook_user = stbi__jpeg_row_hook_user;
+   if      (j->scale_shift == 1) j->idct_block_kernel = stbi__idct_4x4;
+   else if (j->scale_shift == 2) j->idct_block_kernel = stbi__idct_2x2;
+   else if (j->scale_shift == 3) j->idct_block_kernel = stbi__idct_1x1;
 }
 
 // clean up the temporary component buffers
@@ -1971,6 +2856,170 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4]; // resampler state for row 0
+   stbi_uc *output;
+   int n, decode_n, is_rgb;
+   unsigned int rows_per_task;
+   int *ok;
+} stbi__jpeg_convert;
+
+static void stbi__resample_step(stbi__resample *r, stbi__jpeg *z, int k)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < z->img_comp[k].y)
+         r->line1 += z->img_comp[k].w2;
+   }
+}
+
+// resample and color-convert output rows [j0, j1) into c->output
+static void stbi__jpeg_convert_rows(stbi__jpeg_convert *c, stbi_uc **linebuf, unsigned int j0, unsigned int j1)
+{
+   stbi__jpeg *z = c->z;
+   int n = c->n, decode_n = c->decode_n, is_rgb = c->is_rgb;
+   int k;
+   unsigned int i,j;
+   stbi_uc *coutput[4];
+   stbi__resample res_comp[4];
+
+   // step each resampler on to our first row
+   for (k=0; k < decode_n; ++k) {
+      res_comp[k] = c->res_comp[k];
+      for (j=0; j < j0; ++j)
+         stbi__resample_step(&res_comp[k], z, k);
+   }
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *out = c->output + n * z->s->img_x * j;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         stbi__resample_step(r, z, k);
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->ycbcr_hook) {
+               z->ycbcr_hook(z->ycbcr_hook_user, out, y, coutput[1], coutput[2], z->s->img_x, n);
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (z->row_hook)
+         z->row_hook(z->row_hook_user, c->output + n * z->s->img_x * j, j, z->s->img_x, n);
+   }
+}
+
+static unsigned int stbi__min_u32(unsigned int a, unsigned int b)
+{
+   return a < b ? a : b;
+}
+
+// with stbi_set_jpeg_parallel, rows are converted in bands, each with its own line buffers
+static void stbi__jpeg_convert_band(void *task_data, int task)
+{
+   stbi__jpeg_convert *c = (stbi__jpeg_convert *) task_data;
+   unsigned int j0 = task * c->rows_per_task, j1 = j0 + c->rows_per_task;
+   stbi_uc *linebuf[4];
+   int k;
+
+   c->ok[task] = 0;
+   j1 = stbi__min_u32(j1, c->z->s->img_y);
+
+   for (k=0; k < c->decode_n; ++k)
+      linebuf[k] = (stbi_uc *) stbi__malloc(c->z->s->img_x + 3);
+
+   for (k=0; k < c->decode_n; ++k)
+      if (!linebuf[k])
+         break;
+
+   if (k == c->decode_n) {
+      stbi__jpeg_convert_rows(c, linebuf, j0, j1);
+      c->ok[task] = 1;
+   }
+
+   for (k=0; k < c->decode_n; ++k)
+      STBI_FREE(linebuf[k]);
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -1994,15 +3043,12 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // resample and color-convert
    {
-      int k;
-      unsigned int i,j;
+      int k, num_tasks;
       stbi_uc *output;
-      stbi_uc *coutput[4];
-
-      stbi__resample res_comp[4];
+      stbi__jpeg_convert convert;
 
       for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+         stbi__resample *r = &convert.res_comp[k];
 
          // allocate line buffer big enough for upsampling off the edges
          // with upsample factor of 4
@@ -2028,99 +3074,32 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
+      convert.z = z;
+      convert.output = output;
+      convert.n = n;
+      convert.decode_n = decode_n;
+      convert.is_rgb = is_rgb;
+
+      convert.rows_per_task = 64;
+      convert.ok = 0;
+      num_tasks = (z->s->img_y + convert.rows_per_task - 1) / convert.rows_per_task;
+      if (stbi__jpeg_parallel_for && num_tasks > 1)
+         convert.ok = (int *) stbi__malloc_mad2(num_tasks, sizeof(int), 0);
+
+      {
+         stbi_uc *linebuf[4];
+         for (k=0; k < decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+
+         if (convert.ok) {
+            stbi__jpeg_parallel_for(stbi__jpeg_parallel_user, stbi__jpeg_convert_band, &convert, num_tasks);
+            // redo any band that couldn't get line buffers with ours
+            for (k=0; k < num_tasks; ++k)
+               if (!convert.ok[k])
+                  stbi__jpeg_convert_rows(&convert, linebuf, k * convert.rows_per_task, stbi__min_u32((k+1) * convert.rows_per_task, z->s->img_y));
+            STBI_FREE(convert.ok);
+         } else
+            stbi__jpeg_convert_rows(&convert, linebuf, 0, z->s->img_y);
       }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
@@ -2283,11 +3262,22 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+
+   // for streaming: if set, zread refills zbuffer when it runs out, and zflush
+   // is handed the output so far, bar the last 32K window, when zout fills up
+   int (*zread)(void *user, stbi_uc **start, stbi_uc **end);
+   int (*zflush)(void *user, char *data, int len);
+   void *zuser;
 } stbi__zbuf;
 
+static int stbi__zrefill(stbi__zbuf *z)
+{
+   return z->zread && z->zread(z->zuser, &z->zbuffer, &z->zbuffer_end) && z->zbuffer < z->zbuffer_end;
+}
+
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end && !stbi__zrefill(z)) return 0;
    return *z->zbuffer++;
 }
 
@@ -2347,6 +3337,16 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zflush) {
+      // hand on everything but the window that later matches can refer to
+      cur = (int) (zout - z->zout_start);
+      if (cur > 32768) {
+         if (!z->zflush(z->zuser, z->zout_start, cur - 32768)) return stbi__err("aborted","Stream aborted");
+         memmove(z->zout_start, zout - 32768, 32768);
+         z->zout = z->zout_start + 32768;
+      }
+      if (z->zout + n <= z->zout_end) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
@@ -2486,12 +3486,18 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   while (len > 0) {
+      int avail;
+      if (a->zbuffer >= a->zbuffer_end && !stbi__zrefill(a)) return stbi__err("read past buffer","Corrupt PNG");
+      avail = (int) (a->zbuffer_end - a->zbuffer);
+      if (avail > len) avail = len;
+      if (a->zout + avail > a->zout_end)
+         if (!stbi__zexpand(a, a->zout, avail)) return 0;
+      memcpy(a->zout, a->zbuffer, avail);
+      a->zbuffer += avail;
+      a->zout += avail;
+      len -= avail;
+   }
    return 1;
 }
 
@@ -2571,6 +3577,8 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zread = NULL;
+   a->zflush = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -2689,6 +3697,8 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   stbi_uc *palette_out;   // if set, paletted images aren't expanded, and their palette goes here
+   int palette_len;
 } stbi__png;
 
 
@@ -3162,6 +4172,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
             if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
             if (color == 3) pal_img_n = 3; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
+            if (z->palette_out && color != 3) return stbi__err("not paletted","PNG not paletted");
             comp  = stbi__get8(s);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
             filter= stbi__get8(s);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
             interlace = stbi__get8(s); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
@@ -3262,7 +4273,12 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             }
             if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
                stbi__de_iphone(z);
-            if (pal_img_n) {
+            if (pal_img_n && z->palette_out) {
+               // leave the indices as they are
+               memcpy(z->palette_out, palette, pal_len * 4);
+               z->palette_len = pal_len;
+               s->img_n = pal_img_n;
+            } else if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
@@ -3330,6 +4346,7 @@ static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req
 {
    stbi__png p;
    p.s = s;
+   p.palette_out = NULL;
    return stbi__do_png(&p, x,y,comp,req_comp, ri);
 }
 
@@ -3357,9 +4374,252 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
 {
    stbi__png p;
    p.s = s;
+   p.palette_out = NULL;
    return stbi__png_info_raw(&p, x, y, comp);
 }
 
+STBIDEF stbi_uc *stbi_load_png_indexed_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_uc palette[256*4], int *palette_len)
+{
+   stbi__context s;
+   stbi__png p;
+   stbi_uc *result = NULL;
+   stbi__start_mem(&s,buffer,len);
+   p.s = &s;
+   p.palette_out = palette;
+   p.palette_len = 0;
+   if (stbi__parse_png_file(&p, STBI__SCAN_load, 0) && p.palette_len) {
+      result = p.out;
+      p.out = NULL;
+      *x = s.img_x;
+      *y = s.img_y;
+      *palette_len = p.palette_len;
+   }
+   STBI_FREE(p.out);
+   STBI_FREE(p.expanded);
+   STBI_FREE(p.idata);
+   return result;
+}
+
+typedef struct
+{
+   stbi__context *s;
+   stbi__uint32 chunk_left;         // IDAT bytes left in the current chunk
+   int x, y, depth, color, img_n, filter_bytes;
+   int row_bytes;                   // bytes per row, not counting the filter type
+   int row_fill;                    // bytes of the current row received so far
+   stbi_uc *cur, *prior;            // filter type followed by the row
+   stbi_uc palette[1024];
+   int has_trans;
+   stbi__uint16 tc[3];
+   stbi_uc *band;
+   int band_rows, band_count, band_y;
+   stbi_band_callback *fn;
+   void *user;
+   stbi_uc in[1 << 16];
+} stbi__png_bands;
+
+static int stbi__png_bands_read(void *user, stbi_uc **start, stbi_uc **end)
+{
+   stbi__png_bands *b = (stbi__png_bands *) user;
+   int n;
+   while (b->chunk_left == 0) {
+      stbi__pngchunk c;
+      stbi__get32be(b->s); // crc of the previous chunk
+      c = stbi__get_chunk_header(b->s);
+      if (c.type != STBI__PNG_TYPE('I','D','A','T')) return 0;
+      b->chunk_left = c.length;
+   }
+   n = b->chunk_left < sizeof(b->in) ? (int) b->chunk_left : (int) sizeof(b->in);
+   if (!stbi__getn(b->s, b->in, n)) return 0;
+   b->chunk_left -= n;
+   *start = b->in;
+   *end = b->in + n;
+   return 1;
+}
+
+// unfilter the completed row, convert it to RGBA, and pass on the band if full
+static int stbi__png_bands_row(stbi__png_bands *b)
+{
+   stbi_uc *raw = b->cur + 1, *prior = b->prior + 1, *t;
+   stbi_uc *out = b->band + (size_t) b->band_count * b->x * 4;
+   int i, fb = b->filter_bytes, n = b->row_bytes;
+
+   // the zeroed initial prior row makes the first row filters unnecessary
+   switch (b->cur[0]) {
+      case STBI__F_none: break;
+      case STBI__F_sub:   for (i=fb; i < n; ++i) raw[i] += raw[i-fb]; break;
+      case STBI__F_up:    for (i=0; i < n; ++i) raw[i] += prior[i]; break;
+      case STBI__F_avg:
+         for (i=0; i < fb; ++i) raw[i] += prior[i]>>1;
+         for (; i < n; ++i) raw[i] += (raw[i-fb] + prior[i])>>1;
+         break;
+      case STBI__F_paeth:
+         for (i=0; i < fb; ++i) raw[i] += prior[i];
+         for (; i < n; ++i) raw[i] += (stbi_uc) stbi__paeth(raw[i-fb], prior[i], prior[i-fb]);
+         break;
+      default: return stbi__err("invalid filter","Corrupt PNG");
+   }
+
+   for (i=0; i < b->x; ++i, out += 4) {
+      stbi__uint16 v[4];
+      int k, trans = b->has_trans;
+      for (k=0; k < b->img_n; ++k) {
+         int j = i*b->img_n + k;
+         if (b->depth == 16)
+            v[k] = (stbi__uint16) (raw[j*2] << 8 | raw[j*2+1]);
+         else if (b->depth == 8)
+            v[k] = raw[j];
+         else
+            v[k] = (raw[(j*b->depth) >> 3] >> (8 - b->depth - ((j*b->depth) & 7))) & ((1 << b->depth) - 1);
+         if (trans && v[k] != b->tc[k]) trans = 0;
+      }
+      switch (b->color) {
+         case 3: memcpy(out, b->palette + v[0]*4, 4); continue;
+         case 0: out[0] = out[1] = out[2] = (stbi_uc) (b->depth == 16 ? v[0] >> 8 : v[0] * stbi__depth_scale_table[b->depth]); out[3] = 255; break;
+         case 4: out[0] = out[1] = out[2] = (stbi_uc) (b->depth == 16 ? v[0] >> 8 : v[0]); out[3] = (stbi_uc) (b->depth == 16 ? v[1] >> 8 : v[1]); break;
+         case 2: case 6:
+            for (k=0; k < b->img_n; ++k)
+               out[k] = (stbi_uc) (b->depth == 16 ? v[k] >> 8 : v[k]);
+            if (b->color == 2) out[3] = 255;
+            break;
+      }
+      if (trans) out[3] = 0;
+   }
+
+   t = b->cur; b->cur = b->prior; b->prior = t;
+   b->row_fill = 0;
+   ++b->band_count;
+
+   if (b->band_count == b->band_rows || b->band_y + b->band_count == b->y) {
+      if (!b->fn(b->user, b->band, b->band_y, b->band_count)) return stbi__err("aborted","Stream aborted");
+      b->band_y += b->band_count;
+      b->band_count = 0;
+   }
+   return 1;
+}
+
+static int stbi__png_bands_flush(void *user, char *data, int len)
+{
+   stbi__png_bands *b = (stbi__png_bands *) user;
+   while (len > 0 && b->band_y + b->band_count < b->y) {
+      int n = b->row_bytes + 1 - b->row_fill;
+      if (n > len) n = len;
+      memcpy(b->cur + b->row_fill, data, n);
+      b->row_fill += n;
+      data += n;
+      len -= n;
+      if (b->row_fill == b->row_bytes + 1 && !stbi__png_bands_row(b)) return 0;
+   }
+   return 1;
+}
+
+static int stbi__png_bands_decode(stbi__png_bands *b)
+{
+   stbi__zbuf z;
+   int ok;
+   z.zbuffer = z.zbuffer_end = NULL;
+   z.zout_start = z.zout = (char *) stbi__malloc(1 << 17);
+   if (!z.zout) return stbi__err("outofmem", "Out of memory");
+   z.zout_end = z.zout + (1 << 17);
+   z.z_expandable = 1;
+   z.zread = stbi__png_bands_read;
+   z.zflush = stbi__png_bands_flush;
+   z.zuser = b;
+   ok = stbi__parse_zlib(&z, 1) && stbi__png_bands_flush(b, z.zout_start, (int) (z.zout - z.zout_start));
+   STBI_FREE(z.zout_start);
+   if (ok && b->band_y < b->y) return stbi__err("not enough pixels","Corrupt PNG");
+   return ok;
+}
+
+STBIDEF int stbi_load_png_bands(FILE *f, int band_rows, stbi_band_callback *fn, void *user)
+{
+   stbi__context s;
+   stbi__png_bands *b;
+   int i, ok = 0, first = 1;
+
+   if (band_rows < 1) return stbi__err("bad band","Bad band size");
+   stbi__start_file(&s, f);
+   if (!stbi__check_png_header(&s)) return 0;
+
+   b = (stbi__png_bands *) stbi__malloc(sizeof(*b));
+   if (!b) return stbi__err("outofmem", "Out of memory");
+   memset(b, 0, sizeof(*b) - sizeof(b->in));
+   b->s = &s;
+   b->band_rows = band_rows;
+   b->fn = fn;
+   b->user = user;
+   for (i=0; i < 256; ++i)
+      b->palette[i*4+3] = 255;
+
+   for (;;) {
+      stbi__pngchunk c = stbi__get_chunk_header(&s);
+      if (first && c.type != STBI__PNG_TYPE('I','H','D','R')) { stbi__err("first not IHDR","Corrupt PNG"); break; }
+      first = 0;
+      if (c.type == STBI__PNG_TYPE('I','H','D','R')) {
+         int comp, filter, interlace;
+         if (c.length != 13) { stbi__err("bad IHDR len","Corrupt PNG"); break; }
+         b->x = stbi__get32be(&s);
+         b->y = stbi__get32be(&s);
+         b->depth = stbi__get8(&s);
+         b->color = stbi__get8(&s);
+         comp = stbi__get8(&s);
+         filter = stbi__get8(&s);
+         interlace = stbi__get8(&s);
+         if (b->x <= 0 || b->y <= 0 || b->x > (1 << 24) || b->y > (1 << 24)) { stbi__err("too large","Very large image (corrupt?)"); break; }
+         if (comp || filter || interlace) { stbi__err("unsupported","PNG not supported: interlaced"); break; }
+         if (b->color == 0 || b->color == 3)
+            b->img_n = 1, ok = b->depth == 1 || b->depth == 2 || b->depth == 4 || b->depth == 8 || (b->depth == 16 && b->color == 0);
+         else if (b->color == 2 || b->color == 4 || b->color == 6)
+            b->img_n = b->color == 4 ? 2 : b->color == 2 ? 3 : 4, ok = b->depth == 8 || b->depth == 16;
+         if (!ok) { stbi__err("bad ctype","Corrupt PNG"); break; }
+         ok = 0;
+         b->row_bytes = (b->x * b->img_n * b->depth + 7) / 8;
+         b->filter_bytes = b->depth < 8 ? 1 : b->img_n * b->depth / 8;
+      } else if (c.type == STBI__PNG_TYPE('P','L','T','E')) {
+         if (c.length > 256*3 || c.length % 3) { stbi__err("invalid PLTE","Corrupt PNG"); break; }
+         for (i=0; i < (int) c.length / 3; ++i) {
+            b->palette[i*4+0] = stbi__get8(&s);
+            b->palette[i*4+1] = stbi__get8(&s);
+            b->palette[i*4+2] = stbi__get8(&s);
+         }
+      } else if (c.type == STBI__PNG_TYPE('t','R','N','S')) {
+         if (b->color == 3) {
+            if (c.length > 256) { stbi__err("bad tRNS len","Corrupt PNG"); break; }
+            for (i=0; i < (int) c.length; ++i)
+               b->palette[i*4+3] = stbi__get8(&s);
+         } else {
+            if (c.length != (stbi__uint32) b->img_n*2 || b->color & 4) { stbi__err("bad tRNS len","Corrupt PNG"); break; }
+            b->has_trans = 1;
+            for (i=0; i < b->img_n; ++i)
+               b->tc[i] = (stbi__uint16) (stbi__get16be(&s) & (b->depth == 16 ? 0xffff : 0xff));
+         }
+      } else if (c.type == STBI__PNG_TYPE('I','D','A','T')) {
+         stbi_uc *rows = (stbi_uc *) stbi__malloc_mad3(2, b->row_bytes, 1, 2);
+         b->band = (stbi_uc *) stbi__malloc_mad3(b->x, 4, band_rows < b->y ? band_rows : b->y, 0);
+         if (rows && b->band) {
+            memset(rows, 0, 2 * (b->row_bytes + 1));
+            b->cur = rows;
+            b->prior = rows + b->row_bytes + 1;
+            b->chunk_left = c.length;
+            ok = stbi__png_bands_decode(b);
+         } else
+            stbi__err("outofmem", "Out of memory");
+         STBI_FREE(rows);
+         STBI_FREE(b->band);
+         break;
+      } else if (c.type == STBI__PNG_TYPE('I','E','N','D') || c.type == STBI__PNG_TYPE('C','g','B','I') || !(c.type & (1 << 29))) {
+         // no image data, iphone pngs, or unknown critical chunks
+         stbi__err("unsupported","PNG not supported");
+         break;
+      } else
+         stbi__skip(&s, c.length);
+      stbi__get32be(&s); // crc
+   }
+
+   STBI_FREE(b);
+   return ok;
+}
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
    if (stbi__jpeg_info(s, x, y, comp)) return 1;
@@ -3657,8 +4917,44 @@ static unsigned int stbiw__zhash(unsigned char *data)
 #define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
 
 #define stbiw__ZHASH   16384
+#define stbiw__ZCHUNK  (1 << 20)
 
-unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+static void stbiw__zhash_insert(unsigned char ***hash_table, unsigned char *p, int quality)
+{
+   int h = stbiw__zhash(p)&(stbiw__ZHASH-1);
+   // when hash table entry is too long, delete half the entries
+   if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+      STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+      stbiw__sbn(hash_table[h]) = quality;
+   }
+   stbiw__sbpush(hash_table[h],p);
+}
+
+// as stbiw__zlib_deflate, for compression level 0
+static unsigned char *stbiw__zlib_store(unsigned char *out, unsigned char *data, int start, int end, int final)
+{
+   do {
+      int len = end - start > 65535 ? 65535 : end - start;
+      int last = final && start + len == end;
+      stbiw__sbpush(out, (unsigned char) last); // BFINAL, BTYPE = 0 -- stored, then pad to byte boundary
+      stbiw__sbpush(out, (unsigned char) len);
+      stbiw__sbpush(out, (unsigned char) (len >> 8));
+      stbiw__sbpush(out, (unsigned char) ~len);
+      stbiw__sbpush(out, (unsigned char) (~len >> 8));
+      stbiw__sbmaybegrow(out, len);
+      STBIW_MEMMOVE(out + stbiw__sbn(out), data + start, len);
+      stbiw__sbn(out) += len;
+      start += len;
+   } while (start < end);
+   return out;
+}
+
+// deflate data[start, end) as one fixed-huffman block, appending to out.
+// Matches can reach back into the 32K before start, so separately compressed
+// chunks still see the whole window. Unless this is the final block, it's
+// followed by an empty stored block (a sync flush), which leaves us on a byte
+// boundary, so the results for consecutive chunks can just be concatenated.
+static unsigned char *stbiw__zlib_deflate(unsigned char *out, unsigned char *data, int start, int end, int quality, int rle, int final)
 {
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
@@ -3666,46 +4962,63 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char **hash_table[stbiw__ZHASH]; // 64KB on the stack!
-   if (quality < 5) quality = 5;
+   unsigned char ***hash_table = NULL;
+   if (quality <= 0)
+      return stbiw__zlib_store(out, data, start, end, final);
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+   if (!rle) {
+      // too big for the stack of a worker thread
+      hash_table = (unsigned char ***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char **));
+      if (!hash_table) { (void) stbiw__sbfree(out); return NULL; }
+
+      for (i=0; i < stbiw__ZHASH; ++i)
+         hash_table[i] = NULL;
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
+      // prime the hash table with the preceding window
+      for (i = start > 32768 ? start-32768 : 0; i < start && i < end-3; ++i)
+         stbiw__zhash_insert(hash_table, data+i, quality);
+   }
+
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
+   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
+   i=start;
+   while (i < end-3) {
+      int best=3;
       unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
+
+      if (rle) {
+         // just continue any run from the previous byte, or for RGBA, the previous pixel
+         if (i > 0) {
+            int d = stbiw__zlib_countm(data+i-1, data+i, end-i);
+            if (d >= best) best=d,bestloc=data+i-1;
          }
+         if (i > 3) {
+            int d = stbiw__zlib_countm(data+i-4, data+i, end-i);
+            if (d > best) best=d,bestloc=data+i-4;
+         }
+      } else {
+         // hash next 3 bytes of data to be compressed
+         int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+         unsigned char **hlist = hash_table[h];
+         int n = stbiw__sbcount(hlist);
+         for (j=0; j < n; ++j) {
+            if (hlist[j]-data > i-32768) { // if entry lies within window
+               int d = stbiw__zlib_countm(hlist[j], data+i, end-i);
+               if (d >= best) best=d,bestloc=hlist[j];
+            }
+         }
+         stbiw__zhash_insert(hash_table, data+i, quality);
       }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
 
-      if (bestloc) {
+      if (bestloc && !rle) {
          // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
+         int h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
+         unsigned char **hlist = hash_table[h];
+         int n = stbiw__sbcount(hlist);
          for (j=0; j < n; ++j) {
             if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+               int e = stbiw__zlib_countm(hlist[j], data+i+1, end-i-1);
                if (e > best) { // if next match is better, bail on current match
                   bestloc = NULL;
                   break;
@@ -3730,46 +5043,199 @@ unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_l
       }
    }
    // write out final bytes
-   for (;i < data_len; ++i)
+   for (;i < end; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!final)
+      stbiw__zlib_add(0,3); // BFINAL = 0, BTYPE = 0 -- stored
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!final) {
+      // empty stored block: LEN = 0, NLEN = ~0
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
+   if (hash_table) {
+      for (i=0; i < stbiw__ZHASH; ++i)
+         (void) stbiw__sbfree(hash_table[i]);
+      STBIW_FREE(hash_table);
+   }
+   return out;
+}
 
-   {
-      // compute adler32 on input
-      unsigned int i=0, s1=1, s2=0, blocklen = data_len % 5552;
-      int j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
-         s1 %= 65521, s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, (unsigned char) (s2 >> 8));
-      stbiw__sbpush(out, (unsigned char) s2);
-      stbiw__sbpush(out, (unsigned char) (s1 >> 8));
-      stbiw__sbpush(out, (unsigned char) s1);
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int i=0, s1=1, s2=0, blocklen = data_len % 5552;
+   int j=0;
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
+      s1 %= 65521, s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return (s2 << 16) | s1;
+}
+
+// adler32 of the concatenation of two pieces, given their adlers and the length of the second
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem = (unsigned int) len2 % 65521;
+   unsigned int s1 = adler1 & 0xffff;
+   unsigned int s2 = (rem * s1) % 65521;
+   s1 += (adler2 & 0xffff) + 65521 - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 65521*2) s2 -= 65521*2;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+
+static unsigned char *stbiw__zlib_finish(unsigned char *out, unsigned int adler, int *out_len)
+{
+   stbiw__sbpush(out, (unsigned char) (adler >> 24));
+   stbiw__sbpush(out, (unsigned char) (adler >> 16));
+   stbiw__sbpush(out, (unsigned char) (adler >> 8));
+   stbiw__sbpush(out, (unsigned char) adler);
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
 }
 
+static unsigned char *stbiw__zlib_compress(unsigned char *data, int data_len, int *out_len, int quality, int rle)
+{
+   unsigned char *out = NULL;
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate(out, data, 0, data_len, quality, rle, 1);
+   if (!out) return NULL;
+
+   return stbiw__zlib_finish(out, stbiw__adler32(data, data_len), out_len);
+}
+
+unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+   if (quality < 5) quality = 5;
+   return stbiw__zlib_compress(data, data_len, out_len, quality, 0);
+}
+
+static stbi_parallel_for_callback *stbiw__png_parallel_for = 0;
+static void *stbiw__png_parallel_user = 0;
+
+STBIDEF void stbi_set_write_png_parallel(stbi_parallel_for_callback *fn, void *user)
+{
+   stbiw__png_parallel_for = fn;
+   stbiw__png_parallel_user = user;
+}
+
+typedef struct
+{
+   unsigned char *data;
+   int data_len, quality, rle;
+   unsigned char **chunks;
+   unsigned int *adlers;
+} stbiw__zlib_parallel;
+
+static void stbiw__zlib_deflate_chunk(void *task_data, int k)
+{
+   stbiw__zlib_parallel *p = (stbiw__zlib_parallel *) task_data;
+   int start = k * stbiw__ZCHUNK;
+   int end = p->data_len - start > stbiw__ZCHUNK ? start + stbiw__ZCHUNK : p->data_len;
+   p->chunks[k] = stbiw__zlib_deflate(NULL, p->data, start, end, p->quality, p->rle, end == p->data_len);
+   p->adlers[k] = stbiw__adler32(p->data + start, end - start);
+}
+
+// as stbi_zlib_compress, but deflating stbiw__ZCHUNK pieces in parallel
+static unsigned char *stbiw__zlib_compress_parallel(unsigned char *data, int data_len, int *out_len, int quality, int rle)
+{
+   stbiw__zlib_parallel p;
+   int k, num_chunks = (data_len + stbiw__ZCHUNK-1) / stbiw__ZCHUNK, ok = 1;
+   unsigned char *out = NULL;
+   unsigned int adler = 1;
+
+   p.data = data;
+   p.data_len = data_len;
+   p.quality = quality;
+   p.rle = rle;
+   p.chunks = (unsigned char **) STBIW_MALLOC(num_chunks * (sizeof(unsigned char *) + sizeof(unsigned int)));
+   if (!p.chunks) return NULL;
+   p.adlers = (unsigned int *) (p.chunks + num_chunks);
+
+   stbiw__png_parallel_for(stbiw__png_parallel_user, stbiw__zlib_deflate_chunk, &p, num_chunks);
+
+   for (k=0; k < num_chunks; ++k)
+      if (!p.chunks[k]) ok = 0;
+
+   if (ok) {
+      int n = 2;
+      for (k=0; k < num_chunks; ++k)
+         n += stbiw__sbn(p.chunks[k]);
+      stbiw__sbmaybegrow(out, n + 4);
+      stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+      stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   }
+   for (k=0; k < num_chunks; ++k) {
+      if (ok) {
+         int len = k < num_chunks-1 ? stbiw__ZCHUNK : data_len - k * stbiw__ZCHUNK;
+         STBIW_MEMMOVE(out + stbiw__sbn(out), p.chunks[k], stbiw__sbn(p.chunks[k]));
+         stbiw__sbn(out) += stbiw__sbn(p.chunks[k]);
+         adler = stbiw__adler32_combine(adler, p.adlers[k], len);
+      }
+      (void) stbiw__sbfree(p.chunks[k]);
+   }
+   STBIW_FREE(p.chunks);
+   if (!ok) return NULL;
+
+   return stbiw__zlib_finish(out, adler, out_len);
+}
+
 unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
-   static unsigned int crc_table[256];
+   // precomputed rather than built on first use, so PNGs can be written from several threads at once
+   static const unsigned int crc_table[256] =
+   {
+      0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+      0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+      0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+      0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+      0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+      0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+      0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+      0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+      0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+      0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+      0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+      0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+      0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+      0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+      0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+      0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+      0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+      0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+      0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+      0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+      0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+      0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+      0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+      0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+      0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+      0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+      0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+      0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+      0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+      0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+      0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+      0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+   };
+
    unsigned int crc = ~0u;
-   int i,j;
-   if (crc_table[1] == 0)
-      for(i=0; i < 256; i++)
-         for (crc_table[i]=i, j=0; j < 8; ++j)
-            crc_table[i] = (crc_table[i] >> 1) ^ (crc_table[i] & 1 ? 0xedb88320 : 0);
+   int i;
    for (i=0; i < len; ++i)
       crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
    return ~crc;
@@ -3793,25 +5259,26 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return (unsigned char) c;
 }
 
-unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
-{
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int i,j,k,p,zlen;
+int stbi_write_png_compression_level = 8;
+int stbi_write_png_rle = 0;
+int stbi_write_force_png_filter = -1;
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
-
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+// filter rows [j0, j1) into filt, picking the filter for each row that
+// minimises the sum of absolute differences, unless one is forced
+static void stbiw__png_filter_rows(unsigned char *pixels, int stride_bytes, int x, int n, int j0, int j1, unsigned char *filt)
+{
+   int i,j,k,p;
+   for (j=j0; j < j1; ++j) {
       static int mapping[] = { 0,1,2,3,4 };
       static int firstmap[] = { 0,1,0,5,6 };
       int *mymap = j ? mapping : firstmap;
       int best = 0, bestval = 0x7fffffff;
-      for (p=0; p < 2; ++p) {
+      // try the filters in place, then redo the best
+      signed char *line_buffer = (signed char *) filt + j*(x*n+1) + 1;
+      p = 0;
+      if (stbi_write_force_png_filter >= 0 && stbi_write_force_png_filter < 5)
+         best = stbi_write_force_png_filter, p = 1;
+      for (; p < 2; ++p) {
          for (k= p?best:0; k < 5; ++k) {
             int type = mymap[k],est=0;
             unsigned char *z = pixels + stride_bytes*j;
@@ -3842,19 +5309,53 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
             if (est < bestval) { bestval = est; best = k; }
          }
       }
-      // when we get here, best contains the filter type, and line_buffer contains the data
+      // when we get here, best contains the filter type, and the row contains the data
       filt[j*(x*n+1)] = (unsigned char) best;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, 8); // increase 8 to get smaller but use more memory
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
+}
+
+typedef struct
+{
+   unsigned char *pixels, *filt;
+   int stride_bytes, x, y, n, rows_per_task;
+} stbiw__png_filter;
+
+static void stbiw__png_filter_band(void *task_data, int k)
+{
+   stbiw__png_filter *f = (stbiw__png_filter *) task_data;
+   int j0 = k * f->rows_per_task;
+   int j1 = f->y - j0 > f->rows_per_task ? j0 + f->rows_per_task : f->y;
+   stbiw__png_filter_rows(f->pixels, f->stride_bytes, f->x, f->n, j0, j1, f->filt);
+}
+
+// deflate the filtered data, in parallel if enabled
+static unsigned char *stbiw__png_compress(unsigned char *filt, int filt_len, int *zlen)
+{
+   if (stbiw__png_parallel_for && filt_len > stbiw__ZCHUNK)
+      return stbiw__zlib_compress_parallel(filt, filt_len, zlen, stbi_write_png_compression_level, stbi_write_png_rle);
+   return stbiw__zlib_compress(filt, filt_len, zlen, stbi_write_png_compression_level, stbi_write_png_rle);
+}
+
+// wrap compressed image data up as a png, with a PLTE chunk if palette is given
+static unsigned char *stbiw__png_write_chunks(int x, int y, int depth, int ctype, unsigned char *zlib, int zlen, const unsigned char *palette, int palette_len, int *out_len)
+{
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o;
+   int i, trns_len = 0, len;
+
+   if (palette)
+      for (i=0; i < palette_len; ++i)
+         if (palette[i*4+3] != 255)
+            trns_len = i+1;
 
    // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+   len = 8 + 12+13 + 12+zlen + 12;
+   if (palette)  len += 12 + palette_len*3;
+   if (trns_len) len += 12 + trns_len;
+
+   out = (unsigned char *) STBIW_MALLOC(len);
+   if (!out) { STBIW_FREE(zlib); return 0; }
+   *out_len = len;
 
    o=out;
    STBIW_MEMMOVE(o,sig,8); o+= 8;
@@ -3862,13 +5363,32 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    stbiw__wptag(o, "IHDR");
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
-   *o++ = 8;
-   *o++ = (unsigned char) ctype[n];
+   *o++ = (unsigned char) depth;
+   *o++ = (unsigned char) ctype;
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
 
+   if (palette) {
+      stbiw__wp32(o, palette_len*3);
+      stbiw__wptag(o, "PLTE");
+      for (i=0; i < palette_len; ++i) {
+         *o++ = palette[i*4+0];
+         *o++ = palette[i*4+1];
+         *o++ = palette[i*4+2];
+      }
+      stbiw__wpcrc(&o, palette_len*3);
+   }
+
+   if (trns_len) {
+      stbiw__wp32(o, trns_len);
+      stbiw__wptag(o, "tRNS");
+      for (i=0; i < trns_len; ++i)
+         *o++ = palette[i*4+3];
+      stbiw__wpcrc(&o, trns_len);
+   }
+
    stbiw__wp32(o, zlen);
    stbiw__wptag(o, "IDAT");
    STBIW_MEMMOVE(o, zlib, zlen);
@@ -3885,20 +5405,233 @@ unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, in
    return out;
 }
 
-int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char *filt, *zlib;
+   int zlen;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   if (stbiw__png_parallel_for && (x*n+1) * y > stbiw__ZCHUNK) {
+      stbiw__png_filter f;
+      f.pixels = pixels;
+      f.filt = filt;
+      f.stride_bytes = stride_bytes;
+      f.x = x;
+      f.y = y;
+      f.n = n;
+      f.rows_per_task = stbiw__ZCHUNK / (x*n+1) + 1;
+      stbiw__png_parallel_for(stbiw__png_parallel_user, stbiw__png_filter_band, &f, (y + f.rows_per_task-1) / f.rows_per_task);
+   } else
+      stbiw__png_filter_rows(pixels, stride_bytes, x, n, 0, y, filt);
+   zlib = stbiw__png_compress(filt, y*(x*n+1), &zlen);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   return stbiw__png_write_chunks(x, y, 8, ctype[n], zlib, zlen, NULL, 0, out_len);
+}
+
+unsigned char *stbi_write_png_indexed_to_mem(const unsigned char *indices, int x, int y, const unsigned char *palette, int palette_len, int *out_len)
+{
+   unsigned char *filt, *zlib;
+   int i, j, zlen, depth, bpl;
+
+   if (palette_len < 1 || palette_len > 256) return 0;
+
+   // use the smallest bit depth that holds every index
+   depth = palette_len <= 2 ? 1 : palette_len <= 4 ? 2 : palette_len <= 16 ? 4 : 8;
+   bpl = (x * depth + 7) / 8;
+
+   // filtering indices doesn't help, as neighbouring values needn't be similar
+   // colours, so every row just uses filter 0
+   filt = (unsigned char *) STBIW_MALLOC((bpl+1) * y); if (!filt) return 0;
+   for (j=0; j < y; ++j) {
+      unsigned char *line = filt + j*(bpl+1);
+      const unsigned char *row = indices + j*x;
+      line[0] = 0;
+      if (depth == 8)
+         STBIW_MEMMOVE(line + 1, row, x);
+      else {
+         memset(line + 1, 0, bpl);
+         for (i=0; i < x; ++i)
+            line[1 + i*depth/8] |= (unsigned char) (row[i] << (8 - depth - (i*depth & 7)));
+      }
+   }
+   zlib = stbiw__png_compress(filt, y*(bpl+1), &zlen);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   return stbiw__png_write_chunks(x, y, depth, 3, zlib, zlen, palette, palette_len, out_len);
+}
+
+static int stbiw__write_file(char const *filename, unsigned char *data, int len)
 {
    FILE *f;
-   int len;
-   unsigned char *png = stbi_write_png_to_mem((unsigned char *) data, stride_bytes, x, y, comp, &len);
-   if (!png) return 0;
+   if (!data) return 0;
    f = fopen(filename, "wb");
-   if (!f) { STBIW_FREE(png); return 0; }
-   fwrite(png, 1, len, f);
+   if (!f) { STBIW_FREE(data); return 0; }
+   fwrite(data, 1, len, f);
    fclose(f);
-   STBIW_FREE(png);
+   STBIW_FREE(data);
    return 1;
 }
 
+int stbi_write_png_indexed(char const *filename, int x, int y, const unsigned char *indices, const unsigned char *palette, int palette_len)
+{
+   int len;
+   unsigned char *png = stbi_write_png_indexed_to_mem(indices, x, y, palette, palette_len, &len);
+   return stbiw__write_file(filename, png, len);
+}
+
+int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   int len;
+   unsigned char *png = stbi_write_png_to_mem((unsigned char *) data, stride_bytes, x, y, comp, &len);
+   return stbiw__write_file(filename, png, len);
+}
+
+struct stbi_png_writer
+{
+   FILE *f;
+   int x, y, n, rows_written, ok;
+   unsigned char *pixels;        // the previous row, then the rows being written
+   unsigned char *filt;          // deflate window, then the rows being deflated
+   int capacity;                 // in rows, not counting the previous one
+   int window;                   // bytes of deflate window in use
+   unsigned int adler;
+};
+
+STBIDEF stbi_png_writer *stbi_write_png_begin(char const *filename, int x, int y, int n)
+{
+   unsigned char header[8 + 12+13], *o = header;
+   stbi_png_writer *w;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+
+   if (x <= 0 || y <= 0 || n < 1 || n > 4 || x > (0x7fffffff - 1) / n) return NULL;
+   w = (stbi_png_writer *) STBIW_MALLOC(sizeof(*w));
+   if (!w) return NULL;
+   memset(w, 0, sizeof(*w));
+   w->f = fopen(filename, "wb");
+   if (!w->f) { STBIW_FREE(w); return NULL; }
+   w->x = x;
+   w->y = y;
+   w->n = n;
+   w->ok = 1;
+   w->adler = 1;
+
+   stbiw__wpng4(o, 137,80,78,71); stbiw__wpng4(o, 13,10,26,10);
+   stbiw__wp32(o, 13);
+   stbiw__wptag(o, "IHDR");
+   stbiw__wp32(o, x);
+   stbiw__wp32(o, y);
+   *o++ = 8;
+   *o++ = (unsigned char) ctype[n];
+   *o++ = 0;
+   *o++ = 0;
+   *o++ = 0;
+   stbiw__wpcrc(&o, 13);
+   if (fwrite(header, 1, sizeof(header), w->f) != sizeof(header)) w->ok = 0;
+   return w;
+}
+
+STBIDEF int stbi_write_png_rows(stbi_png_writer *w, const void *rows, int count)
+{
+   int stride = w->x * w->n, filt_stride = stride + 1, base = filt_stride + 32768;
+   int len, keep, final;
+   unsigned char *zlib = NULL, *filt;
+
+   if (count > w->y - w->rows_written) count = w->y - w->rows_written;
+   if (!w->ok || count <= 0) return w->ok;
+
+   if (count > w->capacity) {
+      unsigned char *pixels, *filt_new;
+      if ((double) count * filt_stride > 0x7fffffff - base) return w->ok = 0;
+      pixels = (unsigned char *) STBIW_MALLOC((size_t) (count+1) * stride);
+      filt_new = (unsigned char *) STBIW_MALLOC(base + (size_t) count * filt_stride);
+      if (pixels && filt_new && w->rows_written) {
+         STBIW_MEMMOVE(pixels, w->pixels, stride);
+         STBIW_MEMMOVE(filt_new + base - w->window, w->filt + base - w->window, w->window);
+      }
+      STBIW_FREE(w->pixels);
+      STBIW_FREE(w->filt);
+      w->pixels = pixels;
+      w->filt = filt_new;
+      w->capacity = count;
+      if (!pixels || !filt_new) return w->ok = 0;
+   }
+
+   // rows after the first are filtered against the previous one, which is kept
+   // in front of them, and the filtered data follows the window to match against
+   STBIW_MEMMOVE(w->pixels + stride, rows, (size_t) count * stride);
+   filt = w->filt + base;
+   if (w->rows_written == 0)
+      stbiw__png_filter_rows(w->pixels + stride, stride, w->x, w->n, 0, count, filt);
+   else
+      stbiw__png_filter_rows(w->pixels, stride, w->x, w->n, 1, count+1, filt - filt_stride);
+
+   len = count * filt_stride;
+   final = w->rows_written + count == w->y;
+
+   // build the IDAT chunk in place, leaving room for its length and type
+   stbiw__sbmaybegrow(zlib, len/2 + 64);
+   stbiw__sbn(zlib) = 8;
+   if (w->rows_written == 0) {
+      stbiw__sbpush(zlib, 0x78);   // DEFLATE 32K window
+      stbiw__sbpush(zlib, 0x5e);   // FLEVEL = 1
+   }
+   zlib = stbiw__zlib_deflate(zlib, filt - w->window, w->window, w->window + len, stbi_write_png_compression_level, stbi_write_png_rle, final);
+   if (!zlib) return w->ok = 0;
+   w->adler = stbiw__adler32_combine(w->adler, stbiw__adler32(filt, len), len);
+   if (final) {
+      stbiw__sbpush(zlib, (unsigned char) (w->adler >> 24));
+      stbiw__sbpush(zlib, (unsigned char) (w->adler >> 16));
+      stbiw__sbpush(zlib, (unsigned char) (w->adler >> 8));
+      stbiw__sbpush(zlib, (unsigned char) w->adler);
+   }
+   {
+      int data_len = stbiw__sbn(zlib) - 8;
+      unsigned char *o;
+      stbiw__sbmaybegrow(zlib, 4);
+      o = zlib;
+      stbiw__wp32(o, data_len);
+      stbiw__wptag(o, "IDAT");
+      o += data_len;
+      stbiw__wpcrc(&o, data_len);
+      if (fwrite(zlib, 1, data_len + 12, w->f) != (size_t) data_len + 12) w->ok = 0;
+   }
+   (void) stbiw__sbfree(zlib);
+
+   // keep the last 32K as the window for the next band, and the last row for filtering
+   keep = w->window + len > 32768 ? 32768 : w->window + len;
+   STBIW_MEMMOVE(filt - keep, filt + len - keep, keep);
+   w->window = keep;
+   STBIW_MEMMOVE(w->pixels, w->pixels + (size_t) count * stride, stride);
+   w->rows_written += count;
+   return w->ok;
+}
+
+STBIDEF int stbi_write_png_end(stbi_png_writer *w)
+{
+   int ok;
+   if (!w) return 0;
+   ok = w->ok && w->rows_written == w->y;
+   if (ok) {
+      unsigned char iend[12], *o = iend;
+      stbiw__wp32(o, 0);
+      stbiw__wptag(o, "IEND");
+      stbiw__wpcrc(&o, 0);
+      ok = fwrite(iend, 1, sizeof(iend), w->f) == sizeof(iend);
+   }
+   ok = fclose(w->f) == 0 && ok;
+   STBIW_FREE(w->pixels);
+   STBIW_FREE(w->filt);
+   STBIW_FREE(w);
+   return ok;
+}
+
 #ifdef STB_UNDEF_CRT_SECURE_NO_WARNINGS
     #undef _CRT_SECURE_NO_WARNINGS
     #undef STB_UNDEF_CRT_SECURE_NO_WARNINGS
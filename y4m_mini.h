@@ -0,0 +1,171 @@
+//
+//  File:       y4m_mini.h
+//
+//  Function:   Reader and writer for YUV4MPEG2 (.y4m) streams, the simple
+//              uncompressed video format understood by ffmpeg, x264, etc.
+//              Frames are planar Y, Cb, Cr, with 8-bit samples.
+//
+//  Copyright:  Andrew Willmott 2018
+//
+//  Like qoi_mini.h, this includes the implementation, unless Y4M_DECLARATION
+//  is defined. 4:2:0 (all sitings), 4:2:2, 4:4:4 and 4:1:1 chroma are
+//  supported, but not monochrome or high bit depth streams.
+//
+
+#ifndef Y4M_MINI_H
+#define Y4M_MINI_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct y4m_info
+{
+   int  w, h;
+   int  chroma_shift_x;        // chroma is subsampled by 1 << shift horizontally and vertically
+   int  chroma_shift_y;
+   int  full_range;            // set if the stream is tagged XCOLORRANGE=FULL, otherwise it's video (limited) range
+   char header[256];           // stream header line, without the newline, so it can be written back out as-is
+} y4m_info;
+
+// reads the stream header from f, returning 1 if it's a supported Y4M stream
+extern int y4m_read_header(FILE *f, y4m_info *info);
+
+// returns the size of a frame's Y, Cb, and Cr planes, which are stored in that order
+extern size_t y4m_frame_size(const y4m_info *info);
+
+// reads the next frame into 'planes', returning 0 at the end of the stream or on error
+extern int y4m_read_frame(FILE *f, const y4m_info *info, unsigned char *planes);
+
+// write the stream header, and subsequent frames. Return 1 on success.
+extern int y4m_write_header(FILE *f, const y4m_info *info);
+extern int y4m_write_frame (FILE *f, const y4m_info *info, const unsigned char *planes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+
+#ifndef Y4M_DECLARATION
+
+#include <string.h>
+#include <stdlib.h>
+
+#define Y4M__MAX_DIM (1 << 16)
+
+// reads a line of up to size - 1 characters, dropping the newline. Returns 0 if it's missing.
+static int y4m__read_line(FILE *f, char *line, int size)
+{
+   int n = 0;
+
+   for (;;) {
+      int c = fgetc(f);
+
+      if (c == EOF)
+         return 0;
+      if (c == '\n')
+         break;
+      if (n >= size - 1)
+         return 0;
+
+      line[n++] = (char) c;
+   }
+
+   line[n] = 0;
+   return 1;
+}
+
+static int y4m__is(const char *token, size_t len, const char *name)
+{
+   return strlen(name) == len && strncmp(token, name, len) == 0;
+}
+
+int y4m_read_header(FILE *f, y4m_info *info)
+{
+   const char *p;
+
+   memset(info, 0, sizeof(*info));
+
+   if (!y4m__read_line(f, info->header, sizeof(info->header)) || strncmp(info->header, "YUV4MPEG2 ", 10) != 0)
+      return 0;
+
+   // default chroma is 4:2:0
+   info->chroma_shift_x = 1;
+   info->chroma_shift_y = 1;
+
+   for (p = info->header + 9; *p; ) {
+      const char *token = ++p;
+      size_t len;
+
+      while (*p && *p != ' ')
+         p++;
+
+      len = p - token;
+
+      switch (token[0]) {
+         case 'W':
+            info->w = atoi(token + 1);
+            break;
+         case 'H':
+            info->h = atoi(token + 1);
+            break;
+         case 'C':
+            // the 4:2:0 variants differ only in chroma siting
+            if (y4m__is(token, len, "C420") || y4m__is(token, len, "C420jpeg") || y4m__is(token, len, "C420mpeg2") || y4m__is(token, len, "C420paldv"))
+               info->chroma_shift_x = 1, info->chroma_shift_y = 1;
+            else if (y4m__is(token, len, "C422"))
+               info->chroma_shift_x = 1, info->chroma_shift_y = 0;
+            else if (y4m__is(token, len, "C444"))
+               info->chroma_shift_x = 0, info->chroma_shift_y = 0;
+            else if (y4m__is(token, len, "C411"))
+               info->chroma_shift_x = 2, info->chroma_shift_y = 0;
+            else
+               return 0;
+            break;
+         case 'X':
+            if (y4m__is(token, len, "XCOLORRANGE=FULL"))
+               info->full_range = 1;
+            break;
+      }
+   }
+
+   return 0 < info->w && info->w <= Y4M__MAX_DIM && 0 < info->h && info->h <= Y4M__MAX_DIM;
+}
+
+size_t y4m_frame_size(const y4m_info *info)
+{
+   size_t cw = (info->w + (1 << info->chroma_shift_x) - 1) >> info->chroma_shift_x;
+   size_t ch = (info->h + (1 << info->chroma_shift_y) - 1) >> info->chroma_shift_y;
+
+   return (size_t) info->w * info->h + 2 * cw * ch;
+}
+
+int y4m_read_frame(FILE *f, const y4m_info *info, unsigned char *planes)
+{
+   char line[256];
+   size_t size = y4m_frame_size(info);
+
+   // frame parameters, if any, are ignored
+   if (!y4m__read_line(f, line, sizeof(line)) || strncmp(line, "FRAME", 5) != 0 || (line[5] != 0 && line[5] != ' '))
+      return 0;
+
+   return fread(planes, 1, size, f) == size;
+}
+
+int y4m_write_header(FILE *f, const y4m_info *info)
+{
+   return fprintf(f, "%s\n", info->header) > 0;
+}
+
+int y4m_write_frame(FILE *f, const y4m_info *info, const unsigned char *planes)
+{
+   size_t size = y4m_frame_size(info);
+
+   return fputs("FRAME\n", f) >= 0 && fwrite(planes, 1, size, f) == size;
+}
+
+#endif